@@ -371,6 +371,24 @@ attrbuf_append_n(stringbuf_t * sb, attrbuf_t * ab, const char *s, ssize_t len,
 	return sbuf_append_n(sb, s, len);
 }
 
+// note: must allow ab == NULL!
+rpl_private ssize_t
+attrbuf_append_attrs_n(stringbuf_t * sb, attrbuf_t * ab, const char *s,
+                       const attr_t * attrs, ssize_t len)
+{
+	if (s == NULL || len <= 0)
+		return sbuf_len(sb);
+	if (ab != NULL) {
+		if (!attrbuf_ensure_extra(ab, len))
+			return sbuf_len(sb);
+		for (ssize_t i = 0; i < len; i++) {
+			ab->attrs[ab->count + i] = (attrs == NULL ? attr_none() : attrs[i]);
+		}
+		ab->count += len;
+	}
+	return sbuf_append_n(sb, s, len);
+}
+
 rpl_private attr_t
 attrbuf_attr_at(attrbuf_t * ab, ssize_t pos)
 {
@@ -54,6 +54,10 @@ rpl_private ssize_t attrbuf_len(attrbuf_t * ab);    // ab can be NULL
 rpl_private const attr_t *attrbuf_attrs(attrbuf_t * ab, ssize_t expected_len);
 rpl_private ssize_t attrbuf_append_n(stringbuf_t * sb, attrbuf_t * ab,
                                      const char *s, ssize_t len, attr_t attr);
+/// Append text that was rendered before, with its attributes `attrs` (may be NULL)
+rpl_private ssize_t attrbuf_append_attrs_n(stringbuf_t * sb, attrbuf_t * ab,
+                                           const char *s, const attr_t * attrs,
+                                           ssize_t len);
 
 rpl_private void attrbuf_set_at(attrbuf_t * ab, ssize_t pos, ssize_t count,
                                 attr_t attr);
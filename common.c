@@ -440,3 +440,62 @@ mem_strndup(alloc_t * mem, const char *s, ssize_t n)
 	p[i] = 0;
 	return p;
 }
+
+//-------------------------------------------------------------
+// Hashing
+//-------------------------------------------------------------
+
+#define RPL_FNV_OFFSET  (14695981039346656037ULL)
+#define RPL_FNV_PRIME   (1099511628211ULL)
+
+rpl_private uint64_t
+rpl_hash(const char *s)
+{
+	uint64_t hash = RPL_FNV_OFFSET;
+	for (const uint8_t * p = (const uint8_t *)s; *p != 0; p++) {
+		hash = (hash ^ *p) * RPL_FNV_PRIME;
+	}
+	return hash;
+}
+
+rpl_private uint64_t
+rpl_hash_nocase(const char *s)
+{
+	uint64_t hash = RPL_FNV_OFFSET;
+	for (; *s != 0; s++) {
+		hash = (hash ^ (uint8_t) rpl_tolower(*s)) * RPL_FNV_PRIME;
+	}
+	return hash;
+}
+
+rpl_private ssize_t
+rpl_hset_find(const ssize_t * set, ssize_t len, const char *s, uint64_t hash,
+              rpl_hset_eq_fun_t * eq, const void *arg)
+{
+	ssize_t mask = len - 1;
+	ssize_t i = (ssize_t) (hash & (uint64_t) mask);
+	while (set[i] != 0 && !eq(arg, set[i] - 1, s, hash)) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+rpl_private bool
+rpl_hset_reset(alloc_t * mem, ssize_t ** set, ssize_t * len, ssize_t count)
+{
+	ssize_t newlen = (*len <= 0 ? 64 : *len);
+	while (newlen <= 2 * count) {
+		newlen *= 2;
+	}
+	if (newlen == *len) {
+		memset(*set, 0, to_size_t(newlen) * sizeof(ssize_t));
+		return true;
+	}
+	ssize_t *newset = mem_zalloc_tp_n(mem, ssize_t, newlen);
+	if (newset == NULL)
+		return false;
+	mem_free(mem, *set);
+	*set = newset;
+	*len = newlen;
+	return true;
+}
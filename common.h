@@ -179,4 +179,27 @@ rpl_private char *mem_strndup(alloc_t * mem, const char *s, ssize_t n);
 #define mem_zalloc_tp_n(mem,tp,n)    (tp*)mem_zalloc(mem,(n)*ssizeof(tp))
 #define mem_realloc_tp(mem,tp,p,n)   (tp*)mem_realloc(mem,p,(n)*ssizeof(tp))
 
+//-------------------------------------------------------------
+// Hashing
+//-------------------------------------------------------------
+
+/// 64-bit FNV-1a hash of a string
+rpl_private uint64_t rpl_hash(const char *s);
+/// Hash of a string with its ASCII letters in lower case
+rpl_private uint64_t rpl_hash_nocase(const char *s);
+
+/// A hash set of indices (of strings) uses open addressing: `len` slots (a
+/// power of 2) that hold `index + 1`, or 0 if empty. `eq` tells if the item
+/// at `index` is `s` (with hash `hash`).
+typedef bool (rpl_hset_eq_fun_t) (const void *arg, ssize_t index,
+                                  const char *s, uint64_t hash);
+/// Slot of `s` in the set, or the empty slot where it belongs
+rpl_private ssize_t rpl_hset_find(const ssize_t * set, ssize_t len,
+                                  const char *s, uint64_t hash,
+                                  rpl_hset_eq_fun_t * eq, const void *arg);
+/// Clear the set and make it large enough to stay at most half full with
+/// `count` indices (the indices must be inserted again)
+rpl_private bool rpl_hset_reset(alloc_t * mem, ssize_t ** set, ssize_t * len,
+                                ssize_t count);
+
 #endif                          // RPL_COMMON_H
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "repline.h"
 #include "common.h"
@@ -14,7 +15,6 @@
 #include <stdlib.h>
 
 typedef enum file_type_e {
-	// must follow BSD style LSCOLORS order
 	FT_DEFAULT = 0,
 	FT_DIR,
 	FT_SYM,
@@ -31,34 +31,47 @@ typedef enum file_type_e {
 	FT_LAST
 } file_type_t;
 
-static int cli_color;           // 1 enabled, 0 not initialized, -1 disabled
-static const char *lscolors = "exfxcxdxbxegedabagacad"; // default BSD setting
-static const char *ls_colors;
+//-------------------------------------------------------------
+// LS colors
+//
+// LS_COLORS (GNU) or LSCOLORS (BSD) is parsed once into the
+// style of every file type and a hash table of the file name
+// suffixes (`*.ext=`), so styling a name takes a lookup per
+// extension instead of a scan of the environment string.
+//-------------------------------------------------------------
+
+// GNU keys of the file types (in `file_type_t` order)
 static const char *ls_colors_names[] =
-    { "no=", "di=", "ln=", "so=", "pi=", "bd=", "cd=", "su=", "sg=", "tw=",
-"ow=", "st=", "ex=", NULL };
+    { "no", "di", "ln", "so", "pi", "bd", "cd", "su", "sg", "tw",
+"ow", "st", "ex", NULL };
+
+// index of the file types in BSD LSCOLORS (-1 if it has none)
+static const int lscolors_index[FT_LAST] =
+    { -1, 0, 1, 2, 3, 5, 6, 7, 8, 9, 10, 0, 4 };
+
+typedef struct ls_suffix_s {
+	const char *suffix;
+	const char *style;
+} ls_suffix_t;
+
+typedef struct ls_colors_s {
+	alloc_t *mem;
+	const char *styles[FT_LAST];    // bbcode that starts the style of a file type (or NULL)
+	ls_suffix_t *suffixes;      // all suffixes in `LS_COLORS` order
+	ssize_t suffixes_count;
+	ssize_t *set;               // hash set of the suffixes that start with a dot: index + 1
+	ssize_t set_len;
+	ssize_t *others;            // indices of the other suffixes (like `*~`)
+	ssize_t others_count;
+	char *buf;                  // the suffixes and styles
+	ssize_t buf_used;
+} ls_colors_t;
 
 static bool
-ls_colors_init(void)
+ls_colors_enabled(void)
 {
-	if (cli_color != 0)
-		return (cli_color >= 1);
-	// colors enabled?
 	const char *s = getenv("CLICOLOR");
-	if (s == NULL || (strcmp(s, "1") != 0 && strcmp(s, "") != 0)) {
-		cli_color = -1;
-		return false;
-	}
-	cli_color = 1;
-	s = getenv("LS_COLORS");
-	if (s != NULL) {
-		ls_colors = s;
-	}
-	s = getenv("LSCOLORS");
-	if (s != NULL) {
-		lscolors = s;
-	}
-	return true;
+	return (s != NULL && (strcmp(s, "1") == 0 || strcmp(s, "") == 0));
 }
 
 static bool
@@ -69,34 +82,6 @@ ls_valid_esc(ssize_t c)
 	        || (c >= 90 && c <= 97) || (c >= 100 && c <= 107));
 }
 
-static bool
-ls_colors_from_key(stringbuf_t * sb, const char *key)
-{
-	// find key
-	ssize_t keylen = rpl_strlen(key);
-	if (keylen <= 0)
-		return false;
-	const char *p = strstr(ls_colors, key);
-	if (p == NULL)
-		return false;
-	p += keylen;
-	if (key[keylen - 1] != '=') {
-		if (*p != '=')
-			return false;
-		p++;
-	}
-	ssize_t len = 0;
-	while (p[len] != 0 && p[len] != ':') {
-		len++;
-	}
-	if (len <= 0)
-		return false;
-	sbuf_append(sb, "[ansi-sgr=\"");
-	sbuf_append_n(sb, p, len);
-	sbuf_append(sb, "\"]");
-	return true;
-}
-
 static int
 ls_colors_from_char(char c)
 {
@@ -111,51 +96,204 @@ ls_colors_from_char(char c)
 }
 
 static bool
-ls_colors_append(stringbuf_t * sb, file_type_t ft, const char *ext)
+ls_suffix_eq(const void *arg, ssize_t index, const char *suffix, uint64_t hash)
+{
+	rpl_unused(hash);
+	return (rpl_stricmp(((const ls_colors_t *)arg)->suffixes[index].suffix, suffix) == 0);
+}
+
+// copy `n` bytes of `s` into the buffer (0 terminated)
+static const char *
+ls_colors_save(ls_colors_t * lc, const char *s, ssize_t n)
+{
+	char *p = lc->buf + lc->buf_used;
+	memcpy(p, s, to_size_t(n));
+	p[n] = 0;
+	lc->buf_used += n + 1;
+	return p;
+}
+
+// save the bbcode that starts a GNU style (like `01;34`)
+static const char *
+ls_colors_save_sgr(ls_colors_t * lc, const char *sgr, ssize_t n)
+{
+	if (n <= 0)
+		return NULL;
+	for (ssize_t i = 0; i < n; i++) {
+		if (!((sgr[i] >= '0' && sgr[i] <= '9') || sgr[i] == ';'))
+			return NULL;        // like `ln=target`
+	}
+	char *p = lc->buf + lc->buf_used;
+	lc->buf_used += snprintf(p, to_size_t(n + 14), "[ansi-sgr=\"%.*s\"]", (int)n, sgr) + 1;
+	return p;
+}
+
+static void
+ls_colors_add_suffix(ls_colors_t * lc, const char *suffix, const char *style)
+{
+	ssize_t index = lc->suffixes_count++;
+	lc->suffixes[index].suffix = suffix;
+	lc->suffixes[index].style = style;
+	if (suffix[0] != '.') {
+		lc->others[lc->others_count++] = index;
+	} else {
+		// a later entry replaces an earlier one
+		lc->set[rpl_hset_find(lc->set, lc->set_len, suffix, rpl_hash_nocase(suffix),
+		                      &ls_suffix_eq, lc)] = index + 1;
+	}
+}
+
+// parse the GNU `LS_COLORS`: `key=style` entries separated by colons
+static bool
+ls_colors_parse_gnu(ls_colors_t * lc, const char *s)
 {
-	if (!ls_colors_init())
+	ssize_t len = rpl_strlen(s);
+	ssize_t entries = 1;
+	for (ssize_t i = 0; i < len; i++) {
+		if (s[i] == ':')
+			entries++;
+	}
+	lc->buf = mem_malloc_tp_n(lc->mem, char, 2 * len + 16 * entries);
+	lc->suffixes = mem_malloc_tp_n(lc->mem, ls_suffix_t, entries);
+	lc->others = mem_malloc_tp_n(lc->mem, ssize_t, entries);
+	if (lc->buf == NULL || lc->suffixes == NULL || lc->others == NULL
+	    || !rpl_hset_reset(lc->mem, &lc->set, &lc->set_len, entries))
 		return false;
-	if (ls_colors != NULL) {
-		// GNU style
-		if (ft == FT_DEFAULT && ext != NULL) {
-			// first try extension match
-			if (ls_colors_from_key(sb, ext))
-				return true;
-		}
-		if (ft >= FT_DEFAULT && ft < FT_LAST) {
-			// then a filetype match
-			const char *key = ls_colors_names[ft];
-			if (ls_colors_from_key(sb, key))
-				return true;
+	for (const char *p = s; *p != 0;) {
+		const char *end = strchr(p, ':');
+		if (end == NULL)
+			end = s + len;
+		const char *eq = memchr(p, '=', to_size_t(end - p));
+		if (eq != NULL) {
+			const char *style = ls_colors_save_sgr(lc, eq + 1, end - eq - 1);
+			if (p[0] == '*' && eq - p > 1) {
+				ls_colors_add_suffix(lc, ls_colors_save(lc, p + 1, eq - p - 1), style);
+			} else if (eq - p == 2 && strncmp(p, "fi", 2) == 0) {
+				lc->styles[FT_DEFAULT] = style;     // regular file
+			} else if (eq - p == 2) {
+				for (ssize_t ft = 0; ls_colors_names[ft] != NULL; ft++) {
+					if (strncmp(p, ls_colors_names[ft], 2) == 0)
+						lc->styles[ft] = style;
+				}
+			}
 		}
-	} else if (lscolors != NULL) {
-		// BSD style
+		p = (*end == 0 ? end : end + 1);
+	}
+	// directories without their own style look like directories
+	for (ssize_t ft = FT_DIR_OW_STICKY; ft <= FT_DIR_STICKY; ft++) {
+		if (lc->styles[ft] == NULL)
+			lc->styles[ft] = lc->styles[FT_DIR];
+	}
+	return true;
+}
+
+// parse the BSD `LSCOLORS`: foreground and background letters per file type
+static bool
+ls_colors_parse_bsd(ls_colors_t * lc, const char *s)
+{
+	ssize_t len = rpl_strlen(s);
+	lc->buf = mem_malloc_tp_n(lc->mem, char, FT_LAST * 48);
+	if (lc->buf == NULL)
+		return false;
+	for (ssize_t ft = 0; ft < FT_LAST; ft++) {
+		int i = lscolors_index[ft];
 		char fg = 'x';
 		char bg = 'x';
-		if (rpl_strlen(lscolors) > (2 * (ssize_t) ft) + 1) {
-			fg = lscolors[2 * ft];
-			bg = lscolors[2 * ft + 1];
+		if (i >= 0 && len > 2 * i + 1) {
+			fg = s[2 * i];
+			bg = s[2 * i + 1];
 		}
-		sbuf_appendf(sb, "[ansi-color=%d ansi-bgcolor=%d]",
-		             ls_colors_from_char(fg), ls_colors_from_char(bg));
-		return true;
+		char *p = lc->buf + lc->buf_used;
+		lc->buf_used += snprintf(p, 48, "[ansi-color=%d ansi-bgcolor=%d]",
+		                         ls_colors_from_char(fg), ls_colors_from_char(bg)) + 1;
+		lc->styles[ft] = p;
 	}
-	return false;
+	return true;
 }
 
 static void
-ls_colorize(bool no_lscolor, stringbuf_t * sb, file_type_t ft, const char *name,
-            const char *ext, char dirsep)
+ls_colors_free(ls_colors_t * lc)
+{
+	if (lc == NULL)
+		return;
+	mem_free(lc->mem, lc->suffixes);
+	mem_free(lc->mem, lc->set);
+	mem_free(lc->mem, lc->others);
+	mem_free(lc->mem, lc->buf);
+	mem_free(lc->mem, lc);
+}
+
+// parse the file colors of the environment; returns NULL if `CLICOLOR` is not set
+static ls_colors_t *
+ls_colors_new(alloc_t * mem)
+{
+	if (!ls_colors_enabled())
+		return NULL;
+	ls_colors_t *lc = mem_zalloc_tp(mem, ls_colors_t);
+	if (lc == NULL)
+		return NULL;
+	lc->mem = mem;
+	const char *s = getenv("LS_COLORS");
+	bool ok;
+	if (s != NULL) {
+		ok = ls_colors_parse_gnu(lc, s);
+	} else {
+		s = getenv("LSCOLORS");
+		ok = ls_colors_parse_bsd(lc, (s != NULL ? s : "exfxcxdxbxegedabagacad"));   // default BSD setting
+	}
+	if (!ok) {
+		ls_colors_free(lc);
+		return NULL;
+	}
+	return lc;
+}
+
+// do the styles depend on the mode bits (executable, sticky, ...) of a file?
+static bool
+ls_colors_need_mode(const ls_colors_t * lc)
 {
-	bool close = (no_lscolor ? false : ls_colors_append(sb, ft, ext));
-	sbuf_append(sb, "[!pre]");
-	sbuf_append(sb, name);
-	if (dirsep != 0)
-		sbuf_append_char(sb, dirsep);
-	sbuf_append(sb, "[/pre]");
-	if (close) {
-		sbuf_append(sb, "[/]");
+	if (lc == NULL)
+		return false;
+	for (ssize_t ft = FT_SETUID; ft < FT_LAST; ft++) {
+		const char *base = (ft == FT_SETUID || ft == FT_SETGID || ft == FT_EXE
+		                    ? lc->styles[FT_DEFAULT] : lc->styles[FT_DIR]);
+		if (lc->styles[ft] != NULL
+		    && (base == NULL || strcmp(lc->styles[ft], base) != 0))
+			return true;
 	}
+	return false;
+}
+
+// The bbcode that starts the style of file `name` of type `ft` (or NULL).
+// Regular files (and executables without a style) are styled by the suffix
+// that matches, where the last matching entry of `LS_COLORS` wins as with ls.
+static const char *
+ls_colors_style(const ls_colors_t * lc, const char *name, file_type_t ft)
+{
+	if (lc == NULL)
+		return NULL;
+	if (lc->styles[ft] == NULL
+	    && (ft == FT_SETUID || ft == FT_SETGID || ft == FT_EXE))
+		ft = FT_DEFAULT;
+	if (ft != FT_DEFAULT || lc->suffixes_count <= 0)
+		return lc->styles[ft];
+	ssize_t best = -1;
+	for (const char *dot = strchr(name, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+		ssize_t j = rpl_hset_find(lc->set, lc->set_len, dot, rpl_hash_nocase(dot),
+		                          &ls_suffix_eq, lc);
+		if (lc->set[j] - 1 > best)
+			best = lc->set[j] - 1;
+	}
+	ssize_t len = rpl_strlen(name);
+	for (ssize_t i = lc->others_count - 1; i >= 0 && lc->others[i] > best; i--) {
+		const char *suffix = lc->suffixes[lc->others[i]].suffix;
+		ssize_t n = rpl_strlen(suffix);
+		if (n <= len && strcmp(name + len - n, suffix) == 0) {
+			best = lc->others[i];
+			break;
+		}
+	}
+	return (best >= 0 ? lc->suffixes[best].style : lc->styles[ft]);
 }
 
 #if defined(_WIN32)
@@ -186,6 +324,15 @@ os_get_filetype(const char *cpath)
 	return FT_DEFAULT;
 }
 
+static bool
+os_is_executable(const char *cpath)
+{
+	struct _stat64 st = { 0 };
+	if (_stat64(cpath, &st) != 0)
+		return false;
+	return ((st.st_mode & _S_IFREG) != 0 && (st.st_mode & _S_IEXEC) != 0);
+}
+
 #define dir_cursor intptr_t
 #define dir_entry  struct __finddata64_t
 
@@ -220,6 +367,47 @@ os_direntry_name(dir_entry * entry)
 	return entry->name;
 }
 
+static bool
+os_direntry_is_dir(const char *cpath, dir_entry * entry)
+{
+	rpl_unused(cpath);
+	return ((entry->attrib & _A_SUBDIR) != 0);
+}
+
+static file_type_t
+os_direntry_filetype(const char *cpath, dir_entry * entry, bool need_mode)
+{
+	if ((entry->attrib & _A_SUBDIR) != 0)
+		return FT_DIR;
+	if (!need_mode)
+		return FT_DEFAULT;
+	char full_path[_MAX_PATH];
+	if (snprintf(full_path, sizeof(full_path), "%s%s", cpath,
+	             entry->name) >= (int)sizeof(full_path))
+		return FT_DEFAULT;
+	return os_get_filetype(full_path);
+}
+
+typedef struct dir_stamp_s {
+	long long dev;
+	long long ino;
+	long long mtime;
+	long long ctime;
+} dir_stamp_t;
+
+static bool
+os_dir_stamp(const char *cpath, dir_stamp_t * stamp)
+{
+	struct _stat64 st = { 0 };
+	if (_stat64(cpath, &st) != 0)
+		return false;
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->mtime = st.st_mtime;
+	stamp->ctime = st.st_ctime;
+	return true;
+}
+
 static bool
 os_path_is_absolute(const char *path)
 {
@@ -243,6 +431,11 @@ rpl_dirsep(void)
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX  (4096)
+#endif
 
 static bool
 os_is_dir(const char *cpath)
@@ -272,13 +465,9 @@ os_get_filetype(const char *cpath)
 	case S_IFBLK:
 		return FT_BLOCK;
 	case S_IFDIR:{
-			if ((st.st_mode & S_ISUID) != 0)
-				return FT_SETUID;
-			if ((st.st_mode & S_ISGID) != 0)
-				return FT_SETGID;
-			if ((st.st_mode & S_IWGRP) != 0 && (st.st_mode & S_ISVTX) != 0)
+			if ((st.st_mode & S_IWOTH) != 0 && (st.st_mode & S_ISVTX) != 0)
 				return FT_DIR_OW_STICKY;
-			if ((st.st_mode & S_IWGRP))
+			if ((st.st_mode & S_IWOTH))
 				return FT_DIR_OW;
 			if ((st.st_mode & S_ISVTX))
 				return FT_DIR_STICKY;
@@ -286,13 +475,27 @@ os_get_filetype(const char *cpath)
 		}
 	case S_IFREG:
 	default:{
-			if ((st.st_mode & S_IXUSR) != 0)
+			if ((st.st_mode & S_ISUID) != 0)
+				return FT_SETUID;
+			if ((st.st_mode & S_ISGID) != 0)
+				return FT_SETGID;
+			if ((st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0)
 				return FT_EXE;
 			return FT_DEFAULT;
 		}
 	}
 }
 
+static bool
+os_is_executable(const char *cpath)
+{
+	struct stat st;
+	if (stat(cpath, &st) != 0)
+		return false;
+	return (S_ISREG(st.st_mode)
+	        && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0);
+}
+
 #define dir_cursor DIR*
 #define dir_entry  struct dirent*
 
@@ -328,6 +531,84 @@ os_direntry_name(dir_entry * entry)
 	return (*entry)->d_name;
 }
 
+/// Is the entry a directory (or a link to one)? Uses `d_type` where the
+/// platform provides it and only falls back to `stat` for links and file
+/// systems that do not fill it in.
+static bool
+os_direntry_is_dir(const char *cpath, dir_entry * entry)
+{
+#ifdef DT_UNKNOWN
+	unsigned char type = (*entry)->d_type;
+	if (type == DT_DIR)
+		return true;
+	if (type != DT_UNKNOWN && type != DT_LNK)
+		return false;
+#endif
+	char full_path[PATH_MAX];
+	if (snprintf(full_path, sizeof(full_path), "%s%s", cpath,
+	             (*entry)->d_name) >= (int)sizeof(full_path))
+		return false;
+	return os_is_dir(full_path);
+}
+
+/// File type of an entry for its LS color. The type comes from `d_type` where
+/// the platform provides it; the file is only `lstat`-ed if the type is unknown,
+/// or if `need_mode` and the type alone does not decide (executables, sticky
+/// directories, ...).
+static file_type_t
+os_direntry_filetype(const char *cpath, dir_entry * entry, bool need_mode)
+{
+#ifdef DT_UNKNOWN
+	switch ((*entry)->d_type) {
+	case DT_LNK:
+		return FT_SYM;
+	case DT_SOCK:
+		return FT_SOCK;
+	case DT_FIFO:
+		return FT_PIPE;
+	case DT_BLK:
+		return FT_BLOCK;
+	case DT_CHR:
+		return FT_CHAR;
+	case DT_DIR:
+		if (!need_mode)
+			return FT_DIR;
+		break;
+	case DT_REG:
+		if (!need_mode)
+			return FT_DEFAULT;
+		break;
+	default:
+		break;
+	}
+#endif
+	char full_path[PATH_MAX];
+	if (snprintf(full_path, sizeof(full_path), "%s%s", cpath,
+	             (*entry)->d_name) >= (int)sizeof(full_path))
+		return FT_DEFAULT;
+	return os_get_filetype(full_path);
+}
+
+typedef struct dir_stamp_s {
+	long long dev;
+	long long ino;
+	long long mtime;
+	long long ctime;
+} dir_stamp_t;
+
+static bool
+os_dir_stamp(const char *cpath, dir_stamp_t * stamp)
+{
+	struct stat st;
+	if (stat(cpath, &st) != 0)
+		return false;
+	stamp->dev = (long long)st.st_dev;
+	stamp->ino = (long long)st.st_ino;
+	stamp->mtime = (long long)st.st_mtime;
+	stamp->ctime = (long long)st.st_ctime;
+	return true;
+}
+
 static bool
 os_path_is_absolute(const char *path)
 {
@@ -341,6 +622,660 @@ rpl_dirsep(void)
 }
 #endif
 
+//-------------------------------------------------------------
+// Directory listing cache
+//
+// Filename completion runs on every TAB; instead of reading the
+// directory (and stat-ing every match) each time, we keep the
+// names and directory flags of the last few directories and
+// only re-read one when its identity or times change. If file
+// names are colored, the LS color of every entry is looked up
+// once when the directory is read and kept with its name.
+//-------------------------------------------------------------
+
+#define RPL_DIRCACHE_SLOTS  (8)
+
+typedef struct dirlisting_entry_s {
+	ssize_t name;               // offset in `names`
+	bool is_dir;
+	const char *style;          // start of its LS color (NULL if none)
+} dirlisting_entry_t;
+
+struct dirlisting_s {
+	char *path;                 // directory as passed to `os_findfirst` (NULL if unused)
+	dir_stamp_t stamp;          // directory stamp at the time of listing
+	time_t listed_at;           // when the listing was read
+	ssize_t count;
+	ssize_t len;
+	dirlisting_entry_t *entries;
+	char *names;                // all names, each 0 terminated
+	ssize_t names_used;
+	ssize_t names_len;
+};
+
+struct dircache_s {
+	alloc_t *mem;
+	ssize_t next;               // next slot to reuse (round robin)
+	dirlisting_t slots[RPL_DIRCACHE_SLOTS];
+	ls_colors_t *colors;        // NULL if file names are not colored
+	bool need_mode;             // do the colors need the mode bits of files?
+};
+
+rpl_private dircache_t *
+dircache_new(alloc_t * mem)
+{
+	dircache_t *dc = mem_zalloc_tp(mem, dircache_t);
+	if (dc == NULL)
+		return NULL;
+	dc->mem = mem;
+	dc->colors = ls_colors_new(mem);
+	dc->need_mode = ls_colors_need_mode(dc->colors);
+	return dc;
+}
+
+static void
+dirlisting_done(alloc_t * mem, dirlisting_t * dl)
+{
+	mem_free(mem, dl->path);
+	mem_free(mem, dl->entries);
+	mem_free(mem, dl->names);
+	memset(dl, 0, sizeof(*dl));
+}
+
+rpl_private void
+dircache_free(dircache_t * dc)
+{
+	if (dc == NULL)
+		return;
+	for (ssize_t i = 0; i < RPL_DIRCACHE_SLOTS; i++) {
+		dirlisting_done(dc->mem, &dc->slots[i]);
+	}
+	ls_colors_free(dc->colors);
+	mem_free(dc->mem, dc);
+}
+
+static bool
+dirlisting_push(alloc_t * mem, dirlisting_t * dl, const char *name,
+                bool is_dir, const char *style)
+{
+	if (dl->count >= dl->len) {
+		ssize_t newlen = (dl->len <= 0 ? 64 : dl->len * 2);
+		dirlisting_entry_t *newentries =
+		    mem_realloc_tp(mem, dirlisting_entry_t, dl->entries, newlen);
+		if (newentries == NULL)
+			return false;
+		dl->entries = newentries;
+		dl->len = newlen;
+	}
+	ssize_t n = rpl_strlen(name) + 1;
+	if (dl->names_used + n > dl->names_len) {
+		ssize_t newlen = (dl->names_len <= 0 ? 1024 : dl->names_len * 2);
+		while (newlen < dl->names_used + n) {
+			newlen *= 2;
+		}
+		char *newnames = mem_realloc_tp(mem, char, dl->names, newlen);
+		if (newnames == NULL)
+			return false;
+		dl->names = newnames;
+		dl->names_len = newlen;
+	}
+	memcpy(dl->names + dl->names_used, name, n);
+	dl->entries[dl->count].name = dl->names_used;
+	dl->entries[dl->count].is_dir = is_dir;
+	dl->entries[dl->count].style = style;
+	dl->names_used += n;
+	dl->count++;
+	return true;
+}
+
+// read directory `path` into `dl`, calling `fun` for each entry as it is read
+static bool
+dirlisting_read(dircache_t * dc, dirlisting_t * dl, const char *path,
+                dircache_fun_t * fun, void *arg)
+{
+	alloc_t *mem = dc->mem;
+	dl->count = 0;
+	dl->names_used = 0;
+	dl->listed_at = time(NULL);
+	dir_cursor d = 0;
+	dir_entry entry;
+	bool ok = true;
+	if (!os_findfirst(mem, path, &d, &entry))
+		return false;
+	do {
+		const char *fname = os_direntry_name(&entry);
+		if (fname == NULL || strcmp(fname, ".") == 0
+		    || strcmp(fname, "..") == 0)
+			continue;
+		bool is_dir = os_direntry_is_dir(path, &entry);
+		const char *style = NULL;
+		if (dc->colors != NULL) {
+			file_type_t ft = os_direntry_filetype(path, &entry, dc->need_mode);
+			style = ls_colors_style(dc->colors, fname, ft);
+		}
+		ok = dirlisting_push(mem, dl, fname, is_dir, style)
+		    && fun(fname, is_dir, style, arg);
+	} while (ok && os_findnext(d, &entry));
+	os_findclose(d);
+	return ok;
+}
+
+static bool
+dir_stamp_equal(const dir_stamp_t * a, const dir_stamp_t * b)
+{
+	return (a->dev == b->dev && a->ino == b->ino && a->mtime == b->mtime
+	        && a->ctime == b->ctime);
+}
+
+/// Call `fun` for each entry of directory `path` (which ends in a separator),
+/// reading the directory only if it is not cached or changed since. Directory
+/// times have a resolution of a second, so a listing read in the same second as
+/// the last change is not trusted and read again on the next call.
+/// If `fun` returns false, the iteration stops (and a partial listing is not
+/// cached). Returns false if the directory could not be read or was stopped.
+rpl_private bool
+dircache_for_each(dircache_t * dc, const char *path, dircache_fun_t * fun,
+                  void *arg)
+{
+	dir_stamp_t stamp;
+	if (dc == NULL || path == NULL || !os_dir_stamp(path, &stamp))
+		return false;
+	dirlisting_t *dl = NULL;
+	for (ssize_t i = 0; i < RPL_DIRCACHE_SLOTS; i++) {
+		if (dc->slots[i].path != NULL && strcmp(dc->slots[i].path, path) == 0) {
+			dl = &dc->slots[i];
+			break;
+		}
+	}
+	if (dl != NULL && dir_stamp_equal(&dl->stamp, &stamp)
+	    && stamp.mtime < (long long)dl->listed_at
+	    && stamp.ctime < (long long)dl->listed_at) {
+		for (ssize_t i = 0; i < dl->count; i++) {
+			if (!fun(dl->names + dl->entries[i].name, dl->entries[i].is_dir,
+			         dl->entries[i].style, arg))
+				return false;
+		}
+		return true;
+	}
+	if (dl == NULL) {
+		dl = &dc->slots[dc->next];
+		dc->next = (dc->next + 1) % RPL_DIRCACHE_SLOTS;
+		mem_free(dc->mem, dl->path);
+		dl->path = mem_strdup(dc->mem, path);
+		if (dl->path == NULL)
+			return false;
+	}
+	dl->stamp = stamp;
+	if (!dirlisting_read(dc, dl, path, fun, arg)) {
+		dirlisting_done(dc->mem, dl);
+		return false;
+	}
+	return true;
+}
+
+//-------------------------------------------------------------
+// Command table
+//
+// The first word completes to the executables on the PATH.
+// Reading all PATH directories on every TAB is too slow, so the
+// names are collected once into a sorted table (deduplicated by
+// a hash set: the first directory on the PATH wins) that is
+// searched by prefix. At most once a second the PATH and the
+// stamps of its directories are compared with the table; when
+// something changed, a new table is built on a background thread
+// while the old one keeps serving lookups.
+//-------------------------------------------------------------
+
+#define RPL_COMMANDS_CHECK  (1)     // seconds between checks for changes
+
+#if defined(_WIN32)
+#define RPL_PATH_SEP  ';'
+#else
+#define RPL_PATH_SEP  ':'
+#endif
+
+typedef struct cmddir_s {
+	char *path;                 // a directory of the PATH
+	dir_stamp_t stamp;          // its stamp before it was read
+	bool exists;
+} cmddir_t;
+
+typedef struct cmdlist_s {
+	char *path;                 // the PATH the list was built from
+	time_t built_at;
+	cmddir_t *dirs;
+	ssize_t dir_count;
+	const char **names;         // sorted
+	ssize_t count;
+	char *buf;                  // all names, each 0 terminated
+	ssize_t buf_used;
+	ssize_t buf_len;
+} cmdlist_t;
+
+// state while a list is built
+typedef struct cmdlist_builder_s {
+	alloc_t *mem;
+	cmdlist_t *cl;
+	ssize_t *offsets;           // offset of every name in `cl->buf`
+	ssize_t len;
+	ssize_t *set;               // hash set of the names: index + 1, 0 is empty
+	ssize_t set_len;            // power of 2, more than twice the count
+} cmdlist_builder_t;
+
+static void
+cmdlist_free(alloc_t * mem, cmdlist_t * cl)
+{
+	if (cl == NULL)
+		return;
+	for (ssize_t i = 0; i < cl->dir_count; i++) {
+		mem_free(mem, cl->dirs[i].path);
+	}
+	mem_free(mem, cl->dirs);
+	mem_free(mem, cl->names);
+	mem_free(mem, cl->buf);
+	mem_free(mem, cl->path);
+	mem_free(mem, cl);
+}
+
+static bool
+cmdlist_eq(const void *arg, ssize_t index, const char *name, uint64_t hash)
+{
+	const cmdlist_builder_t *b = (const cmdlist_builder_t *)arg;
+	rpl_unused(hash);
+	return (strcmp(b->cl->buf + b->offsets[index], name) == 0);
+}
+
+// slot of `name` in the set, or the empty slot where it belongs
+static ssize_t
+cmdlist_find(const cmdlist_builder_t * b, const char *name)
+{
+	return rpl_hset_find(b->set, b->set_len, name, rpl_hash(name), &cmdlist_eq, b);
+}
+
+static bool
+cmdlist_rehash(cmdlist_builder_t * b)
+{
+	if (!rpl_hset_reset(b->mem, &b->set, &b->set_len, b->cl->count + 1))
+		return false;
+	for (ssize_t i = 0; i < b->cl->count; i++) {
+		b->set[cmdlist_find(b, b->cl->buf + b->offsets[i])] = i + 1;
+	}
+	return true;
+}
+
+// add a name unless it is already present
+static bool
+cmdlist_add(cmdlist_builder_t * b, const char *name)
+{
+	cmdlist_t *cl = b->cl;
+	if (2 * (cl->count + 1) >= b->set_len && !cmdlist_rehash(b))
+		return false;
+	ssize_t j = cmdlist_find(b, name);
+	if (b->set[j] != 0)
+		return true;
+	if (cl->count >= b->len) {
+		ssize_t newlen = (b->len <= 0 ? 256 : 2 * b->len);
+		ssize_t *offsets = mem_realloc_tp(b->mem, ssize_t, b->offsets, newlen);
+		if (offsets == NULL)
+			return false;
+		b->offsets = offsets;
+		b->len = newlen;
+	}
+	ssize_t n = rpl_strlen(name) + 1;
+	if (cl->buf_used + n > cl->buf_len) {
+		ssize_t newlen = (cl->buf_len <= 0 ? 4096 : cl->buf_len * 2);
+		while (newlen < cl->buf_used + n) {
+			newlen *= 2;
+		}
+		char *buf = mem_realloc_tp(b->mem, char, cl->buf, newlen);
+		if (buf == NULL)
+			return false;
+		cl->buf = buf;
+		cl->buf_len = newlen;
+	}
+	memcpy(cl->buf + cl->buf_used, name, to_size_t(n));
+	b->offsets[cl->count++] = cl->buf_used;
+	b->set[j] = cl->count;
+	cl->buf_used += n;
+	return true;
+}
+
+// add the executables in directory `dir`
+static bool
+cmdlist_read_dir(cmdlist_builder_t * b, const char *dir, stringbuf_t * full)
+{
+	dir_cursor d = 0;
+	dir_entry entry;
+	bool ok = true;
+	if (!os_findfirst(b->mem, dir, &d, &entry))
+		return true;            // unreadable: nothing to add
+	do {
+		const char *fname = os_direntry_name(&entry);
+		if (fname == NULL || strcmp(fname, ".") == 0
+		    || strcmp(fname, "..") == 0)
+			continue;
+		sbuf_replace(full, dir);
+		sbuf_append_char(full, rpl_dirsep());
+		sbuf_append(full, fname);
+		if (os_is_executable(sbuf_string(full)))
+			ok = cmdlist_add(b, fname);
+	} while (ok && os_findnext(d, &entry));
+	os_findclose(d);
+	return ok;
+}
+
+static int
+cmdlist_compare(const void *p1, const void *p2)
+{
+	return strcmp(*(const char *const *)p1, *(const char *const *)p2);
+}
+
+/// Build the list of the executables found on `path` (a PATH value).
+/// Returns NULL if out of memory.
+static cmdlist_t *
+cmdlist_build(alloc_t * mem, const char *path)
+{
+	cmdlist_builder_t b;
+	memset(&b, 0, sizeof(b));
+	b.mem = mem;
+	b.cl = mem_zalloc_tp(mem, cmdlist_t);
+	stringbuf_t *full = sbuf_new(mem);
+	bool ok = (b.cl != NULL && full != NULL);
+	if (ok) {
+		b.cl->built_at = time(NULL);
+		b.cl->path = mem_strdup(mem, path);
+		ssize_t n = 1;
+		for (const char *p = path; *p != 0; p++) {
+			if (*p == RPL_PATH_SEP)
+				n++;
+		}
+		b.cl->dirs = mem_zalloc_tp_n(mem, cmddir_t, n);
+		ok = (b.cl->path != NULL && b.cl->dirs != NULL);
+	}
+	for (const char *p = path; ok && *p != 0;) {
+		const char *end = strchr(p, RPL_PATH_SEP);
+		ssize_t len = (end == NULL ? rpl_strlen(p) : end - p);
+		if (len > 0) {          // an empty entry (the current directory) is skipped
+			cmddir_t *dir = &b.cl->dirs[b.cl->dir_count++];
+			dir->path = mem_strndup(mem, p, len);
+			ok = (dir->path != NULL);
+			if (ok) {
+				dir->exists = os_dir_stamp(dir->path, &dir->stamp);
+				ok = (!dir->exists || cmdlist_read_dir(&b, dir->path, full));
+			}
+		}
+		p += len + (end == NULL ? 0 : 1);
+	}
+	if (ok && b.cl->count > 0) {
+		b.cl->names = mem_malloc_tp_n(mem, const char *, b.cl->count);
+		ok = (b.cl->names != NULL);
+	}
+	if (ok) {
+		for (ssize_t i = 0; i < b.cl->count; i++) {
+			b.cl->names[i] = b.cl->buf + b.offsets[i];
+		}
+		qsort(b.cl->names, to_size_t(b.cl->count), sizeof(b.cl->names[0]),
+		      &cmdlist_compare);
+	}
+	sbuf_free(full);
+	mem_free(mem, b.offsets);
+	mem_free(mem, b.set);
+	if (!ok) {
+		cmdlist_free(mem, b.cl);
+		return NULL;
+	}
+	return b.cl;
+}
+
+// is the list still valid for `path`? (see `dircache_for_each` for the times)
+static bool
+cmdlist_is_current(const cmdlist_t * cl, const char *path)
+{
+	if (strcmp(cl->path, path) != 0)
+		return false;
+	for (ssize_t i = 0; i < cl->dir_count; i++) {
+		const cmddir_t *dir = &cl->dirs[i];
+		dir_stamp_t stamp;
+		bool exists = os_dir_stamp(dir->path, &stamp);
+		if (exists != dir->exists)
+			return false;
+		if (exists && (!dir_stamp_equal(&stamp, &dir->stamp)
+		               || stamp.mtime >= (long long)cl->built_at
+		               || stamp.ctime >= (long long)cl->built_at))
+			return false;
+	}
+	return true;
+}
+
+static const char *
+cmdtable_path(void)
+{
+	const char *path = getenv("PATH");
+	return (path == NULL ? "" : path);
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+struct cmdtable_s {
+	alloc_t *mem;
+	cmdlist_t *list;            // the current table (NULL until first used)
+	time_t checked_at;          // when the list was last compared with the PATH
+	pthread_mutex_t lock;       // guards all of the above and the refresh state
+	pthread_t thread;
+	char *refresh_path;         // PATH to build a new list from (NULL if none pending)
+	bool refreshing;            // a refresh thread is started and not yet joined
+	bool refreshed;             // ... and has finished
+};
+
+static void
+cmdtable_lock(cmdtable_t * ct)
+{
+	pthread_mutex_lock(&ct->lock);
+}
+
+static void
+cmdtable_unlock(cmdtable_t * ct)
+{
+	pthread_mutex_unlock(&ct->lock);
+}
+
+static void *
+cmdtable_refresh_main(void *arg)
+{
+	cmdtable_t *ct = (cmdtable_t *) arg;
+	cmdtable_lock(ct);
+	while (ct->refresh_path != NULL) {
+		// build for the latest request; more may come in meanwhile
+		char *path = ct->refresh_path;
+		ct->refresh_path = NULL;
+		cmdtable_unlock(ct);
+		cmdlist_t *cl = cmdlist_build(ct->mem, path);
+		mem_free(ct->mem, path);
+		cmdtable_lock(ct);
+		if (cl != NULL) {
+			cmdlist_free(ct->mem, ct->list);
+			ct->list = cl;
+		}
+	}
+	ct->refreshed = true;
+	cmdtable_unlock(ct);
+	return NULL;
+}
+
+// join a finished refresh thread
+static void
+cmdtable_join(cmdtable_t * ct)
+{
+	if (!ct->refreshing || !ct->refreshed)
+		return;
+	pthread_join(ct->thread, NULL);
+	ct->refreshing = false;
+	ct->refreshed = false;
+}
+
+// build a new list for `path` in the background (with the lock held); a
+// running refresh picks up the request when it is done
+static void
+cmdtable_refresh(cmdtable_t * ct, const char *path)
+{
+	cmdtable_join(ct);
+	char *refresh_path = mem_strdup(ct->mem, path);
+	if (refresh_path == NULL)
+		return;
+	mem_free(ct->mem, ct->refresh_path);
+	ct->refresh_path = refresh_path;
+	if (ct->refreshing)
+		return;
+	if (pthread_create(&ct->thread, NULL, &cmdtable_refresh_main, ct) == 0) {
+		ct->refreshing = true;
+		return;
+	}
+	// no thread could be started: build it here
+	ct->refresh_path = NULL;
+	cmdlist_t *cl = cmdlist_build(ct->mem, refresh_path);
+	mem_free(ct->mem, refresh_path);
+	if (cl != NULL) {
+		cmdlist_free(ct->mem, ct->list);
+		ct->list = cl;
+	}
+}
+
+rpl_private cmdtable_t *
+cmdtable_new(alloc_t * mem)
+{
+	cmdtable_t *ct = mem_zalloc_tp(mem, cmdtable_t);
+	if (ct == NULL)
+		return NULL;
+	ct->mem = mem;
+	pthread_mutex_init(&ct->lock, NULL);
+	return ct;
+}
+
+rpl_private void
+cmdtable_free(cmdtable_t * ct)
+{
+	if (ct == NULL)
+		return;
+	cmdtable_lock(ct);
+	bool refreshing = ct->refreshing;
+	cmdtable_unlock(ct);
+	if (refreshing)
+		pthread_join(ct->thread, NULL);
+	pthread_mutex_destroy(&ct->lock);
+	cmdlist_free(ct->mem, ct->list);
+	mem_free(ct->mem, ct);
+}
+#else
+// no threads: a changed list is rebuilt synchronously
+
+struct cmdtable_s {
+	alloc_t *mem;
+	cmdlist_t *list;            // the current table (NULL until first used)
+	time_t checked_at;          // when the list was last compared with the PATH
+};
+
+static void
+cmdtable_lock(cmdtable_t * ct)
+{
+	rpl_unused(ct);
+}
+
+static void
+cmdtable_unlock(cmdtable_t * ct)
+{
+	rpl_unused(ct);
+}
+
+static void
+cmdtable_refresh(cmdtable_t * ct, const char *path)
+{
+	cmdlist_t *cl = cmdlist_build(ct->mem, path);
+	if (cl != NULL) {
+		cmdlist_free(ct->mem, ct->list);
+		ct->list = cl;
+	}
+}
+
+rpl_private cmdtable_t *
+cmdtable_new(alloc_t * mem)
+{
+	cmdtable_t *ct = mem_zalloc_tp(mem, cmdtable_t);
+	if (ct == NULL)
+		return NULL;
+	ct->mem = mem;
+	return ct;
+}
+
+rpl_private void
+cmdtable_free(cmdtable_t * ct)
+{
+	if (ct == NULL)
+		return;
+	cmdlist_free(ct->mem, ct->list);
+	mem_free(ct->mem, ct);
+}
+#endif
+
+/// Call `fun` for each command that starts with `prefix`, in sorted order.
+/// The table is built on first use; afterwards a changed PATH or directory
+/// is noticed within a second and the table rebuilt in the background.
+/// Returns false if `fun` stopped the iteration (or there is no table).
+rpl_private bool
+cmdtable_for_each(cmdtable_t * ct, const char *prefix, cmdtable_fun_t * fun,
+                  void *arg)
+{
+	if (ct == NULL)
+		return false;
+	const char *path = cmdtable_path();
+	cmdtable_lock(ct);
+	time_t now = time(NULL);
+	if (ct->list == NULL) {
+		ct->list = cmdlist_build(ct->mem, path);
+		ct->checked_at = now;
+	} else if (now - ct->checked_at >= RPL_COMMANDS_CHECK) {
+		ct->checked_at = now;
+		if (!cmdlist_is_current(ct->list, path))
+			cmdtable_refresh(ct, path);
+	}
+	const cmdlist_t *cl = ct->list;
+	bool ok = (cl != NULL);
+	if (ok) {
+		// binary search for the first name not before the prefix
+		ssize_t lo = 0;
+		ssize_t hi = cl->count;
+		while (lo < hi) {
+			ssize_t mid = lo + (hi - lo) / 2;
+			if (strcmp(cl->names[mid], prefix) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		size_t n = strlen(prefix);
+		for (ssize_t i = lo; ok && i < cl->count
+		     && strncmp(cl->names[i], prefix, n) == 0; i++) {
+			ok = fun(cl->names[i], arg);
+		}
+	}
+	cmdtable_unlock(ct);
+	return ok;
+}
+
+/// Rebuild the table (in the background if it was built before), for example
+/// after a program was installed.
+rpl_private void
+cmdtable_invalidate(cmdtable_t * ct)
+{
+	if (ct == NULL)
+		return;
+	cmdtable_lock(ct);
+	if (ct->list != NULL) {
+		ct->checked_at = time(NULL);
+		cmdtable_refresh(ct, cmdtable_path());
+	}
+	cmdtable_unlock(ct);
+}
+
 //-------------------------------------------------------------
 // File completion 
 //-------------------------------------------------------------
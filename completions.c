@@ -1,12 +1,14 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "repline.h"
 #include "common.h"
 #include "env.h"
 #include "stringbuf.h"
 #include "completions.h"
+#include "fuzzy.h"
 
 //-------------------------------------------------------------
 // Completions
@@ -16,20 +18,51 @@ typedef struct completion_s {
 	const char *replacement;
 	const char *display;
 	const char *help;
+	uint64_t hash;              // hash of the replacement
+	int score;                  // rank of a fuzzy match (higher sorts first)
+	ssize_t len;                // length of the replacement
+	uint64_t key;               // its first 8 bytes case folded (see completion_key)
 } completion_t;
 
+// The strings of the completions are bump allocated from a list of blocks,
+// so clearing the completions frees them all at once.
+typedef struct arena_block_s {
+	struct arena_block_s *next; // older (smaller) block
+	ssize_t size;
+	ssize_t used;
+} arena_block_t;
+
+#define RPL_ARENA_BLOCK  (4096)
+
+typedef struct completers_s completers_t;
+
 struct completions_s {
-	// rpl_completer_fun_t *completer;
-	void *completer_arg;
+	completers_t *completers;   // registered completers (borrowed by a job)
 	ssize_t completer_max;
 	ssize_t count;
 	ssize_t len;
 	completion_t *elems;
+	ssize_t *set;               // hash set of the replacements: element index + 1, 0 is empty
+	ssize_t set_len;            // power of 2, more than twice the count
+	arena_block_t *arena;       // storage of the strings (newest block first)
 	alloc_t *mem;
 	ssize_t cut_start;
 	ssize_t cut_stop;
+	dircache_t *dircache;       // cached directory listings for file names
+	char *extend;               // common prefix to add to the input (if any)
+	completion_job_t *pending;  // asynchronous generation started for these completions
+	completion_job_t *job;      // set on the completions a job generates into
+	bool fuzzy;                 // match file names as fuzzy patterns?
+	bool sorting;               // sorted lazily: the first `sorted` are in order
+	ssize_t sorted;
 };
 
+static bool completion_job_lock(completion_job_t *job);
+static void completion_job_unlock(completion_job_t *job);
+static bool completions_cancelled(completions_t *cms);
+static void completers_free(completers_t *reg);
+static void completions_sort_upto(completions_t *cms, ssize_t n);
+
 
 rpl_private completions_t *
 completions_new(alloc_t * mem)
@@ -48,33 +81,116 @@ completions_free(completions_t * cms)
 	if (cms == NULL)
 		return;
 	completions_clear(cms);
-	if (cms->elems != NULL) {
-		mem_free(cms->mem, cms->elems);
-		cms->elems = NULL;
-		cms->count = 0;
-		cms->len = 0;
+	mem_free(cms->mem, cms->elems);
+	mem_free(cms->mem, cms->set);
+	while (cms->arena != NULL) {
+		arena_block_t *block = cms->arena;
+		cms->arena = block->next;
+		mem_free(cms->mem, block);
 	}
+	completions_job_reap(cms);
+	dircache_free(cms->dircache);
+	completers_free(cms->completers);
 	mem_free(cms->mem, cms);    // free ourselves
 }
 
 rpl_private void
 completions_clear(completions_t * cms)
 {
-	while (cms->count > 0) {
-		completion_t *cm = cms->elems + cms->count - 1;
-		mem_free(cms->mem, cm->display);
-		mem_free(cms->mem, cm->replacement);
-		mem_free(cms->mem, cm->help);
-		memset(cm, 0, sizeof(*cm));
-		cms->count--;
+	if (cms->count > 0) {
+		cms->count = 0;
+		memset(cms->set, 0, to_size_t(cms->set_len) * sizeof(cms->set[0]));
+	}
+	// keep only the newest (largest) block of the arena
+	if (cms->arena != NULL) {
+		while (cms->arena->next != NULL) {
+			arena_block_t *block = cms->arena->next;
+			cms->arena->next = block->next;
+			mem_free(cms->mem, block);
+		}
+		cms->arena->used = 0;
+	}
+	mem_free(cms->mem, cms->extend);
+	cms->extend = NULL;
+	cms->sorting = false;
+	cms->sorted = 0;
+}
+
+static const char *
+completions_strdup(completions_t * cms, const char *s)
+{
+	if (s == NULL)
+		return NULL;
+	ssize_t n = rpl_strlen(s) + 1;
+	arena_block_t *block = cms->arena;
+	if (block == NULL || block->used + n > block->size) {
+		ssize_t size = (block == NULL ? RPL_ARENA_BLOCK : 2 * block->size);
+		if (size < n)
+			size = n;
+		block = (arena_block_t *)mem_malloc(cms->mem, ssizeof(arena_block_t) + size);
+		if (block == NULL)
+			return NULL;
+		block->next = cms->arena;
+		block->size = size;
+		block->used = 0;
+		cms->arena = block;
 	}
+	char *p = (char *)(block + 1) + block->used;
+	rpl_memcpy(p, s, n);
+	block->used += n;
+	return p;
+}
+
+static bool
+completion_eq(const void *arg, ssize_t index, const char *replacement, uint64_t hash)
+{
+	const completion_t *cm = ((const completions_t *)arg)->elems + index;
+	return (cm->hash == hash && strcmp(cm->replacement, replacement) == 0);
 }
 
+// slot of `replacement` in the set, or the empty slot where it belongs
+static ssize_t
+completions_find(completions_t * cms, const char *replacement, uint64_t hash)
+{
+	return rpl_hset_find(cms->set, cms->set_len, replacement, hash, &completion_eq, cms);
+}
 
+// rebuild the set with room for at least `count` completions
+static bool
+completions_rehash(completions_t * cms, ssize_t count)
+{
+	if (!rpl_hset_reset(cms->mem, &cms->set, &cms->set_len, count))
+		return false;
+	for (ssize_t i = 0; i < cms->count; i++) {
+		const completion_t *cm = cms->elems + i;
+		cms->set[completions_find(cms, cm->replacement, cm->hash)] = i + 1;
+	}
+	return true;
+}
+
+// Sort key of a replacement: its first 8 bytes case folded, in big endian
+// order so that comparing keys compares the bytes as `rpl_strnicmp` does.
+static uint64_t
+completion_key(const char *replacement, ssize_t len)
+{
+	uint64_t key = 0;
+	for (ssize_t i = 0; i < 8; i++) {
+		int c = (i < len ? rpl_tolower(replacement[i]) : 0);
+		key = (key << 8) | (uint8_t) (c - CHAR_MIN);
+	}
+	return key;
+}
+
+// add a completion unless its replacement is already present
 static void
 completions_push(completions_t * cms, const char *replacement,
-                 const char *display, const char *help)
+                 const char *display, const char *help, int score)
 {
+	if (cms->sorting) {
+		// appended after all that are sorted
+		completions_sort_upto(cms, cms->count);
+		cms->sorting = false;
+	}
 	if (cms->count >= cms->len) {
 		ssize_t newlen = (cms->len <= 0 ? 32 : cms->len * 2);
 		completion_t *newelems =
@@ -84,14 +200,28 @@ completions_push(completions_t * cms, const char *replacement,
 		cms->elems = newelems;
 		cms->len = newlen;
 	}
+	if (2 * (cms->count + 1) >= cms->set_len
+	    && !completions_rehash(cms, cms->count + 1))
+		return;
 	assert(cms->count < cms->len);
+	uint64_t hash = rpl_hash(replacement);
+	ssize_t j = completions_find(cms, replacement, hash);
+	if (cms->set[j] != 0)
+		return;                 // duplicate
 	completion_t *cm = cms->elems + cms->count;
-	cm->replacement = mem_strdup(cms->mem, replacement);
-	cm->display = mem_strdup(cms->mem, display);
-	cm->help = mem_strdup(cms->mem, help);
+	cm->replacement = completions_strdup(cms, replacement);
+	cm->display = completions_strdup(cms, display);
+	cm->help = completions_strdup(cms, help);
+	cm->hash = hash;
+	cm->score = score;
+	if (cm->replacement == NULL)
+		return;
+	cm->len = rpl_strlen(cm->replacement);
+	cm->key = completion_key(cm->replacement, cm->len);
 	/// FIXME is this needed?
 	// cm->delete_before = delete_before;
 	// cm->delete_after = delete_after;
+	cms->set[j] = cms->count + 1;
 	cms->count++;
 }
 
@@ -101,30 +231,75 @@ completions_count(completions_t * cms)
 	return cms->count;
 }
 
-static bool
-completions_contains(completions_t * cms, const char *replacement)
+rpl_private bool
+completions_add_scored(completions_t * cms, const char *replacement,
+                       const char *display, const char *help, int score)
 {
-	for (ssize_t i = 0; i < cms->count; i++) {
-		const completion_t *c = cms->elems + i;
-		if (strcmp(replacement, c->replacement) == 0) {
-			return true;
-		}
-	}
-	return false;
+	if (cms->completer_max <= 0)
+		return false;
+	if (!completion_job_lock(cms->job))
+		return false;           // cancelled
+	cms->completer_max--;
+	//debug_msg("completion: add: %d,%d, %s\n", delete_before, delete_after, replacement);
+	completions_push(cms, replacement, display, help, score);
+	completion_job_unlock(cms->job);
+	return true;
+}
+
+// set the part of the input the completions replace (read by the editor
+// while a job runs)
+static void
+completions_set_cut(completions_t * cms, ssize_t start, ssize_t stop)
+{
+	if (!completion_job_lock(cms->job))
+		return;                 // cancelled
+	cms->cut_start = start;
+	cms->cut_stop = stop;
+	completion_job_unlock(cms->job);
 }
 
 rpl_private bool
 completions_add(completions_t * cms, const char *replacement,
                 const char *display, const char *help)
 {
-	if (cms->completer_max <= 0)
-		return false;
-	cms->completer_max--;
-	//debug_msg("completion: add: %d,%d, %s\n", delete_before, delete_after, replacement);
-	if (!completions_contains(cms, replacement)) {
-		completions_push(cms, replacement, display, help);
+	return completions_add_scored(cms, replacement, display, help, 0);
+}
+
+rpl_private void
+completions_set_fuzzy(completions_t * cms, bool enable)
+{
+	if (cms->fuzzy != enable)
+		completions_forget(cms);    // cached results were matched differently
+	cms->fuzzy = enable;
+}
+
+/// Keep only the `k` completions with the best score, best first.
+static void
+completions_keep_best(completions_t * cms, ssize_t k)
+{
+	if (cms->count <= k)
+		return;
+	fuzzy_topk_t top;
+	if (!fuzzy_topk_init(&top, cms->mem, k))
+		return;
+	for (ssize_t i = 0; i < cms->count; i++) {
+		fuzzy_topk_push(&top, cms->elems[i].score, -i);  // earlier wins a tie
 	}
-	return true;
+	fuzzy_topk_sort(&top);
+	completion_t *elems = mem_malloc_tp_n(cms->mem, completion_t, cms->len);
+	if (elems != NULL && completion_job_lock(cms->job)) {
+		for (ssize_t i = 0; i < top.count; i++) {
+			elems[i] = cms->elems[-top.hits[i].index];
+		}
+		mem_free(cms->mem, cms->elems);
+		cms->elems = elems;
+		cms->count = top.count;
+		completions_rehash(cms, cms->count);
+		completion_job_unlock(cms->job);
+	} else {
+		mem_free(cms->mem, elems);
+	}
+	fuzzy_topk_done(&top);
 }
 
 static completion_t *
@@ -132,9 +307,27 @@ completions_get(completions_t * cms, ssize_t index)
 {
 	if (index < 0 || cms->count <= 0 || index >= cms->count)
 		return NULL;
+	completions_sort_upto(cms, index + 1);
 	return &cms->elems[index];
 }
 
+rpl_private const char *
+completions_get_replacement(completions_t * cms, ssize_t index)
+{
+	completion_t *cm = completions_get(cms, index);
+	return (cm == NULL ? NULL : cm->replacement);
+}
+
+/// Index of the completion with `replacement`, or -1 if there is none.
+rpl_private ssize_t
+completions_index_of(completions_t * cms, const char *replacement)
+{
+	if (cms->count <= 0 || replacement == NULL)
+		return -1;
+	ssize_t j = completions_find(cms, replacement, rpl_hash(replacement));
+	return cms->set[j] - 1;
+}
+
 rpl_private const char *
 completions_get_display(completions_t * cms, ssize_t index, const char **help)
 {
@@ -183,38 +376,38 @@ completions_get_hint(completions_t * cms, ssize_t index, const char **help)
 	return hint;
 }
 
-// rpl_private void
-// completions_set_completer(completions_t * cms, rpl_completer_fun_t * completer,
-                          // void *arg)
-// {
-	// cms->completer = completer;
-	// cms->completer_arg = arg;
-// }
-
-// rpl_private void
-// completions_get_completer(completions_t * cms, rpl_completer_fun_t ** completer,
-                          // void **arg)
-// {
-	// *completer = cms->completer;
-	// *arg = cms->completer_arg;
-// }
-
 rpl_public void *
 rpl_completion_arg(const rpl_completion_env_t * cenv)
 {
-	return (cenv == NULL ? NULL : cenv->env->completions->completer_arg);
+	return (cenv == NULL ? NULL : cenv->arg);
 }
 
 rpl_public bool
 rpl_has_completions(const rpl_completion_env_t * cenv)
 {
-	return (cenv == NULL ? false : cenv->env->completions->count > 0);
+	return (cenv == NULL ? false : cenv->cms->count > 0);
 }
 
 rpl_public bool
 rpl_stop_completing(const rpl_completion_env_t * cenv)
 {
-	return (cenv == NULL ? true : cenv->env->completions->completer_max <= 0);
+	return (cenv == NULL ? true : cenv->cms->completer_max <= 0);
+}
+
+rpl_public const char *
+rpl_completion_input(rpl_completion_env_t * cenv, long *cursor)
+{
+	if (cenv == NULL)
+		return NULL;
+	if (cursor != NULL)
+		*cursor = cenv->cursor;
+	return cenv->input;
+}
+
+rpl_public rpl_completion_context_t
+rpl_completion_context(const rpl_completion_env_t * cenv)
+{
+	return (cenv == NULL ? RPL_CONTEXT_ARGUMENT : cenv->context);
 }
 
 
@@ -240,24 +433,154 @@ completions_apply(completions_t *cms, ssize_t index, stringbuf_t *sbuf,
 }
 
 
-/// ------------------ no changes from here ...
+//-------------------------------------------------------------
+// Sorting
+//
+// Usually only the first few completions are ever shown, so the
+// completions are sorted lazily: asking for a completion sorts
+// up to it by selecting the best ones of the rest with a bounded
+// heap. Every selection takes at least four times as many as are
+// sorted already, and once that is a sixteenth of all of them
+// the rest is sorted at once.
+//-------------------------------------------------------------
+
+#define RPL_SORT_CHUNK  (16)    // completions to sort at least at a time
+
+// best score first, then in the order of `rpl_stricmp`: shorter first and
+// case insensitive
 static int
-completion_compare(const void *p1, const void *p2)
+completion_compare(const completion_t * cm1, const completion_t * cm2)
 {
-	if (p1 == NULL || p2 == NULL)
+	if (cm1->score != cm2->score)
+		return (cm1->score > cm2->score ? -1 : 1);
+	if (cm1->len != cm2->len)
+		return (cm1->len < cm2->len ? -1 : 1);
+	if (cm1->key != cm2->key)
+		return (cm1->key < cm2->key ? -1 : 1);
+	if (cm1->len <= 8)
 		return 0;
-	const completion_t *cm1 = (const completion_t *)p1;
-	const completion_t *cm2 = (const completion_t *)p2;
-	return rpl_stricmp(cm1->replacement, cm2->replacement);
+	return rpl_strnicmp(cm1->replacement + 8, cm2->replacement + 8, cm1->len - 8);
 }
 
+static int
+completion_qsort_compare(const void *p1, const void *p2)
+{
+	return completion_compare((const completion_t *)p1, (const completion_t *)p2);
+}
+
+static int
+completion_index_compare(const void *p1, const void *p2)
+{
+	ssize_t i1 = *(const ssize_t *)p1;
+	ssize_t i2 = *(const ssize_t *)p2;
+	return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+// is completion `i` worse than completion `j`? (the later one on a tie)
+static bool
+completion_worse(const completions_t * cms, ssize_t i, ssize_t j)
+{
+	int c = completion_compare(cms->elems + i, cms->elems + j);
+	return (c > 0 || (c == 0 && i > j));
+}
+
+static void
+completion_heap_sift_down(const completions_t * cms, ssize_t * top,
+                          ssize_t count, ssize_t n)
+{
+	while (true) {
+		ssize_t worst = n;
+		ssize_t l = 2 * n + 1;
+		ssize_t r = l + 1;
+		if (l < count && completion_worse(cms, top[l], top[worst]))
+			worst = l;
+		if (r < count && completion_worse(cms, top[r], top[worst]))
+			worst = r;
+		if (worst == n)
+			return;
+		ssize_t tmp = top[n];
+		top[n] = top[worst];
+		top[worst] = tmp;
+		n = worst;
+	}
+}
+
+// offer completion `i` to the heap `top` of `*count` (at most `k`) indices
+// that has the worst one at the root
+static void
+completion_heap_push(const completions_t * cms, ssize_t * top, ssize_t * count,
+                     ssize_t k, ssize_t i)
+{
+	if (*count < k) {
+		// sift up
+		ssize_t n = (*count)++;
+		while (n > 0 && completion_worse(cms, i, top[(n - 1) / 2])) {
+			top[n] = top[(n - 1) / 2];
+			n = (n - 1) / 2;
+		}
+		top[n] = i;
+	} else if (completion_worse(cms, top[0], i)) {
+		top[0] = i;             // replace the worst
+		completion_heap_sift_down(cms, top, *count, 0);
+	}
+}
+
+/// Make sure the first `n` completions are in sorted order (if sorting).
+static void
+completions_sort_upto(completions_t * cms, ssize_t n)
+{
+	if (!cms->sorting || n <= cms->sorted)
+		return;
+	ssize_t from = cms->sorted;
+	ssize_t k = n - from;
+	if (k < 4 * from)
+		k = 4 * from;
+	if (k < RPL_SORT_CHUNK)
+		k = RPL_SORT_CHUNK;
+	ssize_t *top = NULL;
+	if (16 * (from + k) <= cms->count)
+		top = mem_malloc_tp_n(cms->mem, ssize_t, k);
+	if (top == NULL) {
+		// sort all the rest
+		qsort(cms->elems + from, to_size_t(cms->count - from),
+		      sizeof(cms->elems[0]), &completion_qsort_compare);
+		cms->sorted = cms->count;
+	} else {
+		ssize_t count = 0;
+		for (ssize_t i = from; i < cms->count; i++) {
+			completion_heap_push(cms, top, &count, k, i);
+		}
+		// swap the selected completions beyond `from + k` with the ones
+		// before it that were not selected, then sort those `k`
+		qsort(top, to_size_t(k), sizeof(top[0]), &completion_index_compare);
+		ssize_t next = 0;
+		ssize_t src = k;
+		for (ssize_t i = from; i < from + k; i++) {
+			while (next < k && top[next] < i) {
+				next++;
+			}
+			if (next < k && top[next] == i)
+				continue;
+			src--;
+			completion_t tmp = cms->elems[i];
+			cms->elems[i] = cms->elems[top[src]];
+			cms->elems[top[src]] = tmp;
+		}
+		qsort(cms->elems + from, to_size_t(k), sizeof(cms->elems[0]),
+		      &completion_qsort_compare);
+		cms->sorted = from + k;
+		mem_free(cms->mem, top);
+	}
+	completions_rehash(cms, cms->count);   // indices changed
+}
+
+/// Sort by score (best first), then alphabetically. The sorting is done on
+/// demand, up to the completions that are asked for.
 rpl_private void
 completions_sort(completions_t * cms)
 {
-	if (cms->count <= 0)
-		return;
-	qsort(cms->elems, to_size_t(cms->count), sizeof(cms->elems[0]),
-	      &completion_compare);
+	cms->sorting = true;
+	cms->sorted = 0;
 }
 
 
@@ -265,10 +588,35 @@ completions_sort(completions_t * cms)
 // Completer functions
 //-------------------------------------------------------------
 
+static bool prim_add_completion(rpl_env_t * env, void *funenv,
+                                const char *replacement, const char *display,
+                                const char *help, long delete_before,
+                                long delete_after);
+
 rpl_public bool
 rpl_add_completions(rpl_completion_env_t * cenv, const char *prefix,
                     const char **completions)
 {
+	completions_t *cms = cenv->cms;
+	if (cms->fuzzy && cenv->complete == &prim_add_completion) {
+		// score every candidate and keep only the best ones, as for file names
+		fuzzy_pattern_t pat;
+		fuzzy_pattern_init(&pat, prefix);
+		ssize_t max = cms->completer_max;
+		ssize_t before = cms->count;
+		bool ok = true;
+		cms->completer_max = RPL_MAX_COMPLETIONS_ALL;
+		for (const char **pc = completions; ok && *pc != NULL; pc++) {
+			int score = fuzzy_score(&pat, *pc, NULL);
+			if (score >= 0)
+				ok = completions_add_scored(cms, *pc, NULL, NULL, score);
+		}
+		if (cms->count - before > max)
+			completions_keep_best(cms, before + max);
+		ssize_t added = cms->count - before;
+		cms->completer_max = (max > added ? max - added : 0);
+		return (ok && cms->completer_max > 0);
+	}
 	for (const char **pc = completions; *pc != NULL; pc++) {
 		// if (rpl_istarts_with(*pc, prefix)) {
 		if (rpl_starts_with(*pc, prefix)) {
@@ -306,18 +654,69 @@ prim_add_completion(rpl_env_t * env, void *funenv, const char *replacement,
                     const char *display, const char *help, long delete_before,
                     long delete_after)
 {
-	rpl_unused(funenv);
-	return completions_add(env->completions, replacement, display, help);
+	rpl_unused(env);
+	return completions_add((completions_t *) funenv, replacement, display, help);
 }
 
-// rpl_public void
-// rpl_set_default_completer(rpl_completer_fun_t * completer, void *arg)
-// {
-	// rpl_env_t *env = rpl_get_env();
-	// if (env == NULL)
-		// return;
-	// completions_set_completer(env->completions, completer, arg);
-// }
+rpl_public void
+rpl_set_default_completer(rpl_completer_fun_t * completer, void *arg)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return;
+	completions_set_completer(env->completions, env, completer, arg);
+}
+
+rpl_public bool
+rpl_add_completer(rpl_completion_context_t context,
+                  rpl_completer_fun_t * completer, void *arg)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL || completer == NULL)
+		return false;
+	return completions_add_completer(env->completions, env, context, completer, arg);
+}
+
+typedef struct command_matches_s {
+	rpl_completion_env_t *cenv;
+	fuzzy_pattern_t pat;
+	bool fuzzy;
+} command_matches_t;
+
+static bool
+command_match(const char *name, void *arg)
+{
+	command_matches_t *m = (command_matches_t *) arg;
+	if (!m->fuzzy)
+		return rpl_add_completion(m->cenv, name);
+	if ((fuzzy_mask(name) & m->pat.mask) != m->pat.mask)
+		return true;
+	int score = fuzzy_score(&m->pat, name, NULL);
+	return (score < 0
+	        || completions_add_scored(m->cenv->cms, name, NULL, NULL, score));
+}
+
+rpl_public void
+rpl_complete_command(rpl_completion_env_t * cenv, const char *prefix)
+{
+	command_matches_t m;
+	m.cenv = cenv;
+	m.fuzzy = (cenv->cms != NULL && cenv->cms->fuzzy
+	           && cenv->complete == &prim_add_completion);
+	fuzzy_pattern_init(&m.pat, prefix);
+	cmdtable_for_each(cenv->env->commands, (m.fuzzy ? "" : prefix),
+	                  &command_match, &m);
+}
+
+rpl_public void
+rpl_invalidate_commands(void)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return;
+	cmdtable_invalidate(env->commands);
+	completions_forget(env->completions);
+}
 
 typedef struct stringview_s {
 	char *start, *stop;
@@ -375,13 +774,76 @@ get_first_diffchar(const char *first, const char *second)
 
 #define RPL_MAX_PREFIX  (256)
 
+typedef struct filename_matches_s {
+	completions_t *cms;
+	const char *prefix;         // file name prefix to match
+	ssize_t prefix_len;
+	char pref_intersec[RPL_MAX_PREFIX];  // common prefix of all matches
+	fuzzy_pattern_t pat;        // the prefix as a fuzzy pattern (if fuzzy)
+	bool first;
+	bool cont;                  // false once no more completions can be added
+	ssize_t seen;
+} filename_matches_t;
+
+// add a directory entry if it matches; returns false to stop the listing
+static bool
+filename_match(const char *fname, bool is_dir, const char *style, void *arg)
+{
+	filename_matches_t *m = (filename_matches_t *)arg;
+	int score = 0;
+	if (m->cont && m->cms->fuzzy) {
+		if ((fuzzy_mask(fname) & m->pat.mask) == m->pat.mask)
+			score = fuzzy_score(&m->pat, fname, NULL);
+		else
+			score = -1;
+	}
+	if (!m->cont || score < 0
+	    || (!m->cms->fuzzy && strncmp(fname, m->prefix, m->prefix_len) != 0)) {
+		// keep listing (for the directory cache) unless cancelled
+		m->seen++;
+		return ((m->seen % 64) != 0 || !completions_cancelled(m->cms));
+	}
+	/// Update common prefix
+	if (m->first) {
+		m->first = false;
+		snprintf(m->pref_intersec, RPL_MAX_PREFIX, "%s", fname);
+	} else {
+		ssize_t diffchar = get_first_diffchar(m->pref_intersec, fname);
+		m->pref_intersec[diffchar] = 0;
+	}
+	const char *help = "";
+	stringbuf_t *fname_str = sbuf_new(m->cms->mem);
+	sbuf_append(fname_str, fname);
+	if (is_dir) {
+		sbuf_append_char(fname_str, rpl_dirsep());
+	}
+	if (str_find_forward(fname, strlen(fname), 0, &rpl_char_is_white, true) > 0) {
+		sbuf_insert_char_at(fname_str, '\'', 0);
+		sbuf_append_char(fname_str, '\'');
+	};
+	stringbuf_t *display = NULL;
+	if (style != NULL && (display = sbuf_new(m->cms->mem)) != NULL) {
+		sbuf_append(display, style);
+		sbuf_append(display, "[!pre]");
+		sbuf_append(display, sbuf_string(fname_str));
+		sbuf_append(display, "[/pre][/]");
+	}
+	m->cont = completions_add_scored(m->cms, sbuf_string(fname_str),
+	                                 (display != NULL ? sbuf_string(display)
+	                                  : sbuf_string(fname_str)), help, score);
+	sbuf_free(display);
+	sbuf_free(fname_str);
+	return (m->cont || !completions_cancelled(m->cms));
+}
+
+/// Add the file names that complete the word at `pos` in `input`. The common
+/// prefix of all matches is not inserted but kept in `cms->extend`. With fuzzy
+/// matching every matching name is scored, and only the best ones are kept.
 static void
-filename_completer(rpl_env_t *env, editor_t *eb)
+filename_completer(completions_t *cms, const char *input, ssize_t pos)
 {
-	const char *input = sbuf_string(eb->input);
 	if (input == NULL)
 		return;
-	ssize_t pos = eb->pos;
 	/// New way to find the boundaries for cutting out and replacing the word to be
 	/// completed.
 	stringview_t word = get_word(input, pos, rpl_char_is_white);
@@ -389,8 +851,7 @@ filename_completer(rpl_env_t *env, editor_t *eb)
 	                                          rpl_char_is_dir_separator);
 	ssize_t fname_prefix_len = fname_prefix.stop - fname_prefix.start;
 	stringview_t dirname = { .start = word.start, .stop = fname_prefix.start };
-	env->completions->cut_start = fname_prefix.start - input;
-	env->completions->cut_stop = fname_prefix.stop - input;
+	completions_set_cut(cms, fname_prefix.start - input, fname_prefix.stop - input);
 
 	char word_str[RPL_MAX_PREFIX];
 	snprintf(word_str, word.stop - word.start + 1, "%s", word.start);
@@ -406,68 +867,671 @@ filename_completer(rpl_env_t *env, editor_t *eb)
 	// printf("rest input: \"%s\", word: \"%s\", dirname: \"%s\", fname_prefix: \"%s\"\n",
 	      // input + pos, word_str, dirname_str, fname_prefix_str);
 
-	dir_cursor d = 0;
-	dir_entry entry;
-	bool cont = true;
-	bool first = true;
-	char pref_intersec[RPL_MAX_PREFIX] = {0};
-	ssize_t diffchar = RPL_MAX_PREFIX;
-	if (os_findfirst(env->mem, dirname_str, &d, &entry)) {
-		do {
-			const char *fname = os_direntry_name(&entry);
-			// printf("dir entry: \"%s\"\n", fname);
-			if (fname != NULL &&
-			    strcmp(fname, ".") != 0 &&
-			    strcmp(fname, "..") != 0 &&
-			    strlen(fname) >= fname_prefix_len &&
-			    strncmp(fname, fname_prefix.start, fname_prefix_len) == 0)
-			{
-				/// Update common prefix
-				if (first) {
-					first = false;
-					strcpy(pref_intersec, fname);
-				} else {
-					if (diffchar > 0) {
-						diffchar = get_first_diffchar(pref_intersec, fname);
-						*(pref_intersec + diffchar) = 0;
-					}
-				}
-				const char *help = "";
-				stringbuf_t *fname_str = sbuf_new(env->mem);
-				sbuf_append(fname_str, fname);
-				char full_path[2 * RPL_MAX_PREFIX];
-				sprintf(full_path, "%s%s", dirname_str, fname);
-				if (os_is_dir(full_path)) {
-					sbuf_append_char(fname_str, rpl_dirsep());
-				}
-				if (str_find_forward(fname, strlen(fname), 0, &rpl_char_is_white, true) > 0) {
-					sbuf_insert_char_at(fname_str, '\'', 0);
-					sbuf_append_char(fname_str, '\'');
-				};
-				cont = completions_add(env->completions,
-				                      sbuf_string(fname_str), sbuf_string(fname_str),
-				                      help);
-				sbuf_free(fname_str);
-			}
-		} while (cont && os_findnext(d, &entry));
-		os_findclose(d);
+	if (cms->dircache == NULL)
+		cms->dircache = dircache_new(cms->mem);
+	filename_matches_t m;
+	memset(&m, 0, sizeof(m));
+	m.cms = cms;
+	m.prefix = fname_prefix.start;
+	m.prefix_len = fname_prefix_len;
+	m.first = true;
+	m.cont = true;
+	if (cms->fuzzy) {
+		ssize_t max = cms->completer_max;
+		fuzzy_pattern_init(&m.pat, fname_prefix_str);
+		cms->completer_max = RPL_MAX_COMPLETIONS_ALL;
+		dircache_for_each(cms->dircache, dirname_str, &filename_match, &m);
+		completions_keep_best(cms, max);
+		cms->completer_max = (max > cms->count ? max - cms->count : 0);
+		return;
+	}
+	if (dircache_for_each(cms->dircache, dirname_str, &filename_match, &m)
+	    && m.cont && rpl_strlen(m.pref_intersec) > fname_prefix_len) {
+		cms->extend = mem_strdup(cms->mem, m.pref_intersec + fname_prefix_len);
+	}
+}
+
+/// Insert the common prefix of the completions at the cursor.
+rpl_private void
+completions_extend_input(completions_t *cms, editor_t *eb)
+{
+	if (cms->extend == NULL)
+		return;
+	ssize_t n = sbuf_insert_at(eb->input, cms->extend, eb->pos) - eb->pos;
+	eb->pos += n;
+	cms->cut_stop += n;
+	mem_free(cms->mem, cms->extend);
+	cms->extend = NULL;
+}
+
+
+
+//-------------------------------------------------------------
+// Completer registry
+//
+// Completers are registered per context of the word under the
+// cursor, and the default completer (file names unless set)
+// serves the contexts without one. The results of every run are
+// kept in a few slots that are reused round robin, keyed by the
+// completer, the context, the input before the word (completers
+// may look at the earlier words) and the prefix; a longer prefix is
+// served by filtering the results for a shorter one. Results are
+// only kept if the completer was not stopped early, and they are
+// dropped when a new line is edited. Only one generation at a
+// time uses the registry.
+//-------------------------------------------------------------
+
+#define RPL_COMPLETER_SLOTS      (8)
+#define RPL_COMPLETER_CACHE_MAX  (10000)   // more results are not kept
+
+typedef struct completer_s {
+	rpl_completer_fun_t *fun;
+	void *arg;
+	rpl_completion_context_t context;
+} completer_t;
+
+typedef struct completer_slot_s {
+	completer_t completer;
+	char *before;               // the input before the word
+	char *prefix;               // NULL if the slot is unused
+	completions_t *results;     // all results of the completer for the prefix
+} completer_slot_t;
+
+struct completers_s {
+	completer_t *elems;
+	ssize_t count;
+	ssize_t len;
+	completer_t fallback;       // the default completer (`fun` is NULL for file names)
+	completer_slot_t slots[RPL_COMPLETER_SLOTS];
+	ssize_t next;               // slot to reuse next
+	rpl_env_t *env;
+	alloc_t *mem;
+};
+
+static void
+completer_slot_done(alloc_t * mem, completer_slot_t * slot)
+{
+	mem_free(mem, slot->before);
+	mem_free(mem, slot->prefix);
+	completions_free(slot->results);
+	memset(slot, 0, sizeof(*slot));
+}
+
+static void
+completers_free(completers_t * reg)
+{
+	if (reg == NULL)
+		return;
+	for (ssize_t i = 0; i < RPL_COMPLETER_SLOTS; i++) {
+		completer_slot_done(reg->mem, &reg->slots[i]);
+	}
+	mem_free(reg->mem, reg->elems);
+	mem_free(reg->mem, reg);
+}
+
+static completers_t *
+completions_completers(completions_t * cms, rpl_env_t * env)
+{
+	completions_job_reap(cms);  // a job may use the registry
+	if (cms->completers == NULL) {
+		cms->completers = mem_zalloc_tp(cms->mem, completers_t);
+		if (cms->completers == NULL)
+			return NULL;
+		cms->completers->mem = cms->mem;
+		cms->completers->env = env;
+	}
+	return cms->completers;
+}
+
+rpl_private void
+completions_forget(completions_t * cms)
+{
+	completions_job_reap(cms);
+	if (cms->completers == NULL)
+		return;
+	for (ssize_t i = 0; i < RPL_COMPLETER_SLOTS; i++) {
+		completer_slot_done(cms->mem, &cms->completers->slots[i]);
+	}
+}
+
+rpl_private bool
+completions_set_completer(completions_t * cms, rpl_env_t * env,
+                          rpl_completer_fun_t * completer, void *arg)
+{
+	completers_t *reg = completions_completers(cms, env);
+	if (reg == NULL)
+		return false;
+	reg->fallback.fun = completer;
+	reg->fallback.arg = arg;
+	completions_forget(cms);
+	return true;
+}
+
+rpl_private void
+completions_get_completer(completions_t * cms, rpl_completer_fun_t ** completer,
+                          void **arg)
+{
+	*completer = (cms->completers == NULL ? NULL : cms->completers->fallback.fun);
+	*arg = (cms->completers == NULL ? NULL : cms->completers->fallback.arg);
+}
+
+rpl_private bool
+completions_add_completer(completions_t * cms, rpl_env_t * env,
+                          rpl_completion_context_t context,
+                          rpl_completer_fun_t * completer, void *arg)
+{
+	completers_t *reg = completions_completers(cms, env);
+	if (reg == NULL)
+		return false;
+	if (reg->count >= reg->len) {
+		ssize_t newlen = (reg->len <= 0 ? 8 : 2 * reg->len);
+		completer_t *elems = mem_realloc_tp(reg->mem, completer_t, reg->elems, newlen);
+		if (elems == NULL)
+			return false;
+		reg->elems = elems;
+		reg->len = newlen;
+	}
+	completer_t *c = &reg->elems[reg->count++];
+	c->fun = completer;
+	c->arg = arg;
+	c->context = context;
+	return true;
+}
+
+/// The context of the word from `start` to `stop` in `input`
+static rpl_completion_context_t
+completion_context(const char *input, ssize_t start, ssize_t stop)
+{
+	if (input[start] == '$')
+		return RPL_CONTEXT_VARIABLE;
+	if (input[start] == '-')
+		return RPL_CONTEXT_FLAG;
+	if (input[start] == '~')
+		return RPL_CONTEXT_PATH;
+	for (ssize_t i = start; i < stop; i++) {
+		if (input[i] == '/' || input[i] == rpl_dirsep())
+			return RPL_CONTEXT_PATH;
+	}
+	for (ssize_t i = 0; i < start; i++) {
+		if (!rpl_char_is_white(input + i, 1))
+			return RPL_CONTEXT_ARGUMENT;
+	}
+	return RPL_CONTEXT_COMMAND;
+}
+
+static bool
+completer_matches(const completions_t * cms, const fuzzy_pattern_t * pat,
+                  const char *prefix, const char *replacement, int *score)
+{
+	*score = 0;
+	if (cms->fuzzy) {
+		*score = fuzzy_score(pat, replacement, NULL);
+		return (*score >= 0);
+	}
+	return rpl_starts_with(replacement, prefix);
+}
+
+/// Cached results of `c` for `prefix` after `before`, or for the longest
+/// shorter prefix
+static completer_slot_t *
+completer_find(completers_t * reg, const completer_t * c, const char *before,
+               const char *prefix)
+{
+	completer_slot_t *best = NULL;
+	for (ssize_t i = 0; i < RPL_COMPLETER_SLOTS; i++) {
+		completer_slot_t *slot = &reg->slots[i];
+		if (slot->prefix == NULL || slot->completer.fun != c->fun
+		    || slot->completer.arg != c->arg
+		    || slot->completer.context != c->context
+		    || strcmp(slot->before, before) != 0
+		    || !rpl_starts_with(prefix, slot->prefix))
+			continue;
+		if (best == NULL || rpl_strlen(slot->prefix) > rpl_strlen(best->prefix))
+			best = slot;
 	}
-	ssize_t pref_intersec_len = strlen(pref_intersec);
-	if (pref_intersec_len > 0) {
-		sbuf_insert_at(eb->input, pref_intersec + fname_prefix_len, eb->pos);
-		eb->pos += pref_intersec_len - fname_prefix_len;
-		env->completions->cut_stop -= fname_prefix_len - pref_intersec_len;
+	return best;
+}
+
+/// All results of `c` for `prefix` after `before`: from the cache, or by
+/// calling the completer (the results are then cached). Returns NULL if
+/// cancelled.
+static completions_t *
+completer_results(completions_t * cms, completers_t * reg, const completer_t * c,
+                  const char *before, const char *prefix, const char *input,
+                  ssize_t pos)
+{
+	completer_slot_t *slot = completer_find(reg, c, before, prefix);
+	if (slot != NULL && strcmp(slot->prefix, prefix) == 0)
+		return slot->results;
+	completions_t *results = completions_new(cms->mem);
+	if (results == NULL)
+		return NULL;
+	results->fuzzy = cms->fuzzy;
+	if (slot != NULL) {
+		// narrow the results for a shorter prefix
+		fuzzy_pattern_t pat;
+		fuzzy_pattern_init(&pat, prefix);
+		for (ssize_t i = 0; i < slot->results->count; i++) {
+			const completion_t *cm = slot->results->elems + i;
+			int score;
+			if (completer_matches(cms, &pat, prefix, cm->replacement, &score))
+				completions_push(results, cm->replacement, cm->display, cm->help, score);
+		}
+	} else {
+		rpl_completion_env_t cenv;
+		memset(&cenv, 0, sizeof(cenv));
+		cenv.env = reg->env;
+		cenv.input = input;
+		cenv.cursor = (long)pos;
+		cenv.arg = c->arg;
+		cenv.closure = results;
+		cenv.complete = &prim_add_completion;
+		cenv.cms = results;
+		cenv.context = c->context;
+		results->completer_max = (cms->completer_max > RPL_COMPLETER_CACHE_MAX
+		                          ? cms->completer_max : RPL_COMPLETER_CACHE_MAX);
+		results->job = cms->job;    // a cancelled job stops the completer
+		(*c->fun) (&cenv, prefix);
+		results->job = NULL;
+		if (completions_cancelled(cms)) {
+			completions_free(results);
+			return NULL;
+		}
+		if (results->completer_max <= 0 || results->count > RPL_COMPLETER_CACHE_MAX)
+			return results;     // stopped early or too many: not cached
+	}
+	slot = &reg->slots[reg->next];
+	reg->next = (reg->next + 1) % RPL_COMPLETER_SLOTS;
+	completer_slot_done(reg->mem, slot);
+	slot->before = mem_strdup(reg->mem, before);
+	slot->prefix = mem_strdup(reg->mem, prefix);
+	if (slot->before == NULL || slot->prefix == NULL) {
+		mem_free(reg->mem, slot->before);
+		mem_free(reg->mem, slot->prefix);
+		slot->before = slot->prefix = NULL;
+		return results;
 	}
+	slot->completer = *c;
+	slot->results = results;
+	return results;
 }
 
+static void
+completer_run(completions_t * cms, completers_t * reg, const completer_t * c,
+              const char *before, const char *prefix, const char *input,
+              ssize_t pos)
+{
+	completions_t *results = completer_results(cms, reg, c, before, prefix, input, pos);
+	if (results == NULL)
+		return;
+	for (ssize_t i = 0; i < results->count; i++) {
+		const completion_t *cm = results->elems + i;
+		if (!completions_add_scored(cms, cm->replacement, cm->display, cm->help,
+		                            cm->score))
+			break;
+	}
+	// free the results unless they are cached
+	for (ssize_t i = 0; i < RPL_COMPLETER_SLOTS; i++) {
+		if (reg->slots[i].results == results)
+			return;
+	}
+	completions_free(results);
+}
+
+/// Complete the word at `pos` with the completers of its context.
+static void
+completers_complete(completions_t * cms, const char *input, ssize_t pos)
+{
+	completers_t *reg = cms->completers;
+	if (reg == NULL) {
+		filename_completer(cms, input, pos);
+		return;
+	}
+	stringview_t word = get_word(input, pos, rpl_char_is_white);
+	ssize_t start = word.start - input;
+	if (start > pos)
+		start = pos;
+	rpl_completion_context_t context = completion_context(input, start, pos);
+	char *before = mem_strndup(cms->mem, input, start);
+	char *prefix = mem_strndup(cms->mem, input + start, pos - start);
+	if (before == NULL || prefix == NULL) {
+		mem_free(cms->mem, before);
+		mem_free(cms->mem, prefix);
+		return;
+	}
+	bool found = false;
+	for (ssize_t i = 0; i < reg->count; i++) {
+		if (reg->elems[i].context != context)
+			continue;
+		found = true;
+		completions_set_cut(cms, start, word.stop - input);
+		completer_t c = reg->elems[i];
+		completer_run(cms, reg, &c, before, prefix, input, pos);
+	}
+	if (!found && reg->fallback.fun == NULL) {
+		filename_completer(cms, input, pos);
+	} else if (!found) {
+		completions_set_cut(cms, start, word.stop - input);
+		completer_t c = reg->fallback;
+		c.context = context;
+		completer_run(cms, reg, &c, before, prefix, input, pos);
+	}
+	mem_free(cms->mem, before);
+	mem_free(cms->mem, prefix);
+}
 
 void
 completions_generate(struct rpl_env_s *env, editor_t *eb, ssize_t max)
 {
+	completions_job_reap(env->completions);
 	completions_clear(env->completions);
 	env->completions->completer_max = max;
-	filename_completer(env, eb);
+	completers_complete(env->completions, sbuf_string(eb->input), eb->pos);
+	completions_extend_input(env->completions, eb);
+}
+
+
+//-------------------------------------------------------------
+// Asynchronous generation
+//
+// A job generates completions on a worker thread into its own
+// completions object, so a slow directory does not block the
+// editor. The editor polls for input meanwhile: it may look at
+// the results so far, or cancel the job. A cancelled job still
+// runs until its completer notices (or returns); it is reaped
+// before the edited line is returned, so no completer runs
+// after `rpl_readline` is done.
+//-------------------------------------------------------------
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+
+struct completion_job_s {
+	completions_t *cms;         // results; `count` and `elems` are guarded by `lock`
+	char *input;                // copy of the input
+	ssize_t pos;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	bool done;
+	bool cancel;
+};
+
+static bool
+completion_job_lock(completion_job_t *job)
+{
+	if (job == NULL)
+		return true;
+	pthread_mutex_lock(&job->lock);
+	if (job->cancel) {
+		pthread_mutex_unlock(&job->lock);
+		return false;
+	}
+	return true;
+}
+
+static void
+completion_job_unlock(completion_job_t *job)
+{
+	if (job != NULL)
+		pthread_mutex_unlock(&job->lock);
+}
+
+// has the job generating into `cms` been cancelled?
+static bool
+completions_cancelled(completions_t *cms)
+{
+	if (!completion_job_lock(cms->job))
+		return true;
+	completion_job_unlock(cms->job);
+	return false;
+}
+
+static void *
+completion_job_main(void *arg)
+{
+	completion_job_t *job = (completion_job_t *)arg;
+	completers_complete(job->cms, job->input, job->pos);
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	pthread_cond_broadcast(&job->finished);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+// free a job after its thread is joined
+static void
+completion_job_free(completions_t *cms, completion_job_t *job)
+{
+	pthread_cond_destroy(&job->finished);
+	pthread_mutex_destroy(&job->lock);
+	job->cms->job = NULL;
+	job->cms->dircache = NULL;  // borrowed from `cms`
+	job->cms->completers = NULL;
+	completions_free(job->cms);
+	mem_free(cms->mem, job->input);
+	mem_free(cms->mem, job);
+}
+
+/// Start generating completions for `input` at `pos` on a worker thread.
+/// Returns false if no thread could be started.
+rpl_private bool
+completions_job_start(completions_t *cms, const char *input, ssize_t pos,
+                      ssize_t max)
+{
+	completions_job_reap(cms);
+	completions_clear(cms);
+	if (cms->dircache == NULL)
+		cms->dircache = dircache_new(cms->mem);
+	completion_job_t *job = mem_zalloc_tp(cms->mem, completion_job_t);
+	if (job == NULL)
+		return false;
+	job->input = mem_strdup(cms->mem, input);
+	job->pos = pos;
+	job->cms = completions_new(cms->mem);
+	if (job->input == NULL || job->cms == NULL) {
+		completions_free(job->cms);
+		mem_free(cms->mem, job->input);
+		mem_free(cms->mem, job);
+		return false;
+	}
+	job->cms->completer_max = max;
+	job->cms->fuzzy = cms->fuzzy;
+	job->cms->dircache = cms->dircache;
+	job->cms->completers = cms->completers;
+	job->cms->job = job;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->finished, NULL);
+	if (pthread_create(&job->thread, NULL, &completion_job_main, job) != 0) {
+		pthread_cond_destroy(&job->finished);
+		pthread_mutex_destroy(&job->lock);
+		job->cms->job = NULL;
+		job->cms->dircache = NULL;
+		job->cms->completers = NULL;
+		completions_free(job->cms);
+		mem_free(cms->mem, job->input);
+		mem_free(cms->mem, job);
+		return false;
+	}
+	cms->pending = job;
+	return true;
+}
+
+/// Wait at most `timeout_ms` for the pending job; returns true if it is done.
+rpl_private bool
+completions_job_wait(completions_t *cms, long timeout_ms)
+{
+	completion_job_t *job = cms->pending;
+	if (job == NULL)
+		return true;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long long nsec = (long long)now.tv_usec * 1000 + (long long)timeout_ms * 1000000;
+	struct timespec until;
+	until.tv_sec = now.tv_sec + (time_t)(nsec / 1000000000);
+	until.tv_nsec = (long)(nsec % 1000000000);
+	pthread_mutex_lock(&job->lock);
+	while (!job->done) {
+		if (pthread_cond_timedwait(&job->finished, &job->lock, &until) == ETIMEDOUT)
+			break;
+	}
+	bool done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	return done;
+}
+
+/// Append a copy of the results the pending job has found since the last call
+/// (`cms` must not be changed otherwise while the job runs).
+rpl_private void
+completions_job_partial(completions_t *cms)
+{
+	completion_job_t *job = cms->pending;
+	if (job == NULL)
+		return;
+	pthread_mutex_lock(&job->lock);
+	for (ssize_t i = cms->count; i < job->cms->count; i++) {
+		const completion_t *cm = job->cms->elems + i;
+		completions_push(cms, cm->replacement, cm->display, cm->help, cm->score);
+	}
+	cms->cut_start = job->cms->cut_start;
+	cms->cut_stop = job->cms->cut_stop;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/// Stop the pending job without waiting for it; its results are discarded.
+rpl_private void
+completions_job_cancel(completions_t *cms)
+{
+	completion_job_t *job = cms->pending;
+	if (job == NULL)
+		return;
+	pthread_mutex_lock(&job->lock);
+	job->cancel = true;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/// Wait for the pending job and move its results into `cms` (unless it was
+/// cancelled). Returns true if there were results to move.
+rpl_private bool
+completions_job_finish(completions_t *cms)
+{
+	completion_job_t *job = cms->pending;
+	if (job == NULL)
+		return false;
+	cms->pending = NULL;
+	pthread_join(job->thread, NULL);
+	bool moved = !job->cancel;
+	if (moved) {
+		completions_clear(cms);
+		completions_t *res = job->cms;
+		completions_t tmp = *cms;
+		cms->elems = res->elems;
+		cms->len = res->len;
+		cms->count = res->count;
+		cms->set = res->set;
+		cms->set_len = res->set_len;
+		cms->arena = res->arena;
+		cms->cut_start = res->cut_start;
+		cms->cut_stop = res->cut_stop;
+		cms->extend = res->extend;
+		res->elems = tmp.elems;
+		res->len = tmp.len;
+		res->count = 0;
+		res->set = tmp.set;
+		res->set_len = tmp.set_len;
+		res->arena = tmp.arena;
+		res->extend = NULL;
+	}
+	completion_job_free(cms, job);
+	return moved;
+}
+
+/// Wait for and free a (cancelled) job that is still pending.
+rpl_private void
+completions_job_reap(completions_t *cms)
+{
+	completion_job_t *job = cms->pending;
+	if (job == NULL)
+		return;
+	cms->pending = NULL;
+	pthread_join(job->thread, NULL);
+	completion_job_free(cms, job);
+}
+
+#else
+
+// no worker threads: completions are always generated synchronously
+
+struct completion_job_s {
+	int unused;
+};
+
+static bool
+completion_job_lock(completion_job_t *job)
+{
+	rpl_unused(job);
+	return true;
+}
+
+static void
+completion_job_unlock(completion_job_t *job)
+{
+	rpl_unused(job);
+}
+
+static bool
+completions_cancelled(completions_t *cms)
+{
+	rpl_unused(cms);
+	return false;
+}
+
+rpl_private bool
+completions_job_start(completions_t *cms, const char *input, ssize_t pos,
+                      ssize_t max)
+{
+	rpl_unused(cms);
+	rpl_unused(input);
+	rpl_unused(pos);
+	rpl_unused(max);
+	return false;
+}
+
+rpl_private bool
+completions_job_wait(completions_t *cms, long timeout_ms)
+{
+	rpl_unused(cms);
+	rpl_unused(timeout_ms);
+	return true;
+}
+
+rpl_private void
+completions_job_partial(completions_t *cms)
+{
+	rpl_unused(cms);
+}
+
+rpl_private void
+completions_job_cancel(completions_t *cms)
+{
+	rpl_unused(cms);
+}
+
+rpl_private bool
+completions_job_finish(completions_t *cms)
+{
+	rpl_unused(cms);
+	return false;
+}
+
+rpl_private void
+completions_job_reap(completions_t *cms)
+{
+	rpl_unused(cms);
 }
+#endif
 
 
 extern char **environ;
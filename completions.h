@@ -8,8 +8,8 @@
 //-------------------------------------------------------------
 // Completions
 //-------------------------------------------------------------
-#define RPL_MAX_COMPLETIONS_TO_SHOW  (1000)
-#define RPL_MAX_COMPLETIONS_TO_TRY   (RPL_MAX_COMPLETIONS_TO_SHOW/4)
+#define RPL_MAX_COMPLETIONS_TO_TRY   (250)
+#define RPL_MAX_COMPLETIONS_ALL      (PTRDIFF_MAX)
 
 typedef struct completions_s completions_t;
 typedef struct editor_s editor_t;
@@ -19,26 +19,82 @@ rpl_private void completions_free(completions_t * cms);
 rpl_private void completions_clear(completions_t * cms);
 rpl_private bool completions_add(completions_t * cms, const char *replacement,
                                  const char *display, const char *help);
+/// Add a completion ranked by `score` (see completions_sort)
+rpl_private bool completions_add_scored(completions_t * cms,
+                                        const char *replacement,
+                                        const char *display, const char *help,
+                                        int score);
+/// Match file names (and the candidates of rpl_add_completions) as fuzzy patterns
+rpl_private void completions_set_fuzzy(completions_t * cms, bool enable);
 rpl_private ssize_t completions_count(completions_t * cms);
+rpl_private ssize_t completions_index_of(completions_t * cms,
+                                        const char *replacement);
+rpl_private const char *completions_get_replacement(completions_t * cms,
+                                                    ssize_t index);
 rpl_private void completions_generate(struct rpl_env_s *env,
                                          editor_t *eb,
                                          ssize_t max);
+/// Sort by score (best first), then alphabetically
 rpl_private void completions_sort(completions_t * cms);
-// rpl_private void completions_set_completer(completions_t * cms,
-                                           // rpl_completer_fun_t * completer,
-                                           // void *arg);
+rpl_private void completions_extend_input(completions_t * cms, editor_t *eb);
+
+typedef struct completion_job_s completion_job_t;
+
+rpl_private bool completions_job_start(completions_t * cms, const char *input,
+                                       ssize_t pos, ssize_t max);
+rpl_private bool completions_job_wait(completions_t * cms, long timeout_ms);
+rpl_private void completions_job_partial(completions_t * cms);
+rpl_private void completions_job_cancel(completions_t * cms);
+rpl_private bool completions_job_finish(completions_t * cms);
+rpl_private void completions_job_reap(completions_t * cms);
+rpl_private bool completions_set_completer(completions_t * cms, rpl_env_t * env,
+                                           rpl_completer_fun_t * completer,
+                                           void *arg);
+rpl_private void completions_get_completer(completions_t * cms,
+                                           rpl_completer_fun_t ** completer,
+                                           void **arg);
+rpl_private bool completions_add_completer(completions_t * cms, rpl_env_t * env,
+                                           rpl_completion_context_t context,
+                                           rpl_completer_fun_t * completer,
+                                           void *arg);
+/// Drop the cached results of the completers (before editing a new line)
+rpl_private void completions_forget(completions_t * cms);
 rpl_private const char *completions_get_display(completions_t * cms,
                                                 ssize_t index,
                                                 const char **help);
 rpl_private const char *completions_get_hint(completions_t * cms, ssize_t index,
                                              const char **help);
-// rpl_private void completions_get_completer(completions_t * cms,
-                                           // rpl_completer_fun_t ** completer,
-                                           // void **arg);
 
 rpl_private ssize_t completions_apply(completions_t * cms, ssize_t index,
                                       stringbuf_t * sbuf, ssize_t pos);
 
+//-------------------------------------------------------------
+// Directory listing cache
+//-------------------------------------------------------------
+typedef struct dircache_s dircache_t;
+typedef struct dirlisting_s dirlisting_t;
+/// `style` is the bbcode that starts the LS color of the entry, NULL if it is
+/// not colored (the colors are only used if `CLICOLOR` is set).
+typedef bool (dircache_fun_t) (const char *name, bool is_dir,
+                               const char *style, void *arg);
+
+rpl_private dircache_t *dircache_new(alloc_t * mem);
+rpl_private void dircache_free(dircache_t * dc);
+rpl_private bool dircache_for_each(dircache_t * dc, const char *path,
+                                   dircache_fun_t * fun, void *arg);
+
+//-------------------------------------------------------------
+// Command table (executables on the PATH)
+//-------------------------------------------------------------
+typedef struct cmdtable_s cmdtable_t;
+typedef bool (cmdtable_fun_t) (const char *name, void *arg);
+
+rpl_private cmdtable_t *cmdtable_new(alloc_t * mem);
+rpl_private void cmdtable_free(cmdtable_t * ct);
+rpl_private bool cmdtable_for_each(cmdtable_t * ct, const char *prefix,
+                                   cmdtable_fun_t * fun, void *arg);
+rpl_private void cmdtable_invalidate(cmdtable_t * ct);
+
 //-------------------------------------------------------------
 // Completion environment
 //-------------------------------------------------------------
@@ -51,9 +107,11 @@ struct rpl_completion_env_s {
 	rpl_env_t *env;             // the repline environment
 	const char *input;          // current full input
 	long cursor;                // current cursor position
-	void *arg;                  // argument given to `rpl_set_completer`
+	void *arg;                  // argument given with the completer
 	void *closure;              // free variables for function composition
 	rpl_completion_fun_t *complete; // function that adds a completion
+	completions_t *cms;         // the completions being generated
+	rpl_completion_context_t context;   // context of the word being completed
 };
 
 #endif                          // RPL_COMPLETIONS_H
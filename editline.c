@@ -10,6 +10,7 @@
 #include "completions.h"
 #include "undo.h"
 #include "highlight.h"
+#include "fuzzy.h"
 
 //-------------------------------------------------------------
 // The editor state
@@ -20,15 +21,21 @@ typedef struct editor_s {
 	stringbuf_t *extra;         // extra displayed info (for completion menu etc)
 	stringbuf_t *hint;          // hint displayed as part of the input
 	stringbuf_t *hint_help;     // help for a hint.
+	stringbuf_t *hint_fuzzy;    // fuzzy match of the history, shown below the input
+	stringbuf_t *menu;          // rendered completion menu, shown after `extra`
+	attrbuf_t *attrs_menu;      // ... and its attributes
 	ssize_t pos;                // current cursor position in the input
 	ssize_t cur_rows;           // current used rows to display our content (including extra content)
 	ssize_t cur_row;            // current row that has the cursor (0 based, relative to the prompt)
+	ssize_t cur_col;            // current column of the cursor (including the prompt)
+	ssize_t menu_row;           // row of the first menu row, or -1 if menu rows can not be redrawn in place
 	ssize_t termw;
 	bool modified;              // has a modification happened? (used for history navigation for example)  
 	bool disable_undo;          // temporarily disable auto undo (for history search)
 	ssize_t history_idx;        // current index in the history 
+	history_cursor_t *history_cur;  // cursor for walking the history (matches history_idx)
 	ssize_t history_widx;       // current history index when browsing history by word
-	ssize_t history_wpos;       // current position of word in the history 
+	ssize_t history_wpos;       // current word in that entry, counted from the last one
 	editstate_t *undo;          // undo buffer  
 	editstate_t *redo;          // redo buffer
 	const char *prompt_text;    // text of the prompt before the prompt marker    
@@ -70,6 +77,7 @@ rpl_editline(rpl_env_t * env, const char *prompt_text)
 {
 	tty_start_raw(env->tty);
 	term_start_raw(env->term);
+	completions_forget(env->completions);
 	char *line = edit_line(env, prompt_text);
 	term_end_raw(env->term, false);
 	tty_end_raw(env->tty);
@@ -317,6 +325,45 @@ edit_refresh_rows(rpl_env_t * env, editor_t * eb, stringbuf_t * input,
 	                  &edit_refresh_rows_iter, &info, NULL);
 }
 
+// render the rows shown below the input (like a completion menu), or NULL if
+// there are none; `menu_pos` is set to the offset of the menu (-1 if none)
+static stringbuf_t *
+edit_render_extra(rpl_env_t * env, editor_t * eb, attrbuf_t * attrs,
+                  ssize_t * menu_pos)
+{
+	if (menu_pos != NULL)
+		*menu_pos = -1;
+	if (sbuf_len(eb->extra) == 0 && sbuf_len(eb->hint_fuzzy) == 0
+	    && sbuf_len(eb->menu) == 0)
+		return NULL;
+	stringbuf_t *extra = sbuf_new(eb->mem);
+	if (extra == NULL)
+		return NULL;
+	if (sbuf_len(eb->hint_help) > 0) {
+		bbcode_append(env->bbcode, sbuf_string(eb->hint_help), extra, attrs);
+	}
+	if (sbuf_len(eb->hint_fuzzy) > 0) {
+		stringbuf_t *line = sbuf_new(eb->mem);
+		if (line != NULL) {
+			sbuf_append(line, "[rpl-hint][!pre]");
+			sbuf_append(line, sbuf_string(eb->hint_fuzzy));
+			sbuf_append(line, "[/pre][/rpl-hint]\n");
+			bbcode_append(env->bbcode, sbuf_string(line), extra, attrs);
+			sbuf_free(line);
+		}
+	}
+	bbcode_append(env->bbcode, sbuf_string(eb->extra), extra, attrs);
+	if (sbuf_len(eb->menu) > 0) {
+		// already rendered
+		if (menu_pos != NULL)
+			*menu_pos = sbuf_len(extra);
+		ssize_t len = sbuf_len(eb->menu);
+		attrbuf_append_attrs_n(extra, attrs, sbuf_string(eb->menu),
+		                       attrbuf_attrs(eb->attrs_menu, len), len);
+	}
+	return extra;
+}
+
 static void
 edit_refresh(rpl_env_t * env, editor_t * eb)
 {
@@ -356,18 +403,8 @@ edit_refresh(rpl_env_t * env, editor_t * eb)
 #endif
 	}
 	// render extra (like a completion menu)
-	stringbuf_t *extra = NULL;
-	if (sbuf_len(eb->extra) > 0) {
-		extra = sbuf_new(eb->mem);
-		if (extra != NULL) {
-			if (sbuf_len(eb->hint_help) > 0) {
-				bbcode_append(env->bbcode, sbuf_string(eb->hint_help), extra,
-				              eb->attrs_extra);
-			}
-			bbcode_append(env->bbcode, sbuf_string(eb->extra), extra,
-			              eb->attrs_extra);
-		}
-	}
+	ssize_t menu_pos;
+	stringbuf_t *extra = edit_render_extra(env, eb, eb->attrs_extra, &menu_pos);
 	// calculate rows and row/col position
 	rowcol_t rc = { 0 };
 #ifndef INPUT_CPY
@@ -413,6 +450,20 @@ edit_refresh(rpl_env_t * env, editor_t * eb)
 	}
 	assert(last_row - first_row < termh);
 
+	// menu rows can be redrawn in place later if none scrolled off or wrapped
+	eb->menu_row = -1;
+	if (menu_pos >= 0 && first_row == 0) {
+		rowcol_t rc_menu = { 0 };
+		sbuf_get_rc_at_pos(extra, eb->termw, 0, 0, menu_pos, &rc_menu);
+		ssize_t menu_rows = 1;
+		for (const char *p = sbuf_string(eb->menu); *p != 0; p++) {
+			if (*p == '\n')
+				menu_rows++;
+		}
+		if (rc_menu.row + menu_rows == rows_extra)
+			eb->menu_row = rows_input + rc_menu.row;
+	}
+
 	// reduce flicker
 	buffer_mode_t bmode = term_set_buffer_mode(env->term, BUFFERED);
 
@@ -474,9 +525,51 @@ edit_refresh(rpl_env_t * env, editor_t * eb)
 	// update previous
 	eb->cur_rows = rows;
 	eb->cur_row = rc.row;
+	eb->cur_col = rc.col + (rc.row == 0 ? promptw : cpromptw);
 	// dump_editor(eb);
 }
 
+// Redraw row `row` of the menu in place, assuming nothing else changed since
+// the last refresh. Returns false if a full refresh is needed instead.
+static bool
+edit_refresh_menu_row(rpl_env_t * env, editor_t * eb, ssize_t row)
+{
+	if (eb->menu_row < 0 || eb->menu_row + row >= eb->cur_rows)
+		return false;
+	// find the row in the menu
+	const char *menu = sbuf_string(eb->menu);
+	ssize_t start = 0;
+	for (ssize_t r = 0; r < row; r++) {
+		const char *nl = strchr(menu + start, '\n');
+		if (nl == NULL)
+			return false;
+		start = nl - menu + 1;
+	}
+	const char *nl = strchr(menu + start, '\n');
+	ssize_t len = (nl == NULL ? sbuf_len(eb->menu) : nl - menu) - start;
+	if (str_column_width_n(menu + start, len) >= eb->termw)
+		return false;           // it wraps
+
+	buffer_mode_t bmode = term_set_buffer_mode(env->term, BUFFERED);
+	ssize_t down = eb->menu_row + row - eb->cur_row;
+	term_start_of_line(env->term);
+	term_down(env->term, down);
+	if (eb->attrs_extra == NULL) {
+		term_write_n(env->term, menu + start, len);
+	} else {
+		term_write_formatted_n(env->term, menu + start,
+		                       attrbuf_attrs(eb->attrs_menu, start + len) + start,
+		                       len);
+	}
+	term_clear_to_end_of_line(env->term);
+	term_start_of_line(env->term);
+	term_up(env->term, down);
+	term_right(env->term, eb->cur_col);
+	term_flush(env->term);
+	term_set_buffer_mode(env->term, bmode);
+	return true;
+}
+
 // clear current output
 static void
 edit_clear(rpl_env_t * env, editor_t * eb)
@@ -523,17 +616,7 @@ edit_resize(rpl_env_t * env, editor_t * eb)
 	sbuf_insert_at(eb->input, sbuf_string(eb->hint), eb->pos);  // insert used hint    
 
 	// render extra (like a completion menu)
-	stringbuf_t *extra = NULL;
-	if (sbuf_len(eb->extra) > 0) {
-		extra = sbuf_new(eb->mem);
-		if (extra != NULL) {
-			if (sbuf_len(eb->hint_help) > 0) {
-				bbcode_append(env->bbcode, sbuf_string(eb->hint_help), extra,
-				              NULL);
-			}
-			bbcode_append(env->bbcode, sbuf_string(eb->extra), extra, NULL);
-		}
-	}
+	stringbuf_t *extra = edit_render_extra(env, eb, NULL, NULL);
 	rowcol_t rc = { 0 };
 	const ssize_t rows_input =
 	    sbuf_get_wrapped_rc_at_pos(eb->input, eb->termw, newtermw, promptw,
@@ -603,6 +686,7 @@ edit_refresh_hint(rpl_env_t * env, editor_t * eb)
 static void
 edit_refresh_history_hint(rpl_env_t *env, editor_t *eb)
 {
+	sbuf_clear(eb->hint_fuzzy);
 #if 0
 	FILE *logfile = fopen("/tmp/repline.log", "a");
 	fprintf(logfile, "refresh history hint, edit buffer size: %ld, edit_buf: '%s'\n",
@@ -642,9 +726,6 @@ edit_refresh_history_hint(rpl_env_t *env, editor_t *eb)
 		sbuf_replace(eb->hint, entry + sbuf_len(eb->input));
 		if (eb->history_idx == 0)
 			eb->history_idx++;
-#ifdef RPL_HIST_IMPL_SQLITE
-		env->mem->free((char *)entry);
-#endif
 	} else {
 #if 0
 		FILE *logfile = fopen("/tmp/repline.log", "a");
@@ -656,6 +737,12 @@ edit_refresh_history_hint(rpl_env_t *env, editor_t *eb)
 		eb->history_idx = 0;
 		eb->history_widx = 0;
 		eb->history_wpos = 0;
+		// no entry starts with the input: show the best fuzzy match instead
+		if (env->fuzzy && !env->no_hint && sbuf_len(eb->input) >= 2) {
+			entry = history_get_fuzzy(env->history, sbuf_string(eb->input));
+			if (entry != NULL)
+				sbuf_replace(eb->hint_fuzzy, entry);
+		}
 	}
 	// if (eb->modified) {
 	// eb->history_idx = 0;
@@ -1089,6 +1176,15 @@ static void
 edit_move_hint_to_input(rpl_env_t * env, editor_t * eb)
 {
 	rpl_unused(env);
+	if (sbuf_len(eb->hint) == 0 && sbuf_len(eb->hint_fuzzy) > 0) {
+		// take the fuzzy match as a whole
+		sbuf_replace(eb->input, sbuf_string(eb->hint_fuzzy));
+		sbuf_clear(eb->hint_fuzzy);
+		eb->pos = sbuf_len(eb->input);
+		eb->modified = true;
+		edit_refresh(env, eb);
+		return;
+	}
 	if (sbuf_len(eb->hint) == 0)
 		return;
 	// debug_msg("HINT BEFORE: %s\n", sbuf_string(eb->hint));
@@ -1157,6 +1253,21 @@ edit_move_line_hint_to_input(rpl_env_t * env, editor_t * eb)
 // Edit line: main edit loop
 //-------------------------------------------------------------
 
+/// Blocking read of a key, using the wait for history lookups ahead of time
+static code_t
+edit_read_idle(rpl_env_t * env, editor_t * eb)
+{
+	if (env->history_prefetch) {
+		history_prefetch_from(env->history, sbuf_string(eb->input));
+		code_t c;
+		while (history_prefetch_step(env->history)) {
+			if (tty_read_timeout(env->tty, 0, &c))
+				return c;
+		}
+	}
+	return tty_read(env->tty);
+}
+
 static char *
 edit_line(rpl_env_t * env, const char *prompt_text)
 {
@@ -1168,6 +1279,10 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 	eb.extra = sbuf_new(env->mem);
 	eb.hint = sbuf_new(env->mem);
 	eb.hint_help = sbuf_new(env->mem);
+	eb.hint_fuzzy = sbuf_new(env->mem);
+	eb.menu = sbuf_new(env->mem);
+	eb.attrs_menu = attrbuf_new(env->mem);
+	eb.menu_row = -1;
 	eb.termw = term_get_width(env->term);
 	eb.pos = 0;
 	eb.cur_rows = 1;
@@ -1180,7 +1295,8 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 	editstate_init(&eb.undo);
 	editstate_init(&eb.redo);
 	if (eb.input == NULL || eb.extra == NULL || eb.hint == NULL
-	    || eb.hint_help == NULL) {
+	    || eb.hint_help == NULL || eb.hint_fuzzy == NULL || eb.menu == NULL
+	    || eb.attrs_menu == NULL) {
 		return NULL;
 	}
 	// caching
@@ -1203,7 +1319,7 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 		term_flush(env->term);
 		if (env->hint_delay <= 0 || sbuf_len(eb.hint) == 0) {
 			// blocking read
-			c = tty_read(env->tty);
+			c = edit_read_idle(env, &eb);
 		} else {
 			// timeout to display hint
 			if (!tty_read_timeout(env->tty, env->hint_delay, &c)) {
@@ -1212,7 +1328,7 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 					// display hint
 					edit_refresh(env, &eb);
 				}
-				c = tty_read(env->tty);
+				c = edit_read_idle(env, &eb);
 			} else {
 				// clear the pending hint if we got input before the delay expired
 				sbuf_clear(eb.hint);
@@ -1293,6 +1409,10 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 			case KEY_CTRL_N:
 				edit_history_next(env, &eb);
 				break;
+			case KEY_CTRL_R:
+			case KEY_CTRL_S:
+				edit_history_search_with_current_word(env, &eb);
+				break;
 			case KEY_CTRL_L:
 				edit_clear_screen(env, &eb);
 				break;
@@ -1407,8 +1527,6 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 				break;
 			case KEY_CTRL_O:
 			case KEY_CTRL_Q:
-			case KEY_CTRL_R:
-			case KEY_CTRL_S:
 			case KEY_CTRL_V:
 			case KEY_CTRL_X:
 			case KEY_ESC:
@@ -1441,6 +1559,7 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 
 	// goto end
 	eb.pos = sbuf_len(eb.input);
+	sbuf_clear(eb.hint_fuzzy);
 
 	// refresh once more but without brace matching
 	bool bm = env->no_bracematch;
@@ -1459,7 +1578,12 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 		res = sbuf_strdup(eb.input);
 	}
 
-	// update history
+	// wait for a cancelled completion job, its completer may still run
+	completions_job_reap(env->completions);
+
+	// update history (the cursor must not outlive a change)
+	history_cursor_free(eb.history_cur);
+	eb.history_cur = NULL;
 	/// NOTE history_update() and history_push() are the same with sqlite backend
 	// history_update(env->history, sbuf_string(eb.input));
 	history_push(env->history, sbuf_string(eb.input));
@@ -1475,6 +1599,9 @@ edit_line(rpl_env_t * env, const char *prompt_text)
 	sbuf_free(eb.extra);
 	sbuf_free(eb.hint);
 	sbuf_free(eb.hint_help);
+	sbuf_free(eb.hint_fuzzy);
+	sbuf_free(eb.menu);
+	attrbuf_free(eb.attrs_menu);
 
 	return res;
 }
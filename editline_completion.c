@@ -19,6 +19,134 @@ edit_complete(rpl_env_t *env, editor_t *eb, ssize_t idx)
 }
 
 
+//-------------------------------------------------------------
+// Menu cache
+//
+// The column width of every completion and its rendered cell
+// (text and attributes) are computed once per menu. Moving the
+// selection only assembles the rows from the cells again, and
+// redraws the rows that changed if the screen allows it.
+//-------------------------------------------------------------
+
+typedef struct menu_cell_s {
+	stringbuf_t *text;          // rendered cell (NULL if not rendered yet)
+	attrbuf_t *attrs;
+} menu_cell_t;
+
+typedef struct menu_s {
+	alloc_t *mem;
+	ssize_t len;                // completions the arrays have room for
+	ssize_t *widths;            // column width of each completion (-1 if not measured yet)
+	menu_cell_t *cells;         // cells of completion `i`: [2*i] plain, [2*i+1] selected
+	ssize_t cell_width;         // the column width the cells are rendered for
+} menu_t;
+
+// The completions shown: `columns` columns of `percolumn` rows each, from
+// completion `first` on; completion `first + col*percolumn + row` is shown in
+// `row` and `col` (if it is less than `first + shown`).
+typedef struct menu_layout_s {
+	ssize_t first;
+	ssize_t shown;
+	ssize_t columns;
+	ssize_t percolumn;
+	ssize_t width;              // column width (-1 to not pad)
+} menu_layout_t;
+
+static void
+menu_init(menu_t *menu, alloc_t *mem)
+{
+	memset(menu, 0, sizeof(*menu));
+	menu->mem = mem;
+	menu->cell_width = -1;
+}
+
+static void
+menu_cell_done(menu_cell_t *cell)
+{
+	sbuf_free(cell->text);
+	attrbuf_free(cell->attrs);
+	cell->text = NULL;
+	cell->attrs = NULL;
+}
+
+// forget all widths and cells (when the completions changed order)
+static void
+menu_reset(menu_t *menu)
+{
+	for (ssize_t i = 0; i < menu->len; i++) {
+		menu->widths[i] = -1;
+		menu_cell_done(&menu->cells[2 * i]);
+		menu_cell_done(&menu->cells[2 * i + 1]);
+	}
+}
+
+static void
+menu_done(menu_t *menu)
+{
+	menu_reset(menu);
+	mem_free(menu->mem, menu->widths);
+	mem_free(menu->mem, menu->cells);
+	memset(menu, 0, sizeof(*menu));
+}
+
+// make room for completion `idx`
+static bool
+menu_ensure(menu_t *menu, ssize_t idx)
+{
+	if (idx < menu->len)
+		return true;
+	ssize_t newlen = (menu->len <= 0 ? 16 : 2 * menu->len);
+	while (newlen <= idx) {
+		newlen *= 2;
+	}
+	ssize_t *widths = mem_realloc_tp(menu->mem, ssize_t, menu->widths, newlen);
+	if (widths == NULL)
+		return false;
+	menu->widths = widths;
+	menu_cell_t *cells = mem_realloc_tp(menu->mem, menu_cell_t, menu->cells, 2 * newlen);
+	if (cells == NULL)
+		return false;
+	menu->cells = cells;
+	for (ssize_t i = menu->len; i < newlen; i++) {
+		menu->widths[i] = -1;
+		memset(&menu->cells[2 * i], 0, 2 * sizeof(menu_cell_t));
+	}
+	menu->len = newlen;
+	return true;
+}
+
+// column width of the display (and help) of completion `idx`
+static ssize_t
+menu_width(menu_t *menu, rpl_env_t *env, ssize_t idx)
+{
+	if (menu_ensure(menu, idx) && menu->widths[idx] >= 0)
+		return menu->widths[idx];
+	const char *help = NULL;
+	const char *display = completions_get_display(env->completions, idx, &help);
+	if (display == NULL)
+		return 0;
+	ssize_t w = bbcode_column_width(env->bbcode, display);
+	if (help != NULL) {
+		w += 2 + bbcode_column_width(env->bbcode, help);
+	}
+	if (idx < menu->len)
+		menu->widths[idx] = w;
+	return w;
+}
+
+static ssize_t
+menu_max_width(menu_t *menu, rpl_env_t *env, ssize_t count)
+{
+	ssize_t max_width = 0;
+	for (ssize_t i = 0; i < count; i++) {
+		ssize_t w = menu_width(menu, env, i);
+		if (w > max_width) {
+			max_width = w;
+		}
+	}
+	return max_width;
+}
+
 rpl_private void
 sbuf_append_tagged(stringbuf_t *sb, const char *tag, const char *content)
 {
@@ -27,8 +155,9 @@ sbuf_append_tagged(stringbuf_t *sb, const char *tag, const char *content)
 	sbuf_append(sb, "[/]");
 }
 
+// append the markup of completion `idx` to `sb`
 static void
-editor_append_completion(rpl_env_t *env, editor_t *eb, ssize_t idx,
+editor_append_completion(rpl_env_t *env, stringbuf_t *sb, ssize_t idx,
                          ssize_t width, bool numbered, bool selected)
 {
 	const char *help = NULL;
@@ -36,159 +165,386 @@ editor_append_completion(rpl_env_t *env, editor_t *eb, ssize_t idx,
 	if (display == NULL)
 		return;
 	if (numbered) {
-		sbuf_appendf(eb->extra, "[rpl-info]%s%zd [/]",
+		sbuf_appendf(sb, "[rpl-info]%s%zd [/]",
 		             (selected ? (tty_is_utf8(env->tty) ? "\xE2\x86\x92" : "*")
 		              : " "), 1 + idx);
 		width -= 3;
 	}
 
 	if (width > 0) {
-		sbuf_appendf(eb->extra, "[width=\"%zd;left; ;on\"]", width);
+		sbuf_appendf(sb, "[width=\"%zd;left; ;on\"]", width);
 	}
 	if (selected) {
-		sbuf_append(eb->extra, "[rpl-emphasis]");
+		sbuf_append(sb, "[rpl-emphasis]");
 	}
-	sbuf_append(eb->extra, display);
+	sbuf_append(sb, display);
 	if (selected) {
-		sbuf_append(eb->extra, "[/rpl-emphasis]");
+		sbuf_append(sb, "[/rpl-emphasis]");
 	}
 	if (help != NULL) {
-		sbuf_append(eb->extra, "  ");
-		sbuf_append_tagged(eb->extra, "rpl-info", help);
+		sbuf_append(sb, "  ");
+		sbuf_append_tagged(sb, "rpl-info", help);
 	}
 	if (width > 0) {
-		sbuf_append(eb->extra, "[/width]");
+		sbuf_append(sb, "[/width]");
 	}
 }
 
-// 2 and 3 column output up to 80 wide
-#define RPL_DISPLAY2_MAX    34
-#define RPL_DISPLAY2_COL    (3+RPL_DISPLAY2_MAX)
-#define RPL_DISPLAY2_WIDTH  (2*RPL_DISPLAY2_COL + 2)    // 75
+// the rendered (numbered) cell of completion `idx`, or NULL if there is none
+static menu_cell_t *
+menu_cell(menu_t *menu, rpl_env_t *env, ssize_t idx, ssize_t width,
+          bool selected)
+{
+	if (idx >= completions_count(env->completions) || !menu_ensure(menu, idx))
+		return NULL;
+	if (width != menu->cell_width) {
+		for (ssize_t i = 0; i < menu->len; i++) {
+			menu_cell_done(&menu->cells[2 * i]);
+			menu_cell_done(&menu->cells[2 * i + 1]);
+		}
+		menu->cell_width = width;
+	}
+	menu_cell_t *cell = &menu->cells[2 * idx + (selected ? 1 : 0)];
+	if (cell->text != NULL)
+		return cell;
+	stringbuf_t *markup = sbuf_new(menu->mem);
+	cell->text = sbuf_new(menu->mem);
+	cell->attrs = attrbuf_new(menu->mem);
+	if (markup == NULL || cell->text == NULL || cell->attrs == NULL) {
+		sbuf_free(markup);
+		menu_cell_done(cell);
+		return NULL;
+	}
+	editor_append_completion(env, markup, idx, width, true, selected);
+	bbcode_append(env->bbcode, sbuf_string(markup), cell->text, cell->attrs);
+	sbuf_free(markup);
+	return cell;
+}
 
-#define RPL_DISPLAY3_MAX    21
-#define RPL_DISPLAY3_COL    (3+RPL_DISPLAY3_MAX)
-#define RPL_DISPLAY3_WIDTH  (3*RPL_DISPLAY3_COL + 2*2)  // 76
+// render the rows of the layout with `selected` highlighted into `eb->menu`
+static void
+edit_menu_render(rpl_env_t *env, editor_t *eb, menu_t *menu,
+                 const menu_layout_t *lay, ssize_t selected)
+{
+	sbuf_clear(eb->menu);
+	attrbuf_clear(eb->attrs_menu);
+	for (ssize_t row = 0; row < lay->percolumn; row++) {
+		if (row > 0)
+			attrbuf_append_n(eb->menu, eb->attrs_menu, "\n", 1, attr_none());
+		for (ssize_t col = 0; col < lay->columns; col++) {
+			ssize_t idx = lay->first + col * lay->percolumn + row;
+			if (col > 0)
+				attrbuf_append_n(eb->menu, eb->attrs_menu, "  ", 2, attr_none());
+			menu_cell_t *cell = menu_cell(menu, env, idx, lay->width, idx == selected);
+			if (cell == NULL)
+				continue;
+			ssize_t len = sbuf_len(cell->text);
+			attrbuf_append_attrs_n(eb->menu, eb->attrs_menu, sbuf_string(cell->text),
+			                       attrbuf_attrs(cell->attrs, len), len);
+		}
+	}
+}
 
+// append a line of markup (like a status line) to `eb->menu`
 static void
-editor_append_completion2(rpl_env_t *env, editor_t *eb, ssize_t col_width,
-                          ssize_t idx1, ssize_t idx2, ssize_t selected)
+edit_menu_append_line(rpl_env_t *env, editor_t *eb, const char *markup)
 {
-	editor_append_completion(env, eb, idx1, col_width, true,
-	                         (idx1 == selected));
-	sbuf_append(eb->extra, "  ");
-	editor_append_completion(env, eb, idx2, col_width, true,
-	                         (idx2 == selected));
+	if (sbuf_len(eb->menu) > 0)
+		attrbuf_append_n(eb->menu, eb->attrs_menu, "\n", 1, attr_none());
+	bbcode_append(env->bbcode, markup, eb->menu, eb->attrs_menu);
 }
 
 static void
-editor_append_completion3(rpl_env_t *env, editor_t *eb, ssize_t col_width,
-                          ssize_t idx1, ssize_t idx2, ssize_t idx3,
-                          ssize_t selected)
+edit_menu_clear(editor_t *eb)
 {
-	editor_append_completion(env, eb, idx1, col_width, true,
-	                         (idx1 == selected));
-	sbuf_append(eb->extra, "  ");
-	editor_append_completion(env, eb, idx2, col_width, true,
-	                         (idx2 == selected));
-	sbuf_append(eb->extra, "  ");
-	editor_append_completion(env, eb, idx3, col_width, true,
-	                         (idx3 == selected));
+	sbuf_clear(eb->menu);
+	attrbuf_clear(eb->attrs_menu);
 }
 
-static ssize_t
-edit_completions_max_width(rpl_env_t *env, ssize_t count)
+// The menu on screen showed `prev` selected and `eb->menu` now has `selected`:
+// only redraw the rows of both. Returns false if a full refresh is needed.
+static bool
+edit_menu_redraw(rpl_env_t *env, editor_t *eb, const menu_layout_t *lay,
+                 ssize_t prev, ssize_t selected)
 {
-	ssize_t max_width = 0;
-	for (ssize_t i = 0; i < count; i++) {
-		const char *help = NULL;
-		ssize_t w =
-		    bbcode_column_width(env->bbcode,
-		                        completions_get_display(env->completions, i,
-		                                                &help));
-		if (help != NULL) {
-			w += 2 + bbcode_column_width(env->bbcode, help);
-		}
-		if (w > max_width) {
-			max_width = w;
-		}
+	ssize_t idx[2] = { prev, selected };
+	for (ssize_t i = 0; i < 2; i++) {
+		if (idx[i] < lay->first || idx[i] >= lay->first + lay->shown)
+			continue;
+		if (i == 1 && (idx[1] - lay->first) % lay->percolumn ==
+		    (idx[0] - lay->first) % lay->percolumn)
+			continue;           // the same row
+		if (!edit_refresh_menu_row(env, eb, (idx[i] - lay->first) % lay->percolumn))
+			return false;
 	}
-	return max_width;
+	return true;
 }
 
-static void
-edit_completion_menu(rpl_env_t *env, editor_t *eb, bool more_available)
-{
-	ssize_t count = completions_count(env->completions);
-	ssize_t count_displayed = count;
-	assert(count > 1);
-	ssize_t selected = (env->complete_nopreview ? 0 : -1);  // select first or none
-	ssize_t percolumn = count;
+// 2 and 3 column output up to 80 wide
+#define RPL_DISPLAY2_MAX    34
+#define RPL_DISPLAY2_COL    (3+RPL_DISPLAY2_MAX)
+#define RPL_DISPLAY2_WIDTH  (2*RPL_DISPLAY2_COL + 2)    // 75
 
- again:
-	// show first 9 (or 8) completions
-	sbuf_clear(eb->extra);
+#define RPL_DISPLAY3_MAX    21
+#define RPL_DISPLAY3_COL    (3+RPL_DISPLAY3_MAX)
+#define RPL_DISPLAY3_WIDTH  (3*RPL_DISPLAY3_COL + 2*2)  // 76
+
+// lay out the first 9 (or 8) completions and render them into `eb->menu`;
+// returns how many are shown
+static ssize_t
+edit_completion_layout(rpl_env_t *env, editor_t *eb, menu_t *menu,
+                       menu_layout_t *lay, ssize_t count, ssize_t selected)
+{
 	ssize_t twidth = term_get_width(env->term) - 1;
 	ssize_t colwidth;
+	lay->first = 0;
 	if (count > 3
-	    && ((colwidth = 3 + edit_completions_max_width(env, 9)) * 3 + 2 * 2) <
+	    && ((colwidth = 3 + menu_max_width(menu, env, 9)) * 3 + 2 * 2) <
 	    twidth) {
 		// display as a 3 column block
-		count_displayed = (count > 9 ? 9 : count);
-		percolumn = 3;
-		for (ssize_t rw = 0; rw < percolumn; rw++) {
-			if (rw > 0)
-				sbuf_append(eb->extra, "\n");
-			editor_append_completion3(env, eb, colwidth, rw, percolumn + rw,
-			                          (2 * percolumn) + rw, selected);
-		}
+		lay->shown = (count > 9 ? 9 : count);
+		lay->columns = 3;
+		lay->percolumn = 3;
+		lay->width = colwidth;
 	} else if (count > 4
-	           && ((colwidth = 3 + edit_completions_max_width(env, 8)) * 2 +
+	           && ((colwidth = 3 + menu_max_width(menu, env, 8)) * 2 +
 	               2) < twidth) {
 		// display as a 2 column block if some entries are too wide for three columns
-		count_displayed = (count > 8 ? 8 : count);
-		percolumn = (count_displayed <= 6 ? 3 : 4);
-		for (ssize_t rw = 0; rw < percolumn; rw++) {
-			if (rw > 0)
-				sbuf_append(eb->extra, "\n");
-			editor_append_completion2(env, eb, colwidth, rw, percolumn + rw,
-			                          selected);
-		}
+		lay->shown = (count > 8 ? 8 : count);
+		lay->columns = 2;
+		lay->percolumn = (lay->shown <= 6 ? 3 : 4);
+		lay->width = colwidth;
 	} else {
 		// display as a list
-		count_displayed = (count > 9 ? 9 : count);
-		percolumn = count_displayed;
-		for (ssize_t i = 0; i < count_displayed; i++) {
-			if (i > 0)
-				sbuf_append(eb->extra, "\n");
-			editor_append_completion(env, eb, i, -1, true /* numbered */ ,
-			                         selected == i);
+		lay->shown = (count > 9 ? 9 : count);
+		lay->columns = 1;
+		lay->percolumn = lay->shown;
+		lay->width = -1;
+	}
+	edit_menu_render(env, eb, menu, lay, selected);
+	return lay->shown;
+}
+
+#define RPL_COMPLETION_WAIT          (20)   // ms to wait before polling for input
+#define RPL_COMPLETION_POLL          (20)   // ms between polls for input
+#define RPL_COMPLETION_PARTIAL_DELAY (250)  // ms before showing the completions found so far
+
+// Scrollable list of all completions. Only the rows that fit on the terminal
+// are rendered; if `more_available`, all further completions are generated
+// while the list is shown. Returns a key to handle after the list (or 0).
+static code_t
+edit_completion_list(rpl_env_t *env, editor_t *eb, menu_t *menu,
+                     ssize_t selected, bool more_available)
+{
+	completions_t *cms = env->completions;
+	bool generating = false;
+	if (more_available) {
+		if (env->complete_async
+		    && completions_job_start(cms, sbuf_string(eb->input), eb->pos,
+		                             RPL_MAX_COMPLETIONS_ALL)) {
+			// the job starts from an empty list, so no cached cell is valid
+			menu_reset(menu);
+			generating = !completions_job_wait(cms, RPL_COMPLETION_WAIT);
+			if (generating) {
+				completions_job_partial(cms);
+			} else {
+				completions_job_finish(cms);
+				completions_sort(cms);
+				menu_reset(menu);
+			}
+		} else {
+			completions_generate(env, eb, RPL_MAX_COMPLETIONS_ALL);
+			completions_sort(cms);
+			menu_reset(menu);
 		}
 	}
-	if (count > count_displayed) {
-		if (more_available) {
-			sbuf_append(eb->extra,
-			            "\n[rpl-info](press page-down (or ctrl-j) to see all further completions)[/]");
+	ssize_t top = 0;            // first row shown
+	ssize_t jump = 0;           // index typed so far (0 if none)
+	bool moved = false;         // has the user moved the selection?
+	menu_layout_t lay;          // the rows on screen
+	memset(&lay, 0, sizeof(lay));
+	ssize_t shown = -1;         // selection on screen (-1 if the list needs a refresh)
+	ssize_t shown_rows = 0;     // rows that fit on screen
+	if (selected < 0)
+		selected = 0;
+	code_t c = 0;
+	while (true) {
+		// render the rows that fit below the input with a status line
+		ssize_t count = completions_count(cms);
+		rowcol_t rc;
+		ssize_t rows = term_get_height(env->term) - edit_get_rowcol(env, eb, &rc) - 1;
+		if (rows < 1)
+			rows = 1;
+		if (selected >= count)
+			selected = (count > 0 ? count - 1 : 0);
+		if (selected < top)
+			top = selected;
+		else if (selected >= top + rows)
+			top = selected - rows + 1;
+		ssize_t visible = (top + rows < count ? rows : count - top);
+		bool same = (shown >= 0 && rows == shown_rows && lay.first == top
+		             && lay.shown == visible);
+		lay.first = top;
+		lay.shown = visible;
+		lay.columns = 1;
+		lay.percolumn = (visible > 0 ? visible : 1);
+		lay.width = -1;
+		edit_menu_render(env, eb, menu, &lay, selected);
+		stringbuf_t *status = sbuf_new(eb->mem);
+		if (status != NULL) {
+			sbuf_appendf(status, "[rpl-info](%zd-%zd of %zd%s",
+			             (count > 0 ? top + 1 : 0),
+			             (top + rows < count ? top + rows : count), count,
+			             (generating ? ", searching" : ""));
+			if (jump > 0)
+				sbuf_appendf(status, "; go to %zd", jump);
+			sbuf_append(status, ")[/]");
+			edit_menu_append_line(env, eb, sbuf_string(status));
+			sbuf_free(status);
+		}
+		// if only the selection moved within the same rows, redraw just those
+		if (!same || !edit_menu_redraw(env, eb, &lay, shown, selected))
+			edit_refresh(env, eb);
+		shown = (generating || jump > 0 ? -1 : selected);
+		shown_rows = rows;
+
+		// read a key; while generating, show new results as they come in
+		if (generating) {
+			if (!tty_read_timeout(env->tty, RPL_COMPLETION_POLL, &c)) {
+				if (completions_job_wait(cms, 0)) {
+					// sort, and keep the selected completion if the user moved to it
+					const char *sel = completions_get_replacement(cms, selected);
+					char *cur = (sel == NULL || !moved ? NULL : mem_strdup(env->mem, sel));
+					completions_job_finish(cms);
+					completions_sort(cms);
+					menu_reset(menu);
+					if (cur != NULL) {
+						selected = completions_index_of(cms, cur);
+						mem_free(env->mem, cur);
+					}
+					generating = false;
+				} else {
+					completions_job_partial(cms);
+				}
+				continue;
+			}
 		} else {
-			sbuf_appendf(eb->extra,
-			             "\n[rpl-info](press page-down (or ctrl-j) to see all %zd completions)[/]",
+			c = tty_read(env->tty);
+		}
+		if (tty_term_resize_event(env->tty)) {
+			edit_resize(env, eb);
+			shown = -1;
+		}
+
+		moved = true;
+		if (c == KEY_DOWN || c == KEY_TAB) {
+			selected++;
+		} else if (c == KEY_UP || c == KEY_SHIFT_TAB) {
+			if (selected > 0)
+				selected--;
+		} else if (c == KEY_PAGEDOWN || c == KEY_LINEFEED) {
+			selected += rows;
+			top += rows;
+		} else if (c == KEY_PAGEUP) {
+			selected = (selected > rows ? selected - rows : 0);
+			top = (top > rows ? top - rows : 0);
+		} else if (c == KEY_HOME) {
+			selected = 0;
+		} else if (c >= '0' && c <= '9') {
+			// jump to an index
+			jump = 10 * jump + (c - '0');
+			if (jump > count && !generating)
+				jump = c - '0';
+			if (jump > 0)
+				selected = jump - 1;
+			shown = -1;
+			continue;
+		} else if (c == KEY_BACKSP && jump > 0) {
+			jump /= 10;
+			if (jump > 0)
+				selected = jump - 1;
+			shown = -1;
+			continue;
+		} else if (c == KEY_ENTER || c == KEY_RIGHT || c == KEY_END) {
+			completions_job_cancel(cms);
+			edit_menu_clear(eb);
+			if (!edit_complete(env, eb, selected))
+				edit_refresh(env, eb);
+			return 0;
+		} else {
+			// leave the list (and handle the key unless it is escape)
+			completions_job_cancel(cms);
+			edit_menu_clear(eb);
+			edit_refresh(env, eb);
+			return (c == KEY_ESC ? 0 : c);
+		}
+		if (jump > 0)
+			shown = -1;         // the status line changes
+		jump = 0;
+	}
+}
+
+// append how to see further completions if not all are shown
+static void
+edit_completion_menu_info(rpl_env_t *env, editor_t *eb, ssize_t count,
+                          ssize_t count_displayed, bool more_available)
+{
+	if (count <= count_displayed)
+		return;
+	if (more_available) {
+		edit_menu_append_line(env, eb,
+		                      "[rpl-info](press page-down (or ctrl-j) to see all further completions)[/]");
+	} else {
+		stringbuf_t *info = sbuf_new(eb->mem);
+		if (info != NULL) {
+			sbuf_appendf(info,
+			             "[rpl-info](press page-down (or ctrl-j) to see all %zd completions)[/]",
 			             count);
+			edit_menu_append_line(env, eb, sbuf_string(info));
+			sbuf_free(info);
 		}
 	}
-	if (!env->complete_nopreview && selected >= 0
-	    && selected <= count_displayed) {
-		edit_complete(env, eb, selected);
-		editor_undo_restore(eb, false);
+}
+
+static void
+edit_completion_menu(rpl_env_t *env, editor_t *eb, bool more_available)
+{
+	ssize_t count = completions_count(env->completions);
+	ssize_t count_displayed = count;
+	assert(count > 1);
+	ssize_t selected = (env->complete_nopreview ? 0 : -1);  // select first or none
+	menu_t menu;
+	menu_init(&menu, env->mem);
+	menu_layout_t lay;
+	memset(&lay, 0, sizeof(lay));
+	ssize_t shown = -2;         // selection on screen (-2 if the menu needs a refresh)
+
+ again:
+	if (shown == -2 || !env->complete_nopreview) {
+		count_displayed = edit_completion_layout(env, eb, &menu, &lay, count, selected);
+		edit_completion_menu_info(env, eb, count, count_displayed, more_available);
+		if (!env->complete_nopreview && selected >= 0
+		    && selected <= count_displayed) {
+			edit_complete(env, eb, selected);
+			editor_undo_restore(eb, false);
+		} else {
+			edit_refresh(env, eb);
+		}
 	} else {
-		edit_refresh(env, eb);
+		// without a preview only the selection changed
+		edit_menu_render(env, eb, &menu, &lay, selected);
+		edit_completion_menu_info(env, eb, count, count_displayed, more_available);
+		if (!edit_menu_redraw(env, eb, &lay, shown, selected))
+			edit_refresh(env, eb);
 	}
+	shown = selected;
 
 	// read here; if not a valid key, push it back and return to main event loop
 	code_t c = tty_read(env->tty);
 	if (tty_term_resize_event(env->tty)) {
 		edit_resize(env, eb);
+		shown = -2;
 	}
-	sbuf_clear(eb->extra);
 
 	// direct selection?
 	if (c >= WITH_ALT('1') && c <= WITH_ALT('9')) {
@@ -206,7 +562,10 @@ edit_completion_menu(rpl_env_t *env, editor_t *eb, bool more_available)
 			//term_beep(env->term);
 			selected = 0;
 		}
-		sbuf_clear(eb->hint);
+		if (sbuf_len(eb->hint) > 0) {
+			sbuf_clear(eb->hint);
+			shown = -2;
+		}
 		goto again;
 	} else if (c == KEY_UP || c == KEY_SHIFT_TAB) {
 		selected--;
@@ -215,8 +574,11 @@ edit_completion_menu(rpl_env_t *env, editor_t *eb, bool more_available)
 			//term_beep(env->term);
 		}
 		goto again;
-	} else if (c == KEY_F1) {
+	}
+	edit_menu_clear(eb);
+	if (c == KEY_F1) {
 		edit_show_help(env, eb);
+		shown = -2;
 		goto again;
 	} else if (c == KEY_ESC) {
 		completions_clear(env->completions);
@@ -232,52 +594,95 @@ edit_completion_menu(rpl_env_t *env, editor_t *eb, bool more_available)
 		assert(selected < count);
 		edit_complete(env, eb, selected);
 	} else if ((c == KEY_PAGEDOWN || c == KEY_LINEFEED) && count > 9) {
-		// show all completions
-		c = 0;
-		if (more_available) {
-			// generate all entries (up to the max (= 1000))
-		    completions_generate(env, eb,
-		                         RPL_MAX_COMPLETIONS_TO_SHOW);
-			count = completions_count(env->completions);
-		}
-		rowcol_t rc;
-		edit_get_rowcol(env, eb, &rc);
-		edit_clear(env, eb);
-		edit_write_prompt(env, eb, 0, false, true);
-		term_writeln(env->term, "");
-		for (ssize_t i = 0; i < count; i++) {
-			const char *display =
-			    completions_get_display(env->completions, i, NULL);
-			if (display != NULL) {
-				bbcode_println(env->bbcode, display);
-			}
-		}
-		if (count >= RPL_MAX_COMPLETIONS_TO_SHOW) {
-			bbcode_println(env->bbcode, "[rpl-info]... and more.[/]");
-		} else {
-			bbcode_printf(env->bbcode,
-			              "[rpl-info](%zd possible completions)[/]\n", count);
-		}
-		for (ssize_t i = 0; i < rc.row + 1; i++) {
-			term_write(env->term, " \n");
-		}
-		eb->cur_rows = 0;
-		edit_refresh(env, eb);
+		// browse all completions
+		c = edit_completion_list(env, eb, &menu, selected, more_available);
 	} else {
 		edit_refresh(env, eb);
 	}
 	// done
+	menu_done(&menu);
 	completions_clear(env->completions);
 	if (c != 0)
 		tty_code_pushback(env->tty, c);
 }
 
 
+// show the completions found so far while generation continues
+static void
+edit_completion_partial(rpl_env_t *env, editor_t *eb)
+{
+	completions_job_partial(env->completions);
+	ssize_t count = completions_count(env->completions);
+	edit_menu_clear(eb);
+	if (count > 0) {
+		menu_t menu;
+		menu_layout_t lay;
+		menu_init(&menu, env->mem);
+		edit_completion_layout(env, eb, &menu, &lay, count, -1);
+		menu_done(&menu);
+	}
+	stringbuf_t *info = sbuf_new(eb->mem);
+	if (info != NULL) {
+		sbuf_appendf(info, "[rpl-info](searching, %zd completions so far)[/]", count);
+		edit_menu_append_line(env, eb, sbuf_string(info));
+		sbuf_free(info);
+	}
+	edit_refresh(env, eb);
+}
+
+// Wait for the completions generated on a worker thread while polling for
+// input. Returns false if a key was pressed first: the generation is
+// cancelled, the key is pushed back, and the completions hold what was shown
+// so far (if anything).
+static bool
+edit_wait_completions(rpl_env_t *env, editor_t *eb)
+{
+	long waited = RPL_COMPLETION_WAIT;
+	bool shown = false;
+	code_t c;
+	while (!completions_job_wait(env->completions, (shown ? 0 : RPL_COMPLETION_WAIT))) {
+		if (tty_read_timeout(env->tty, RPL_COMPLETION_POLL, &c)) {
+			completions_job_cancel(env->completions);
+			if (!shown)
+				completions_clear(env->completions);
+			tty_code_pushback(env->tty, c);
+			return false;
+		}
+		waited += RPL_COMPLETION_POLL;
+		if (waited >= RPL_COMPLETION_PARTIAL_DELAY) {
+			edit_completion_partial(env, eb);
+			shown = true;
+			waited = 0;
+		}
+	}
+	completions_job_finish(env->completions);
+	completions_extend_input(env->completions, eb);
+	if (shown)
+		edit_menu_clear(eb);
+	return true;
+}
+
 static void
 edit_generate_completions(rpl_env_t *env, editor_t *eb)
 {
 	// printf("edit buffer before: '%s', pos: %ld\n", sbuf_string(eb->input), eb->pos);
-	completions_generate(env, eb, RPL_MAX_COMPLETIONS_TO_TRY);
+	sbuf_clear(eb->hint_fuzzy);
+	if (!env->complete_async
+	    || !completions_job_start(env->completions, sbuf_string(eb->input),
+	                              eb->pos, RPL_MAX_COMPLETIONS_TO_TRY)) {
+		completions_generate(env, eb, RPL_MAX_COMPLETIONS_TO_TRY);
+	} else if (!edit_wait_completions(env, eb)) {
+		// interrupted: continue in the menu with the partial results (if shown)
+		if (completions_count(env->completions) > 1) {
+			completions_sort(env->completions);
+			edit_completion_menu(env, eb, true);
+		} else {
+			completions_clear(env->completions);
+			edit_menu_clear(eb);
+			edit_refresh(env, eb);
+		}
+		return;
+	}
 	// print_completions(env);
 	bool more_available = (completions_count(env->completions) >= RPL_MAX_COMPLETIONS_TO_TRY);
 	if (completions_count(env->completions) <= 0) {
@@ -16,14 +16,30 @@ edit_history_at(rpl_env_t * env, editor_t * eb, int ofs)
 #endif
 	if (ofs < 0 && eb->history_idx + ofs < 0)
 		return;
-	if (ofs > 0 && eb->history_idx + ofs >
-	    // if (ofs < 0 && eb->history_idx < 0) return;
-	    // if (ofs > 0 && eb->history_idx >
-	    history_count_with_prefix(env->history, sbuf_string(eb->input)))
-		return;
-	const char *entry = history_get_with_prefix(env->history,
-	                                            eb->history_idx + ofs,
-	                                            sbuf_string(eb->input));
+	/// Reuse the cursor as long as input and index did not change in between
+	const char *prefix = sbuf_string(eb->input);
+	if (eb->history_cur == NULL
+	    || history_cursor_pos(eb->history_cur) != eb->history_idx
+	    || strcmp(history_cursor_prefix(eb->history_cur), prefix) != 0) {
+		history_cursor_free(eb->history_cur);
+		eb->history_cur = history_cursor_new(env->history, prefix);
+		if (eb->history_cur == NULL)
+			return;
+		// skip the entries that are already shown (as a hint)
+		while (history_cursor_pos(eb->history_cur) < eb->history_idx) {
+			if (history_cursor_prev(eb->history_cur) == NULL)
+				break;
+		}
+		eb->history_idx = history_cursor_pos(eb->history_cur);
+	}
+	const char *entry = NULL;
+	if (ofs > 0) {
+		entry = history_cursor_prev(eb->history_cur);
+		if (entry == NULL)
+			return;             // already at the oldest entry
+	} else {
+		entry = history_cursor_next(eb->history_cur);
+	}
 	debug_msg("edit history at: %d + %d, found: %s\n", eb->history_idx, ofs,
 	          entry);
 	if (entry == NULL) {
@@ -33,9 +49,6 @@ edit_history_at(rpl_env_t * env, editor_t * eb, int ofs)
 	} else {
 		// eb->history_idx += ofs;
 		sbuf_replace(eb->hint, entry + sbuf_len(eb->input));
-#ifdef RPL_HIST_IMPL_SQLITE
-		env->mem->free((char *)entry);
-#endif
 		/// TODO disabled setting cursor pos when browsing history ... check if this is ok
 #if 0
 		if (ofs > 0) {
@@ -49,7 +62,7 @@ edit_history_at(rpl_env_t * env, editor_t * eb, int ofs)
 		// edit_refresh(env, eb);
 	}
 	edit_refresh(env, eb);
-	eb->history_idx += ofs;
+	eb->history_idx = history_cursor_pos(eb->history_cur);
 }
 
 static void
@@ -64,45 +77,281 @@ edit_history_next(rpl_env_t * env, editor_t * eb)
 	edit_history_at(env, eb, -1);
 }
 
+//-------------------------------------------------------------
+// Incremental history search
+//-------------------------------------------------------------
+
+/// Undo stack of the search: either a step of the cursor, or an
+/// inserted character together with the cursor of the shorter text
+typedef struct hsearch_s {
+	struct hsearch_s *next;
+	history_cursor_t *cur;      // cursor before the character was inserted
+	bool cinsert;               // character inserted (or cursor stepped)?
+	bool backward;              // direction of the step
+} hsearch_t;
+
+static bool
+hsearch_push(alloc_t * mem, hsearch_t ** hs, history_cursor_t * cur,
+             bool cinsert, bool backward)
+{
+	hsearch_t *h = mem_zalloc_tp(mem, hsearch_t);
+	if (h == NULL)
+		return false;
+	h->cur = cur;
+	h->cinsert = cinsert;
+	h->backward = backward;
+	h->next = *hs;
+	*hs = h;
+	return true;
+}
+
+static bool
+hsearch_pop(alloc_t * mem, hsearch_t ** hs, history_cursor_t ** cur,
+            bool *cinsert, bool *backward)
+{
+	hsearch_t *h = *hs;
+	if (h == NULL)
+		return false;
+	*hs = h->next;
+	if (cur != NULL)
+		*cur = h->cur;
+	if (cinsert != NULL)
+		*cinsert = h->cinsert;
+	if (backward != NULL)
+		*backward = h->backward;
+	mem_free(mem, h);
+	return true;
+}
+
 static void
-edit_history_prev_word(rpl_env_t * env, editor_t * eb)
+hsearch_done(alloc_t * mem, hsearch_t * hs)
 {
-	/// FIXME word history doesn't go further than previous command (leave it like that?)
-	/// FIXME quote character should be provided somewhere, maybe as a global option
-	///       for completions it is in qword_closure_t->quote_chars
-	if (eb->history_wpos == 0)
-		eb->history_widx++;
-	const char *entry =
-	    history_get_with_prefix(env->history, eb->history_widx, "");
-	if (entry == NULL) {
+	while (hs != NULL) {
+		hsearch_t *next = hs->next;
+		history_cursor_free(hs->cur);
+		mem_free(mem, hs);
+		hs = next;
+	}
+}
+
+/// Open a search cursor for the current input, positioned at the most recent match
+static history_cursor_t *
+edit_history_search_open(rpl_env_t * env, editor_t * eb)
+{
+	history_cursor_t *cur = (env->fuzzy && sbuf_len(eb->input) > 0
+	                         ? history_cursor_new_fuzzy(env->history, sbuf_string(eb->input))
+	                         : history_cursor_new_search(env->history, sbuf_string(eb->input)));
+	if (cur != NULL && history_cursor_prev(cur) == NULL)
 		term_beep(env->term);
-		return;
+	return cur;
+}
+
+/// Append `entry` with the characters that match the search emphasized
+static void
+edit_history_search_append(rpl_env_t * env, editor_t * eb, const char *entry)
+{
+	const char *search = sbuf_string(eb->input);
+	ssize_t len = sbuf_len(eb->input);
+	ssize_t *positions = mem_malloc_tp_n(env->mem, ssize_t, len + 1);
+	ssize_t count = 0;
+	if (positions != NULL && len > 0) {
+		if (env->fuzzy) {
+			fuzzy_pattern_t pat;
+			fuzzy_pattern_init(&pat, search);
+			if (fuzzy_score(&pat, entry, positions) >= 0)
+				count = len;
+		} else {
+			const char *match = strstr(entry, search);
+			for (ssize_t i = 0; match != NULL && i < len; i++) {
+				positions[count++] = (match - entry) + i;
+			}
+		}
 	}
-	stringbuf_t *entry_s = sbuf_new(eb->mem);
-	sbuf_append(entry_s, entry);
-	ssize_t word_end = eb->history_wpos;
-	if (eb->history_wpos == 0) {
-		word_end = sbuf_len(entry_s) - 1;
+	// emphasize the runs of matched characters
+	ssize_t done = 0;
+	for (ssize_t i = 0; i < count;) {
+		ssize_t start = positions[i];
+		ssize_t stop = start + 1;
+		while (++i < count && positions[i] == stop) {
+			stop++;
+		}
+		if (start > done) {
+			sbuf_append(eb->extra, "[!pre]");
+			sbuf_append_n(eb->extra, entry + done, start - done);
+			sbuf_append(eb->extra, "[/pre]");
+		}
+		sbuf_append(eb->extra, "[u rpl-emphasis][!pre]");
+		sbuf_append_n(eb->extra, entry + start, stop - start);
+		sbuf_append(eb->extra, "[/pre][/u]");
+		done = stop;
 	}
-	ssize_t word_start = sbuf_find_ws_word_start(entry_s, word_end);
-	char *entry_ss = sbuf_strdup(entry_s);
-	if (*(entry_ss + word_end) == '\'') {
-		*(entry_ss + word_end) = '\0';
-		word_start = strrchr(entry_ss, '\'') - entry_ss;
+	if (entry[done] != 0) {
+		sbuf_append(eb->extra, "[!pre]");
+		sbuf_append(eb->extra, entry + done);
+		sbuf_append(eb->extra, "[/pre]");
 	}
-	// debug_msg("edit history: prev word: %d, entry: %s, start: %d, end: %d\n",
-	     // eb->history_widx, entry, word_start, word_end);
+	mem_free(env->mem, positions);
+}
+
+static void
+edit_history_search(rpl_env_t * env, editor_t * eb, const char *initial)
+{
+	// set a search prompt and remember the previous state
+	editor_undo_capture(eb);
+	eb->disable_undo = true;
+	bool old_hint = rpl_enable_hint(false);
+	const char *prompt_text = eb->prompt_text;
+	eb->prompt_text = "history search";
 	sbuf_clear(eb->hint);
-	sbuf_append_n(eb->hint, entry + word_start, word_end - word_start + 1);
-	do {
-		word_start--;
-	} while (word_start >= 0 && rpl_char_is_white(entry_ss + word_start, 1));
-	// if (word_start < 0) word_start = 0;
-	eb->history_wpos = word_start;
+	sbuf_clear(eb->hint_fuzzy);
+	sbuf_replace(eb->input, (initial != NULL ? initial : ""));
+	eb->pos = sbuf_len(eb->input);
+
+	// search state
+	hsearch_t *hs = NULL;       // search undo
+	history_cursor_t *cur = edit_history_search_open(env, eb);
+	code_t c;
+
+	// incremental search
+ again:
+	sbuf_clear(eb->extra);
+	const char *entry = (cur == NULL ? NULL : history_cursor_entry(cur));
+	if (entry != NULL) {
+		sbuf_appendf(eb->extra, "[rpl-info]%zd. [/][rpl-diminish]",
+		             history_cursor_pos(cur));
+		edit_history_search_append(env, eb, entry);
+		sbuf_append(eb->extra, "[/rpl-diminish]");
+		if (!env->no_help) {
+			sbuf_append(eb->extra, "\n[rpl-info](use tab for the next match)[/]");
+		}
+		sbuf_append(eb->extra, "\n");
+	}
+	edit_refresh(env, eb);
+
+	// wait for input
+	c = tty_read(env->tty);
+	if (tty_term_resize_event(env->tty)) {
+		edit_resize(env, eb);
+	}
+	sbuf_clear(eb->extra);
+
+	// process commands
+	if (c == KEY_ESC || c == KEY_BELL /* ^G */  || c == KEY_CTRL_C) {
+		c = 0;
+		eb->disable_undo = false;
+		editor_undo_restore(eb, false);
+	} else if (c == KEY_ENTER) {
+		c = 0;
+		editor_undo_forget(eb);
+		if (entry != NULL)
+			sbuf_replace(eb->input, entry);
+		eb->pos = sbuf_len(eb->input);
+		eb->modified = false;
+	} else if (c == KEY_BACKSP || c == KEY_CTRL_Z) {
+		// undo last search action
+		history_cursor_t *prev = NULL;
+		bool cinsert = false;
+		bool backward = false;
+		if (hsearch_pop(env->mem, &hs, &prev, &cinsert, &backward)) {
+			if (cinsert) {
+				history_cursor_free(cur);
+				cur = prev;
+				edit_backspace(env, eb);
+			} else if (backward) {
+				history_cursor_next(cur);
+			} else {
+				history_cursor_prev(cur);
+			}
+		}
+		goto again;
+	} else if (c == KEY_CTRL_R || c == KEY_TAB || c == KEY_UP) {
+		// search backward
+		if (cur != NULL && history_cursor_prev(cur) != NULL)
+			hsearch_push(env->mem, &hs, NULL, false, true);
+		else
+			term_beep(env->term);
+		goto again;
+	} else if (c == KEY_CTRL_S || c == KEY_SHIFT_TAB || c == KEY_DOWN) {
+		// search forward (but never past the most recent match)
+		if (cur != NULL && history_cursor_pos(cur) > 1
+		    && history_cursor_next(cur) != NULL)
+			hsearch_push(env->mem, &hs, NULL, false, false);
+		else
+			term_beep(env->term);
+		goto again;
+	} else if (c == KEY_F1) {
+		edit_show_help(env, eb);
+		goto again;
+	} else {
+		// insert character and search again for the longer text
+		char chr;
+		unicode_t uchr;
+		if (code_is_ascii_char(c, &chr)) {
+			edit_insert_char(env, eb, chr);
+		} else if (code_is_unicode(c, &uchr)) {
+			edit_insert_unicode(env, eb, uchr);
+		} else {
+			// ignore command
+			term_beep(env->term);
+			goto again;
+		}
+		hsearch_push(env->mem, &hs, cur, true, false);
+		cur = edit_history_search_open(env, eb);
+		goto again;
+	}
+
+	// done
+	eb->disable_undo = false;
+	hsearch_done(env->mem, hs);
+	history_cursor_free(cur);
+	eb->prompt_text = prompt_text;
+	rpl_enable_hint(old_hint);
+	edit_refresh(env, eb);
+	if (c != 0)
+		tty_code_pushback(env->tty, c);
+}
+
+/// Start an incremental search with the word before the cursor
+static void
+edit_history_search_with_current_word(rpl_env_t * env, editor_t * eb)
+{
+	char *initial = NULL;
+	ssize_t start = sbuf_find_word_start(eb->input, eb->pos);
+	if (start >= 0) {
+		const ssize_t next = sbuf_next(eb->input, start, NULL);
+		if (!rpl_char_is_idletter(sbuf_string(eb->input) + start,
+		                          (long)(next - start))) {
+			start = next;
+		}
+		if (start >= 0 && start < eb->pos) {
+			initial =
+			    mem_strndup(eb->mem, sbuf_string(eb->input) + start,
+			                eb->pos - start);
+		}
+	}
+	edit_history_search(env, eb, initial);
+	mem_free(env->mem, initial);
+}
+
+static void
+edit_history_prev_word(rpl_env_t * env, editor_t * eb)
+{
+	/// Step to the previous word, and past the first word on to the last word of the entry before
+	ssize_t widx = (eb->history_widx == 0 ? 1 : eb->history_widx);
+	ssize_t wpos = (eb->history_widx == 0 ? 0 : eb->history_wpos + 1);
+	ssize_t len = 0;
+	const char *word;
+	while ((word = history_get_word(env->history, widx, wpos, &len)) == NULL) {
+		if (widx >= history_word_entries(env->history)) {
+			term_beep(env->term);
+			return;
+		}
+		widx++;
+		wpos = 0;
+	}
+	eb->history_widx = widx;
+	eb->history_wpos = wpos;
+	sbuf_clear(eb->hint);
+	sbuf_append_n(eb->hint, word, len);
 	edit_refresh(env, eb);
-	sbuf_free(entry_s);
-	free(entry_ss);
-#ifdef RPL_HIST_IMPL_SQLITE
-	env->mem->free((char *)entry);
-#endif
 }
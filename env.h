@@ -21,6 +21,7 @@ struct rpl_env_s {
 	term_t *term;               // terminal
 	tty_t *tty;                 // keyboard (NULL if stdin is a pipe, file, etc)
 	completions_t *completions; // current completions
+	cmdtable_t *commands;       // executables on the PATH (for command completion)
 	history_t *history;         // edit history
 	bbcode_t *bbcode;           // print with bbcodes
 	const char *prompt_marker;  // the prompt marker (defaults to "> ")
@@ -35,6 +36,8 @@ struct rpl_env_s {
 	bool twoline_prompt;        // print marker on a separate line
 	bool singleline_only;       // allow only single line editing?
 	bool complete_nopreview;    // do not show completion preview for each selection in the completion menu?
+	bool complete_async;        // generate completions on a worker thread?
+	bool fuzzy;                 // fuzzy matching for completions, hints and history search?
 	bool complete_noquote;      // don't quote (file) names but escape single characters
 	bool no_multiline_indent;   // indent continuation lines to line up under the initial prompt 
 	bool no_help;               // show short help line for history search etc.
@@ -43,6 +46,9 @@ struct rpl_env_s {
 	bool no_bracematch;         // enable brace matching?
 	bool autobrace;             // enable automatic brace insertion?
 	bool no_lscolors;           // use LSCOLORS/LS_COLORS to colorize file name completions?
+	bool history_async;         // write history entries on a background thread?
+	bool history_prefetch;      // look up history hints ahead of time while idle?
+	long history_max_age;       // drop history entries older than this many days (0 for no limit)
 	long hint_delay;            // delay before displaying a hint in milliseconds
 };
 
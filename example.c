@@ -12,6 +12,7 @@
 
 // completion function defined below
 static void completer(rpl_completion_env_t * cenv, const char *prefix);
+static void word_completer(rpl_completion_env_t * cenv, const char *word);
 
 // highlighter function defined below
 static void highlighter(rpl_highlight_env_t * henv, const char *input,
@@ -45,8 +46,14 @@ main()
 	// enable completion with a default completion function
 	// rpl_set_default_completer(&completer, NULL);
 
+	// complete the first word with our own words (file names otherwise)
+	rpl_add_completer(RPL_CONTEXT_COMMAND, &word_completer, NULL);
+
 	// rpl_enable_completion_always_quote(false);
 
+	// generate completions on a worker thread (our completer is thread safe)
+	rpl_enable_completion_async(true);
+
 	// enable syntax highlighting with a highlight function
 	// rpl_set_default_highlighter(highlighter, NULL);
 
@@ -0,0 +1,358 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "fuzzy.h"
+
+//-------------------------------------------------------------
+// Fuzzy matching
+//
+// A match is scored like fzf (v1): a greedy forward scan finds
+// where the first complete match ends, a backward scan from there
+// finds the shortest window, and the window is scored with
+// bonuses for word starts and consecutive characters and with
+// penalties for gaps.
+//-------------------------------------------------------------
+
+#define FUZZY_MATCH         (16)
+#define FUZZY_BOUNDARY      (8)     // bonus: first character of a word
+#define FUZZY_CAMEL         (7)     // bonus: upper case after lower case
+#define FUZZY_CONSECUTIVE   (4)     // bonus: follows the previous match
+#define FUZZY_FIRST         (2)     // the bonus of the first pattern character counts double
+#define FUZZY_GAP_START     (3)
+#define FUZZY_GAP_EXTEND    (1)
+
+static char
+fuzzy_fold(char c)
+{
+	return (c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c);
+}
+
+static bool
+fuzzy_eq(const fuzzy_pattern_t * pat, char pc, char c)
+{
+	return (pat->ignore_case ? fuzzy_fold(pc) == fuzzy_fold(c) : pc == c);
+}
+
+static bool
+fuzzy_is_separator(char c)
+{
+	return (c == ' ' || c == '\t' || c == '/' || c == '\\' || c == '-'
+	        || c == '_' || c == '.' || c == ':' || c == '=' || c == ','
+	        || c == ';' || c == '|' || c == '\'' || c == '"');
+}
+
+static int
+fuzzy_bonus(const char *s, ssize_t i)
+{
+	if (i == 0 || fuzzy_is_separator(s[i - 1]))
+		return FUZZY_BOUNDARY;
+	if (s[i - 1] >= 'a' && s[i - 1] <= 'z' && s[i] >= 'A' && s[i] <= 'Z')
+		return FUZZY_CAMEL;
+	return 0;
+}
+
+static int
+fuzzy_mask_bit(uint8_t c)
+{
+	if (c >= 'a' && c <= 'z')
+		return (c - 'a');
+	if (c >= 'A' && c <= 'Z')
+		return (c - 'A');
+	if (c >= '0' && c <= '9')
+		return 26 + (c - '0');
+	if (c >= 0x80)
+		return 63;              // any byte of a multi-byte character
+	return 36 + (c % 27);       // the other ascii characters share bits
+}
+
+rpl_private uint64_t
+fuzzy_mask(const char *s)
+{
+	uint64_t mask = 0;
+	for (const uint8_t * p = (const uint8_t *)s; *p != 0; p++) {
+		mask |= (uint64_t) 1 << fuzzy_mask_bit(*p);
+	}
+	return mask;
+}
+
+rpl_private void
+fuzzy_pattern_init(fuzzy_pattern_t * pat, const char *text)
+{
+	pat->text = text;
+	pat->len = rpl_strlen(text);
+	pat->mask = fuzzy_mask(text);
+	pat->ignore_case = true;
+	for (ssize_t i = 0; i < pat->len; i++) {
+		if (text[i] >= 'A' && text[i] <= 'Z')
+			pat->ignore_case = false;
+	}
+}
+
+rpl_private int
+fuzzy_score(const fuzzy_pattern_t * pat, const char *s, ssize_t * positions)
+{
+	if (pat->len == 0)
+		return 0;
+	// forward: where does the first complete match end?
+	ssize_t pi = 0;
+	ssize_t end = -1;
+	for (ssize_t i = 0; s[i] != 0; i++) {
+		if (fuzzy_eq(pat, pat->text[pi], s[i]) && ++pi == pat->len) {
+			end = i;
+			break;
+		}
+	}
+	if (end < 0)
+		return -1;
+	// backward: the latest start of a match that ends there
+	ssize_t start = end;
+	pi = pat->len - 1;
+	for (ssize_t i = end; i >= 0; i--) {
+		if (fuzzy_eq(pat, pat->text[pi], s[i]) && pi-- == 0) {
+			start = i;
+			break;
+		}
+	}
+	// score the window
+	int score = 0;
+	int run_bonus = 0;          // bonus of the first character of a consecutive run
+	bool in_gap = false;
+	pi = 0;
+	for (ssize_t i = start; i <= end && pi < pat->len; i++) {
+		if (!fuzzy_eq(pat, pat->text[pi], s[i])) {
+			score -= (in_gap ? FUZZY_GAP_EXTEND : FUZZY_GAP_START);
+			in_gap = true;
+			continue;
+		}
+		int bonus = fuzzy_bonus(s, i);
+		if (pi > 0 && !in_gap) {
+			if (bonus < run_bonus)
+				bonus = run_bonus;
+			if (bonus < FUZZY_CONSECUTIVE)
+				bonus = FUZZY_CONSECUTIVE;
+		} else {
+			run_bonus = bonus;
+		}
+		if (pi == 0)
+			bonus *= FUZZY_FIRST;
+		score += FUZZY_MATCH + bonus;
+		if (positions != NULL)
+			positions[pi] = i;
+		pi++;
+		in_gap = false;
+	}
+	return (score < 0 ? 0 : score);
+}
+
+//-------------------------------------------------------------
+// Top-k selection
+//-------------------------------------------------------------
+
+// is hit `a` worse than hit `b`?
+static bool
+fuzzy_worse(const fuzzy_hit_t * a, const fuzzy_hit_t * b)
+{
+	return (a->score < b->score || (a->score == b->score && a->index < b->index));
+}
+
+rpl_private bool
+fuzzy_topk_init(fuzzy_topk_t * top, alloc_t * mem, ssize_t k)
+{
+	top->mem = mem;
+	top->k = (k < 1 ? 1 : k);
+	top->count = 0;
+	top->hits = mem_malloc_tp_n(mem, fuzzy_hit_t, top->k);
+	return (top->hits != NULL);
+}
+
+rpl_private void
+fuzzy_topk_done(fuzzy_topk_t * top)
+{
+	mem_free(top->mem, top->hits);
+	top->hits = NULL;
+	top->count = 0;
+}
+
+static void
+fuzzy_topk_sift_down(fuzzy_topk_t * top, ssize_t i)
+{
+	fuzzy_hit_t *hits = top->hits;
+	while (true) {
+		ssize_t worst = i;
+		ssize_t l = 2 * i + 1;
+		ssize_t r = l + 1;
+		if (l < top->count && fuzzy_worse(&hits[l], &hits[worst]))
+			worst = l;
+		if (r < top->count && fuzzy_worse(&hits[r], &hits[worst]))
+			worst = r;
+		if (worst == i)
+			return;
+		fuzzy_hit_t tmp = hits[i];
+		hits[i] = hits[worst];
+		hits[worst] = tmp;
+		i = worst;
+	}
+}
+
+rpl_private void
+fuzzy_topk_push(fuzzy_topk_t * top, int score, ssize_t index)
+{
+	fuzzy_hit_t hit = { score, index };
+	fuzzy_hit_t *hits = top->hits;
+	if (top->count < top->k) {
+		// sift up
+		ssize_t i = top->count++;
+		while (i > 0 && fuzzy_worse(&hit, &hits[(i - 1) / 2])) {
+			hits[i] = hits[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		hits[i] = hit;
+	} else if (fuzzy_worse(&hits[0], &hit)) {
+		hits[0] = hit;          // replace the worst
+		fuzzy_topk_sift_down(top, 0);
+	}
+}
+
+static int
+fuzzy_hit_compare(const void *p1, const void *p2)
+{
+	const fuzzy_hit_t *a = (const fuzzy_hit_t *)p1;
+	const fuzzy_hit_t *b = (const fuzzy_hit_t *)p2;
+	return (fuzzy_worse(b, a) ? -1 : (fuzzy_worse(a, b) ? 1 : 0));
+}
+
+rpl_private void
+fuzzy_topk_sort(fuzzy_topk_t * top)
+{
+	if (top->count > 1)
+		qsort(top->hits, to_size_t(top->count), sizeof(top->hits[0]),
+		      &fuzzy_hit_compare);
+}
+
+//-------------------------------------------------------------
+// Ranking
+//
+// The masks are tested 64 at a time into a bit set (a loop the
+// compiler can vectorize), and only the texts that pass are
+// scored. Large arrays are split over threads that each keep
+// their own top-k, merged at the end.
+//-------------------------------------------------------------
+
+#define RPL_FUZZY_PARALLEL  (1 << 16)   // texts per thread at least
+#define RPL_FUZZY_THREADS   (8)
+
+typedef struct fuzzy_part_s {
+	const fuzzy_pattern_t *pat;
+	const char *const *texts;
+	const uint64_t *masks;
+	ssize_t from;
+	ssize_t to;
+	fuzzy_topk_t top;
+} fuzzy_part_t;
+
+static void
+fuzzy_rank_part(fuzzy_part_t * part)
+{
+	const uint64_t pmask = part->pat->mask;
+	for (ssize_t base = part->from; base < part->to; base += 64) {
+		ssize_t n = part->to - base;
+		if (n > 64)
+			n = 64;
+		const uint64_t *masks = part->masks + base;
+		uint64_t pass = 0;
+		for (ssize_t j = 0; j < n; j++) {
+			pass |= (uint64_t) ((masks[j] & pmask) == pmask) << j;
+		}
+		while (pass != 0) {
+			ssize_t j = 0;
+			while ((pass & ((uint64_t) 1 << j)) == 0) {
+				j++;
+			}
+			pass &= ~((uint64_t) 1 << j);
+			int score = fuzzy_score(part->pat, part->texts[base + j], NULL);
+			if (score >= 0)
+				fuzzy_topk_push(&part->top, score, base + j);
+		}
+	}
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+
+static void *
+fuzzy_rank_main(void *arg)
+{
+	fuzzy_rank_part((fuzzy_part_t *) arg);
+	return NULL;
+}
+
+static ssize_t
+fuzzy_threads(ssize_t count)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ssize_t n = count / RPL_FUZZY_PARALLEL;
+	if (n > cpus)
+		n = cpus;
+	if (n > RPL_FUZZY_THREADS)
+		n = RPL_FUZZY_THREADS;
+	return (n < 1 ? 1 : n);
+}
+#else
+static ssize_t
+fuzzy_threads(ssize_t count)
+{
+	rpl_unused(count);
+	return 1;
+}
+#endif
+
+rpl_private bool
+fuzzy_rank(fuzzy_topk_t * top, const char *pattern, const char *const *texts,
+           const uint64_t * masks, ssize_t count)
+{
+	fuzzy_pattern_t pat;
+	fuzzy_pattern_init(&pat, pattern);
+	fuzzy_part_t parts[RPL_FUZZY_THREADS];
+	ssize_t nparts = fuzzy_threads(count);
+	for (ssize_t i = 0; i < nparts; i++) {
+		parts[i].pat = &pat;
+		parts[i].texts = texts;
+		parts[i].masks = masks;
+		parts[i].from = count * i / nparts;
+		parts[i].to = count * (i + 1) / nparts;
+		if (!fuzzy_topk_init(&parts[i].top, top->mem, top->k)) {
+			while (i-- > 0) {
+				fuzzy_topk_done(&parts[i].top);
+			}
+			return false;
+		}
+	}
+#if !defined(_WIN32)
+	pthread_t threads[RPL_FUZZY_THREADS];
+	ssize_t started = 1;
+	while (started < nparts
+	       && pthread_create(&threads[started], NULL, &fuzzy_rank_main,
+	                         &parts[started]) == 0) {
+		started++;
+	}
+	fuzzy_rank_part(&parts[0]);
+	for (ssize_t i = 1; i < nparts; i++) {
+		if (i < started)
+			pthread_join(threads[i], NULL);
+		else
+			fuzzy_rank_part(&parts[i]);  // no thread could be started
+	}
+#else
+	fuzzy_rank_part(&parts[0]);
+#endif
+	for (ssize_t i = 0; i < nparts; i++) {
+		for (ssize_t j = 0; j < parts[i].top.count; j++) {
+			fuzzy_topk_push(top, parts[i].top.hits[j].score, parts[i].top.hits[j].index);
+		}
+		fuzzy_topk_done(&parts[i].top);
+	}
+	fuzzy_topk_sort(top);
+	return true;
+}
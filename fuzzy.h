@@ -0,0 +1,60 @@
+#pragma once
+#ifndef RPL_FUZZY_H
+#define RPL_FUZZY_H
+
+#include "common.h"
+
+//-------------------------------------------------------------
+// Fuzzy matching
+//-------------------------------------------------------------
+
+/// A pattern matches a text if its characters occur in the text in the same
+/// order (a subsequence). Matching ignores case unless the pattern contains
+/// an upper case letter.
+typedef struct fuzzy_pattern_s {
+	const char *text;
+	ssize_t len;
+	uint64_t mask;              // characters of the pattern (see fuzzy_mask)
+	bool ignore_case;
+} fuzzy_pattern_t;
+
+/// A match found by ranking: its score and the index of the text
+typedef struct fuzzy_hit_s {
+	int score;
+	ssize_t index;
+} fuzzy_hit_t;
+
+/// Bounded min-heap that keeps the `k` best hits
+typedef struct fuzzy_topk_s {
+	fuzzy_hit_t *hits;
+	ssize_t count;
+	ssize_t k;
+	alloc_t *mem;
+} fuzzy_topk_t;
+
+rpl_private void fuzzy_pattern_init(fuzzy_pattern_t * pat, const char *text);
+/// Bit set of the (case folded) characters of `s`; a text can only match a
+/// pattern if its mask contains the mask of the pattern.
+rpl_private uint64_t fuzzy_mask(const char *s);
+/// Score of `s` for the pattern, or -1 if it does not match. Higher is better:
+/// consecutive characters and characters at the start of a word score more,
+/// gaps cost. If `positions` is not NULL it receives the offset in `s` of
+/// every pattern character (`pat->len` entries).
+rpl_private int fuzzy_score(const fuzzy_pattern_t * pat, const char *s,
+                           ssize_t * positions);
+
+rpl_private bool fuzzy_topk_init(fuzzy_topk_t * top, alloc_t * mem, ssize_t k);
+rpl_private void fuzzy_topk_done(fuzzy_topk_t * top);
+/// Offer a hit; on equal scores the higher index wins.
+rpl_private void fuzzy_topk_push(fuzzy_topk_t * top, int score, ssize_t index);
+/// Sort the kept hits from best to worst (the heap can not be pushed to afterwards)
+rpl_private void fuzzy_topk_sort(fuzzy_topk_t * top);
+
+/// Rank `count` texts (with their masks, see fuzzy_mask) and keep the best
+/// `top->k` hits in `top`, sorted from best to worst. Large arrays are scored
+/// by several threads.
+rpl_private bool fuzzy_rank(fuzzy_topk_t * top, const char *pattern,
+                            const char *const *texts, const uint64_t * masks,
+                            ssize_t count);
+
+#endif                          // RPL_FUZZY_H
@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
 
 #include "repline.h"
 #include "common.h"
@@ -9,216 +15,718 @@
 
 #define RPL_MAX_HISTORY (200)
 
-struct history_s {
+typedef struct history_file_s history_file_t;
+typedef struct history_file_cursor_s history_file_cursor_t;
+
+//-------------------------------------------------------------
+// Trigram index for substring search
+//
+// For every trigram of an entry the sequence number of the entry
+// is appended to the posting list of that trigram. Sequence numbers
+// only grow, so posting lists stay sorted and can be walked from the
+// most recent entry backward. Deleted entries are skipped lazily and
+// the index is rebuilt once they outnumber the live entries.
+//-------------------------------------------------------------
+
+typedef struct posting_s {
+	uint32_t trigram;           // the three bytes, with bit 24 set (0 marks an empty slot)
+	uint32_t *seqs;             // sequence numbers of the entries containing the trigram
+	ssize_t count;
+	ssize_t len;
+} posting_t;
+
+typedef struct trigram_index_s {
+	posting_t *slots;           // open addressing hash table
+	ssize_t count;              // used slots
+	ssize_t len;                // number of slots (a power of 2)
+	ssize_t dead;               // deleted entries that are still in posting lists
+} trigram_index_t;
+
+/// Slot of the hash set over the live entries (ref 0 marks an empty slot)
+typedef struct hset_slot_s {
+	uint32_t hash;              // hash of the entry
+	uint32_t ref;               // sequence number of the entry + 1
+} hset_slot_t;
+
+//-------------------------------------------------------------
+// History
+//
+// Entries live in a ring buffer indexed by their sequence number,
+// from the oldest slot in use (first_seq) to the most recent one
+// (next_seq - 1). Deleted entries leave a NULL slot behind, and
+// the ring is compacted once these fill half of it. A hash set
+// over the live entries finds duplicates without scanning.
+//-------------------------------------------------------------
+
+struct history_file_s {
+	history_t base;
 	ssize_t count;              // current number of entries in use
-	ssize_t len;                // size of elems 
-	const char **elems;         // history items (up to count)
+	ssize_t max;                // maximum number of entries (0 = no history)
+	const char **elems;         // ring buffer of entries (NULL = deleted)
+	ssize_t len;                // size of elems (a power of 2)
+	uint32_t first_seq;         // sequence number of the oldest slot in use
+	uint32_t next_seq;          // sequence number of the next pushed entry
+	hset_slot_t *set;           // open addressing hash set of the live entries
+	ssize_t set_len;            // size of set (a power of 2)
+	trigram_index_t index;
 	const char *fname;          // history file
+	uint32_t saved_seq;         // entries from here on are not yet appended to the file
+	ssize_t journal_count;      // records in the file (including duplicates)
+	bool rewrite;               // the history was cleared, so the file must be replaced
+	char **removed;             // removed entries that are in the file already
+	ssize_t removed_count;
+	ssize_t removed_len;
+	bool loading;               // bulk loading: index the entries once at the end
+	long dropped;               // number of times the oldest entry was dropped
 	alloc_t *mem;
 };
 
-rpl_private void history_load(history_t * h);
-rpl_private const char *history_get(const history_t * h, ssize_t n);
+static const history_backend_t history_file_backend;
+static void history_file_save(history_t * hist);
+static void history_file_clear(history_t * hist);
+static bool history_file_push(history_t * hist, const char *entry);
+static void history_file_remove_last(history_t * hist);
+
+rpl_private void history_load(history_file_t * h);
+static void history_compact_file(history_file_t * h);
+rpl_private const char *history_get(const history_file_t * h, ssize_t n);
+
+static uint32_t
+trigram_at(const char *s)
+{
+	return (0x1000000 | ((uint32_t) (uint8_t) s[0] << 16)
+	        | ((uint32_t) (uint8_t) s[1] << 8) | (uint32_t) (uint8_t) s[2]);
+}
+
+static posting_t *
+trigram_find(const trigram_index_t * idx, uint32_t trigram)
+{
+	if (idx->len <= 0)
+		return NULL;
+	ssize_t mask = idx->len - 1;
+	ssize_t i = (ssize_t) ((trigram * 2654435761u) & (uint32_t) mask);
+	while (idx->slots[i].trigram != 0) {
+		if (idx->slots[i].trigram == trigram)
+			return &idx->slots[i];
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void
+trigram_index_clear(alloc_t * mem, trigram_index_t * idx)
+{
+	for (ssize_t i = 0; i < idx->len; i++) {
+		mem_free(mem, idx->slots[i].seqs);
+	}
+	mem_free(mem, idx->slots);
+	memset(idx, 0, sizeof(*idx));
+}
+
+static bool
+trigram_index_grow(alloc_t * mem, trigram_index_t * idx)
+{
+	ssize_t newlen = (idx->len <= 0 ? 1024 : idx->len * 2);
+	posting_t *newslots = mem_zalloc_tp_n(mem, posting_t, newlen);
+	if (newslots == NULL)
+		return false;
+	for (ssize_t i = 0; i < idx->len; i++) {
+		posting_t *p = &idx->slots[i];
+		if (p->trigram == 0)
+			continue;
+		ssize_t j = (ssize_t) ((p->trigram * 2654435761u) & (uint32_t) (newlen - 1));
+		while (newslots[j].trigram != 0) {
+			j = (j + 1) & (newlen - 1);
+		}
+		newslots[j] = *p;
+	}
+	mem_free(mem, idx->slots);
+	idx->slots = newslots;
+	idx->len = newlen;
+	return true;
+}
 
-rpl_private history_t *
-history_new(alloc_t * mem)
+static void
+trigram_index_add(alloc_t * mem, trigram_index_t * idx, uint32_t seq,
+                  const char *entry)
 {
-	history_t *h = mem_zalloc_tp(mem, history_t);
+	ssize_t len = rpl_strlen(entry);
+	for (ssize_t i = 0; i + 3 <= len; i++) {
+		uint32_t trigram = trigram_at(entry + i);
+		posting_t *p = trigram_find(idx, trigram);
+		if (p == NULL) {
+			if (2 * (idx->count + 1) > idx->len && !trigram_index_grow(mem, idx))
+				return;
+			ssize_t j = (ssize_t) ((trigram * 2654435761u) & (uint32_t) (idx->len - 1));
+			while (idx->slots[j].trigram != 0) {
+				j = (j + 1) & (idx->len - 1);
+			}
+			p = &idx->slots[j];
+			p->trigram = trigram;
+			idx->count++;
+		}
+		if (p->count > 0 && p->seqs[p->count - 1] == seq)
+			continue;           // trigram occurs more than once in this entry
+		if (p->count >= p->len) {
+			ssize_t newlen = (p->len <= 0 ? 4 : p->len * 2);
+			uint32_t *newseqs = mem_realloc_tp(mem, uint32_t, p->seqs, newlen);
+			if (newseqs == NULL)
+				return;
+			p->seqs = newseqs;
+			p->len = newlen;
+		}
+		p->seqs[p->count++] = seq;
+	}
+}
+
+/// Returns the entry with sequence number `seq`, or NULL if it was deleted
+static const char *
+history_at_seq(const history_file_t * h, uint32_t seq)
+{
+	if (seq - h->first_seq >= h->next_seq - h->first_seq)
+		return NULL;
+	return h->elems[seq & (uint32_t) (h->len - 1)];
+}
+
+static ssize_t
+hset_find(const history_file_t * h, const char *entry, uint32_t hash)
+{
+	if (h->set_len <= 0)
+		return -1;
+	ssize_t mask = h->set_len - 1;
+	for (ssize_t i = (ssize_t) (hash & (uint32_t) mask); h->set[i].ref != 0;
+	     i = (i + 1) & mask) {
+		if (h->set[i].hash == hash
+		    && strcmp(history_at_seq(h, h->set[i].ref - 1), entry) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void
+hset_insert_slot(hset_slot_t * set, ssize_t set_len, uint32_t hash, uint32_t ref)
+{
+	ssize_t i = (ssize_t) (hash & (uint32_t) (set_len - 1));
+	while (set[i].ref != 0) {
+		i = (i + 1) & (set_len - 1);
+	}
+	set[i].hash = hash;
+	set[i].ref = ref;
+}
+
+static bool
+hset_insert(history_file_t * h, uint32_t hash, uint32_t seq)
+{
+	if (2 * (h->count + 1) > h->set_len) {
+		ssize_t newlen = (h->set_len <= 0 ? 64 : h->set_len * 2);
+		hset_slot_t *newset = mem_zalloc_tp_n(h->mem, hset_slot_t, newlen);
+		if (newset == NULL)
+			return false;
+		for (ssize_t i = 0; i < h->set_len; i++) {
+			if (h->set[i].ref != 0)
+				hset_insert_slot(newset, newlen, h->set[i].hash, h->set[i].ref);
+		}
+		mem_free(h->mem, h->set);
+		h->set = newset;
+		h->set_len = newlen;
+	}
+	hset_insert_slot(h->set, h->set_len, hash, seq + 1);
+	return true;
+}
+
+/// Remove slot `i` and shift back the slots of its probe sequence (no tombstones)
+static void
+hset_remove_at(history_file_t * h, ssize_t i)
+{
+	ssize_t mask = h->set_len - 1;
+	ssize_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		if (h->set[j].ref == 0)
+			break;
+		ssize_t home = (ssize_t) (h->set[j].hash & (uint32_t) mask);
+		// move slot j back to i unless its home lies cyclically in (i, j]
+		if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		h->set[i] = h->set[j];
+		i = j;
+	}
+	h->set[i].ref = 0;
+}
+
+static void
+history_index_rebuild(history_file_t * h)
+{
+	trigram_index_clear(h->mem, &h->index);
+	for (uint32_t seq = h->first_seq; seq != h->next_seq; seq++) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL)
+			trigram_index_add(h->mem, &h->index, seq, entry);
+	}
+}
+
+/// Move the live entries to a new ring of size `newlen`, renumbering them from 0
+static bool
+history_compact(history_file_t * h, ssize_t newlen)
+{
+	const char **newelems = mem_zalloc_tp_n(h->mem, const char *, newlen);
+	if (newelems == NULL)
+		return false;
+	uint32_t n = 0;
+	uint32_t saved = 0;
+	for (uint32_t seq = h->first_seq; seq != h->next_seq; seq++) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL)
+			newelems[n++] = entry;
+		if (seq + 1 == h->saved_seq)
+			saved = n;
+	}
+	h->saved_seq = saved;
+	mem_free(h->mem, h->elems);
+	h->elems = newelems;
+	h->len = newlen;
+	h->first_seq = 0;
+	h->next_seq = n;
+	if (h->set != NULL)
+		memset(h->set, 0, to_size_t(h->set_len) * sizeof(hset_slot_t));
+	for (uint32_t seq = 0; seq < n; seq++) {
+		hset_insert_slot(h->set, h->set_len, (uint32_t)rpl_hash(h->elems[seq]), seq + 1);
+	}
+	if (!h->loading)
+		history_index_rebuild(h);
+	return true;
+}
+
+static void
+history_delete_seq(history_file_t * h, uint32_t seq)
+{
+	const char *entry = history_at_seq(h, seq);
+	if (entry == NULL)
+		return;
+	ssize_t i = hset_find(h, entry, (uint32_t)rpl_hash(entry));
+	if (i >= 0)
+		hset_remove_at(h, i);
+	mem_free(h->mem, entry);
+	h->elems[seq & (uint32_t) (h->len - 1)] = NULL;
+	h->count--;
+	h->index.dead++;
+	// release deleted slots at the old end of the ring
+	while (h->first_seq != h->next_seq && history_at_seq(h, h->first_seq) == NULL) {
+		h->first_seq++;
+	}
+}
+
+static history_t *
+history_file_new(alloc_t * mem)
+{
+	history_file_t *h = mem_zalloc_tp(mem, history_file_t);
+	if (h == NULL)
+		return NULL;
+	h->base.backend = &history_file_backend;
 	h->mem = mem;
-	return h;
+	return &h->base;
 }
 
-rpl_private void
-history_free(history_t * h)
+static void
+history_file_free(history_t * hist)
 {
+	history_file_t *h = (history_file_t *)hist;
 	if (h == NULL)
 		return;
-	history_clear(h);
-	if (h->len > 0) {
-		mem_free(h->mem, h->elems);
-		h->elems = NULL;
-		h->len = 0;
-	}
+	history_file_clear(&h->base);
+	mem_free(h->mem, h->elems);
+	h->elems = NULL;
+	h->len = 0;
+	h->max = 0;
+	mem_free(h->mem, h->set);
+	h->set = NULL;
+	h->set_len = 0;
+	mem_free(h->mem, h->removed);
+	h->removed = NULL;
+	h->removed_len = 0;
+	trigram_index_clear(h->mem, &h->index);
 	mem_free(h->mem, h->fname);
 	h->fname = NULL;
 	mem_free(h->mem, h);        // free ourselves
 }
 
 rpl_private ssize_t
-history_count(const history_t * h)
+history_count(const history_file_t * h)
 {
 	return h->count;
 }
 
-rpl_private ssize_t
-history_count_with_prefix(const history_t * h, const char *prefix)
-{
-	// rpl_unused(h); rpl_unused(prefix);
-	// return 0;
-	const char *p = NULL;
-	ssize_t i, count = 0;
-	for (i = 0; i < h->count; i++) {
-		p = history_get(h, i);
-		if (strncmp(p, prefix, strlen(prefix)) == 0)
-			count++;
-	}
-	return count;
-}
-
 //-------------------------------------------------------------
 // push/clear
 //-------------------------------------------------------------
 
 rpl_private bool
-history_update(history_t * h, const char *entry)
+history_update(history_file_t * h, const char *entry)
 {
 	if (entry == NULL)
 		return false;
-	history_remove_last(h);
-	history_push(h, entry);
+	history_file_remove_last(&h->base);
+	history_file_push(&h->base, entry);
 	//debug_msg("history: update: with %s; now at %s\n", entry, history_get(h,0));
 	return true;
 }
 
-static void
-history_delete_at(history_t * h, ssize_t idx)
-{
-	if (idx < 0 || idx >= h->count)
-		return;
-	mem_free(h->mem, h->elems[idx]);
-	for (ssize_t i = idx + 1; i < h->count; i++) {
-		h->elems[i - 1] = h->elems[i];
-	}
-	h->count--;
-}
-
-rpl_private bool
-history_push(history_t * h, const char *entry)
+static bool
+history_file_push(history_t * hist, const char *entry)
 {
-	if (h->len <= 0 || entry == NULL)
+	history_file_t *h = (history_file_t *)hist;
+	if (h->max <= 0 || entry == NULL)
 		return false;
 	// remove any older duplicate
-	for (int i = 0; i < h->count; i++) {
-		if (strcmp(h->elems[i], entry) == 0) {
-			history_delete_at(h, i);
-		}
+	uint32_t hash = (uint32_t)rpl_hash(entry);
+	ssize_t i = hset_find(h, entry, hash);
+	if (i >= 0) {
+		history_delete_seq(h, h->set[i].ref - 1);
 	}
-	// insert at front
-	if (h->count == h->len) {
+	if (h->count >= h->max) {
 		// delete oldest entry
-		history_delete_at(h, 0);
+		history_delete_seq(h, h->first_seq);
+		h->dropped++;
 	}
-	assert(h->count < h->len);
-	h->elems[h->count] = mem_strdup(h->mem, entry);
+	if ((ssize_t) (h->next_seq - h->first_seq) >= h->len
+	    || h->next_seq == UINT32_MAX) {
+		// ring is full: grow it if mostly live, otherwise squeeze out the deleted slots
+		ssize_t newlen = (h->len <= 0 ? 64 : (2 * h->count >= h->len ? 2 * h->len : h->len));
+		if (!history_compact(h, newlen))
+			return false;
+	}
+	if (!hset_insert(h, hash, h->next_seq))
+		return false;
+	uint32_t seq = h->next_seq++;
+	h->elems[seq & (uint32_t) (h->len - 1)] = mem_strdup(h->mem, entry);
 	h->count++;
+	if (h->loading)
+		;                       // indexed after loading
+	else if (h->index.dead > h->count)
+		history_index_rebuild(h);
+	else
+		trigram_index_add(h->mem, &h->index, seq, entry);
 	return true;
 }
 
+/// Remember a removed entry, to drop it from the file on the next save
 static void
-history_remove_last_n(history_t * h, ssize_t n)
+history_add_removed(history_file_t * h, const char *entry)
 {
-	if (n <= 0)
-		return;
-	if (n > h->count)
-		n = h->count;
-	for (ssize_t i = h->count - n; i < h->count; i++) {
-		mem_free(h->mem, h->elems[i]);
+	if (h->removed_count >= h->removed_len) {
+		ssize_t newlen = (h->removed_len <= 0 ? 4 : 2 * h->removed_len);
+		char **removed = mem_realloc_tp(h->mem, char *, h->removed, newlen);
+		if (removed == NULL)
+			return;
+		h->removed = removed;
+		h->removed_len = newlen;
 	}
-	h->count -= n;
-	assert(h->count >= 0);
+	char *copy = mem_strdup(h->mem, entry);
+	if (copy != NULL)
+		h->removed[h->removed_count++] = copy;
 }
 
-rpl_private void
-history_remove_last(history_t * h)
+static void
+history_clear_removed(history_file_t * h)
 {
+	for (ssize_t i = 0; i < h->removed_count; i++) {
+		mem_free(h->mem, h->removed[i]);
+	}
+	h->removed_count = 0;
+}
+
+static void
+history_remove_last_n(history_file_t * h, ssize_t n)
+{
+	while (n > 0 && h->count > 0) {
+		uint32_t seq = h->next_seq - 1;
+		while (history_at_seq(h, seq) == NULL) {
+			seq--;
+		}
+		if (seq - h->first_seq < h->saved_seq - h->first_seq)
+			history_add_removed(h, history_at_seq(h, seq));   // the entry is in the file already
+		history_delete_seq(h, seq);
+		n--;
+	}
+	if (h->count == 0) {
+		h->first_seq = h->next_seq = h->saved_seq = 0;
+		trigram_index_clear(h->mem, &h->index);
+	}
+}
+
+static void
+history_file_remove_last(history_t * hist)
+{
+	history_file_t *h = (history_file_t *)hist;
 	history_remove_last_n(h, 1);
 }
 
-rpl_private void
-history_clear(history_t * h)
+static void
+history_file_clear(history_t * hist)
 {
-	history_remove_last_n(h, h->count);
+	history_file_t *h = (history_file_t *)hist;
+	for (uint32_t seq = h->first_seq; seq != h->next_seq; seq++) {
+		mem_free(h->mem, history_at_seq(h, seq));
+	}
+	if (h->elems != NULL)
+		memset(h->elems, 0, to_size_t(h->len) * sizeof(const char *));
+	if (h->set != NULL)
+		memset(h->set, 0, to_size_t(h->set_len) * sizeof(hset_slot_t));
+	h->count = 0;
+	h->first_seq = h->next_seq = h->saved_seq = 0;
+	h->rewrite = true;
+	history_clear_removed(h);
+	trigram_index_clear(h->mem, &h->index);
 }
 
-rpl_private void
-history_close(history_t * h)
+static void
+history_file_close(history_t * hist)
+{
+	history_file_t *h = (history_file_t *)hist;
+	/// Drop duplicates and trimmed entries from the journal
+	if (h->fname == NULL || h->max <= 0)
+		return;
+	history_file_save(&h->base);
+	history_compact_file(h);
+}
+
+static void
+history_file_set_async(history_t * hist, bool enable)
 {
-	/// Nothing to be done here ...
+	/// Writes are cheap in memory, and the file is written by history_file_save()
+	rpl_unused(hist);
+	rpl_unused(enable);
 }
 
+static void
+history_file_set_max_age(history_t * hist, long max_age)
+{
+	/// Entries have no timestamps in this backend, only the maximum count applies
+	rpl_unused(hist);
+	rpl_unused(max_age);
+}
+
+/// Parameter n is the history index from latest to oldest, starting with 0
 rpl_private const char *
-history_get(const history_t * h, ssize_t n)
+history_get(const history_file_t * h, ssize_t n)
 {
 	if (n < 0 || n >= h->count)
 		return NULL;
-	return h->elems[h->count - n - 1];
+	if ((ssize_t) (h->next_seq - h->first_seq) == h->count)
+		return history_at_seq(h, h->next_seq - 1 - (uint32_t) n);
+	for (uint32_t seq = h->next_seq - 1; seq != h->first_seq - 1; seq--) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL && n-- == 0)
+			return entry;
+	}
+	return NULL;
 }
 
-rpl_private const char *
-history_get_with_prefix(const history_t * h, ssize_t from, const char *prefix)
+/// Parameter n is the history command index from latest to oldest, starting with 1
+static const char *
+history_file_get_with_prefix(history_t * hist, ssize_t n, const char *prefix)
 {
-	const char *p = NULL;
-	ssize_t i;
-	for (i = from; i < h->count; i++) {
-		p = history_get(h, i);
-		if (strncmp(p, prefix, strlen(prefix)) == 0)
-			break;
+	const history_file_t *h = (const history_file_t *)hist;
+	size_t len = strlen(prefix);
+	for (uint32_t seq = h->next_seq - 1; n > 0 && seq != h->first_seq - 1; seq--) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL && strncmp(entry, prefix, len) == 0 && --n == 0)
+			return entry;
 	}
-	return p;
+	return NULL;
 }
 
-rpl_private bool
-history_search(const history_t * h, ssize_t from /*including */ ,
-               const char *search, bool backward, ssize_t * hidx,
-               ssize_t * hpos)
-{
-	debug_msg("searching history %s for '%s' from %d\n",
-	          backward ? "back" : "forward", search, from);
-	const char *p = NULL;
-	ssize_t i;
-	if (backward) {
-		for (i = from; i < h->count; i++) {
-			p = strstr(history_get(h, i), search);
-			if (p != NULL)
-				break;
+//-------------------------------------------------------------
+// History cursor
+//-------------------------------------------------------------
+
+struct history_file_cursor_s {
+	history_cursor_t base;
+	const history_file_t *h;
+	char *prefix;
+	bool search;                // match `prefix` anywhere in the entry instead of at the start
+	ssize_t pos;                // current position (0 = none, 1 = most recent)
+	uint32_t seq;               // sequence number of the current entry
+};
+
+static history_cursor_t *
+history_file_cursor_new(const history_t * hist, const char *prefix)
+{
+	const history_file_t *h = (const history_file_t *)hist;
+	history_file_cursor_t *cur = mem_zalloc_tp(h->mem, history_file_cursor_t);
+	if (cur == NULL)
+		return NULL;
+	cur->base.backend = &history_file_backend;
+	cur->h = h;
+	cur->prefix = mem_strdup(h->mem, prefix == NULL ? "" : prefix);
+	if (cur->prefix == NULL) {
+		mem_free(h->mem, cur);
+		return NULL;
+	}
+	return &cur->base;
+}
+
+static history_cursor_t *
+history_file_cursor_new_search(const history_t * hist, const char *search)
+{
+	history_cursor_t *cur = history_file_cursor_new(hist, search);
+	if (cur != NULL)
+		((history_file_cursor_t *)cur)->search = true;
+	return cur;
+}
+
+static void
+history_file_cursor_free(history_cursor_t * hcur)
+{
+	history_file_cursor_t *cur = (history_file_cursor_t *)hcur;
+	if (cur == NULL)
+		return;
+	mem_free(cur->h->mem, cur->prefix);
+	mem_free(cur->h->mem, cur);
+}
+
+static const char *
+history_file_cursor_prefix(const history_cursor_t * hcur)
+{
+	const history_file_cursor_t *cur = (const history_file_cursor_t *)hcur;
+	return cur->prefix;
+}
+
+static ssize_t
+history_file_cursor_pos(const history_cursor_t * hcur)
+{
+	const history_file_cursor_t *cur = (const history_file_cursor_t *)hcur;
+	return cur->pos;
+}
+
+static const char *
+history_file_cursor_entry(const history_cursor_t * hcur)
+{
+	const history_file_cursor_t *cur = (const history_file_cursor_t *)hcur;
+	return (cur->pos <= 0 ? NULL : history_at_seq(cur->h, cur->seq));
+}
+
+static bool
+history_cursor_matches(const history_file_cursor_t * cur, const char *entry)
+{
+	if (entry == NULL)
+		return false;
+	if (cur->search)
+		return (strstr(entry, cur->prefix) != NULL);
+	return (strncmp(entry, cur->prefix, strlen(cur->prefix)) == 0);
+}
+
+/// Returns the posting list of the rarest trigram in `search`, or NULL if some trigram never occurs
+static const posting_t *
+history_search_postings(const history_file_t * h, const char *search)
+{
+	const posting_t *best = NULL;
+	ssize_t len = rpl_strlen(search);
+	for (ssize_t i = 0; i + 3 <= len; i++) {
+		const posting_t *p = trigram_find(&h->index, trigram_at(search + i));
+		if (p == NULL)
+			return NULL;
+		if (best == NULL || p->count < best->count)
+			best = p;
+	}
+	return best;
+}
+
+/// Returns the first position in `seqs` (of length `count`) whose value is at least `seq`
+static ssize_t
+seq_lower_bound(const uint32_t * seqs, ssize_t count, uint32_t seq)
+{
+	ssize_t lo = 0;
+	ssize_t hi = count;
+	while (lo < hi) {
+		ssize_t mid = lo + (hi - lo) / 2;
+		if (seqs[mid] < seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/// Find the closest matching entry that is older (or newer) than the current one
+static const char *
+history_cursor_step(history_file_cursor_t * cur, bool backward)
+{
+	const history_file_t *h = cur->h;
+	if (cur->pos <= 0 && !backward)
+		return NULL;
+	if (cur->search && rpl_strlen(cur->prefix) >= 3) {
+		// walk the postings of the rarest trigram
+		const posting_t *p = history_search_postings(h, cur->prefix);
+		if (p == NULL)
+			return NULL;
+		ssize_t j = (cur->pos <= 0 ? p->count : seq_lower_bound(p->seqs, p->count, cur->seq));
+		if (!backward && j < p->count && p->seqs[j] == cur->seq)
+			j++;
+		for (j = (backward ? j - 1 : j); j >= 0 && j < p->count; j += (backward ? -1 : 1)) {
+			const char *entry = history_at_seq(h, p->seqs[j]);
+			if (history_cursor_matches(cur, entry)) {
+				cur->seq = p->seqs[j];
+				return entry;
+			}
 		}
-	} else {
-		for (i = from; i >= 0; i--) {
-			p = strstr(history_get(h, i), search);
-			if (p != NULL)
-				break;
+		return NULL;
+	}
+	// scan the ring
+	uint32_t seq = (cur->pos <= 0 ? h->next_seq : cur->seq);
+	while (true) {
+		seq = (backward ? seq - 1 : seq + 1);
+		if (seq - h->first_seq >= h->next_seq - h->first_seq)
+			return NULL;
+		const char *entry = history_at_seq(h, seq);
+		if (history_cursor_matches(cur, entry)) {
+			cur->seq = seq;
+			return entry;
 		}
 	}
-	if (p == NULL)
-		return false;
-	debug_msg("found '%s' at index: %d\n", search, i);
-	if (hidx != NULL)
-		*hidx = i;
-	if (hpos != NULL)
-		*hpos = (p - history_get(h, i));
-	return true;
+}
+
+static const char *
+history_file_cursor_prev(history_cursor_t * hcur)
+{
+	history_file_cursor_t *cur = (history_file_cursor_t *)hcur;
+	const char *entry = history_cursor_step(cur, true);
+	if (entry != NULL)
+		cur->pos++;
+	return entry;
+}
+
+static const char *
+history_file_cursor_next(history_cursor_t * hcur)
+{
+	history_file_cursor_t *cur = (history_file_cursor_t *)hcur;
+	const char *entry = (cur->pos > 1 ? history_cursor_step(cur, false) : NULL);
+	if (entry != NULL) {
+		cur->pos--;
+		return entry;
+	}
+	cur->pos = 0;
+	return NULL;
 }
 
 //-------------------------------------------------------------
 // 
 //-------------------------------------------------------------
 
-rpl_private void
-history_load_from(history_t * h, const char *fname, long max_entries)
+static void
+history_file_load_from(history_t * hist, const char *fname, long max_entries)
 {
-	history_clear(h);
+	history_file_t *h = (history_file_t *)hist;
+	history_file_clear(hist);
 	h->fname = mem_strdup(h->mem, fname);
-	if (max_entries == 0) {
-		assert(h->elems == NULL);
-		return;
-	}
-	if (max_entries < 0 || max_entries > RPL_MAX_HISTORY)
+	if (max_entries < 0)
 		max_entries = RPL_MAX_HISTORY;
-	h->elems = (const char **)mem_zalloc_tp_n(h->mem, char *, max_entries);
-	if (h->elems == NULL)
-		return;
-	h->len = max_entries;
-	history_load(h);
+	/// The ring grows on demand, so a large maximum costs nothing up front
+	h->max = max_entries;
+	if (h->max > 0)
+		history_load(h);
+	h->saved_seq = h->next_seq;
+	h->rewrite = false;
 }
 
 //-------------------------------------------------------------
@@ -255,7 +763,7 @@ rpl_isxdigit(int c)
 }
 
 static bool
-history_read_entry(history_t * h, FILE * f, stringbuf_t * sbuf)
+history_read_entry(history_file_t * h, FILE * f, stringbuf_t * sbuf)
 {
 	sbuf_clear(sbuf);
 	while (!feof(f)) {
@@ -287,13 +795,49 @@ history_read_entry(history_t * h, FILE * f, stringbuf_t * sbuf)
 	}
 	if (sbuf_len(sbuf) == 0 || sbuf_string(sbuf)[0] == '#')
 		return true;
-	return history_push(h, sbuf_string(sbuf));
+	return history_file_push(&h->base, sbuf_string(sbuf));
 }
 
-static bool
-history_write_entry(const char *entry, FILE * f, stringbuf_t * sbuf)
+/// Unescape the record `[p,end)` into `buf` (which may be `p` itself, or has room for at least
+/// end - p + 1 bytes). Spans without escapes are copied in one go.
+rpl_private bool
+history_unescape(const char *p, const char *end, char *buf)
 {
-	sbuf_clear(sbuf);
+	char *out = buf;
+	while (p < end) {
+		const char *bs = memchr(p, '\\', to_size_t(end - p));
+		if (bs == NULL)
+			bs = end;
+		memmove(out, p, to_size_t(bs - p));
+		out += bs - p;
+		p = bs;
+		if (p >= end)
+			break;
+		char c = (p + 1 < end ? p[1] : 0);
+		p += 2;
+		if (c == 'n') {
+			*out++ = '\n';
+		} else if (c == 'r') {  /* ignore */
+		} else if (c == 't') {
+			*out++ = '\t';
+		} else if (c == '\\') {
+			*out++ = '\\';
+		} else if (c == 'x' && p + 1 < end && rpl_isxdigit(p[0])
+		           && rpl_isxdigit(p[1])) {
+			*out++ = (char)(from_xdigit(p[0]) * 16 + from_xdigit(p[1]));
+			p += 2;
+		} else
+			return false;
+	}
+	*out = 0;
+	return true;
+}
+
+/// Append the escaped record of an entry (with a newline) to `sbuf`
+rpl_private void
+history_append_record(const char *entry, stringbuf_t * sbuf)
+{
+	ssize_t start = sbuf_len(sbuf);
 	//debug_msg("history: write: %s\n", entry);
 	while (entry != NULL && *entry != 0) {
 		char c = *entry++;
@@ -316,18 +860,23 @@ history_write_entry(const char *entry, FILE * f, stringbuf_t * sbuf)
 	}
 	//debug_msg("history: write buf: %s\n", sbuf_string(sbuf));
 
-	if (sbuf_len(sbuf) > 0) {
+	if (sbuf_len(sbuf) > start) {
 		sbuf_append(sbuf, "\n");
-		fputs(sbuf_string(sbuf), f);
 	}
+}
+
+static bool
+history_write_entry(const char *entry, FILE * f, stringbuf_t * sbuf)
+{
+	sbuf_clear(sbuf);
+	history_append_record(entry, sbuf);
+	fputs(sbuf_string(sbuf), f);
 	return true;
 }
 
-rpl_private void
-history_load(history_t * h)
+static void
+history_load_stream(history_file_t * h)
 {
-	if (h->fname == NULL)
-		return;
 	FILE *f = fopen(h->fname, "r");
 	if (f == NULL)
 		return;
@@ -336,30 +885,359 @@ history_load(history_t * h)
 		while (!feof(f)) {
 			if (!history_read_entry(h, f, sbuf))
 				break;          // error
+			h->journal_count++;
 		}
 		sbuf_free(sbuf);
 	}
 	fclose(f);
 }
 
+#ifndef _WIN32
+
+/// Load the history file through a read-only memory map; returns false if it cannot be mapped
+static bool
+history_load_mapped(history_file_t * h)
+{
+	int fd = open(h->fname, O_RDONLY);
+	if (fd < 0)
+		return true;            // no history yet
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return true;
+	}
+	const char *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	const char *end = data + st.st_size;
+	char *buf = NULL;
+	ssize_t buflen = 0;
+	for (const char *p = data; p < end;) {
+		const char *eol = memchr(p, '\n', to_size_t(end - p));
+		if (eol == NULL)
+			eol = end;
+		if (eol - p + 1 > buflen) {
+			ssize_t newlen = (eol - p + 1 > 2 * buflen ? eol - p + 1 : 2 * buflen);
+			char *newbuf = mem_realloc_tp(h->mem, char, buf, newlen);
+			if (newbuf == NULL)
+				break;
+			buf = newbuf;
+			buflen = newlen;
+		}
+		if (!history_unescape(p, eol, buf))
+			break;              // error
+		if (buf[0] != 0 && buf[0] != '#' && !history_file_push(&h->base, buf))
+			break;
+		h->journal_count++;
+		p = eol + 1;
+	}
+	mem_free(h->mem, buf);
+	munmap((void *)data, (size_t)st.st_size);
+	return true;
+}
+
+#endif
+
+/// Read the entries of the history file without indexing them
+static void
+history_load_entries(history_file_t * h)
+{
+	h->journal_count = 0;
+	h->loading = true;
+#ifndef _WIN32
+	if (!history_load_mapped(h))
+#endif
+		history_load_stream(h);
+	h->loading = false;
+}
+
 rpl_private void
-history_save(const history_t * h)
+history_load(history_file_t * h)
 {
 	if (h->fname == NULL)
 		return;
-	FILE *f = fopen(h->fname, "w");
-	if (f == NULL)
-		return;
-#ifndef _WIN32
-	chmod(h->fname, S_IRUSR | S_IWUSR);
-#endif
+	history_load_entries(h);
+	history_index_rebuild(h);
+}
+
+/// Write all entries to `f`
+static void
+history_write_all(const history_file_t * h, FILE * f)
+{
 	stringbuf_t *sbuf = sbuf_new(h->mem);
 	if (sbuf != NULL) {
-		for (int i = 0; i < h->count; i++) {
-			if (!history_write_entry(h->elems[i], f, sbuf))
+		for (uint32_t seq = h->first_seq; seq != h->next_seq; seq++) {
+			const char *entry = history_at_seq(h, seq);
+			if (entry != NULL && !history_write_entry(entry, f, sbuf))
 				break;          // error
 		}
 		sbuf_free(sbuf);
 	}
+}
+
+#ifndef _WIN32
+
+//-------------------------------------------------------------
+// Journal
+//
+// Saving appends the new entries to the file with a single write().
+// Duplicates and entries past the maximum accumulate in the file
+// until it is compacted (on close, or once it holds twice the
+// maximum number of entries) into a temporary file that replaces
+// it atomically. Appends and compaction lock the file, so several
+// processes can share it. Removing entries that are in the file
+// already merges it the same way and then drops just those.
+//-------------------------------------------------------------
+
+/// Open the history file and lock it exclusively. Retries if another
+/// process replaced the file while we waited for the lock.
+static int
+history_open_locked(const char *fname, int flags)
+{
+	for (int tries = 0; tries < 8; tries++) {
+		int fd = open(fname, flags | O_CREAT, S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			return -1;
+		struct stat st_fd, st_path;
+		if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st_fd) == 0
+		    && stat(fname, &st_path) == 0 && st_fd.st_ino == st_path.st_ino
+		    && st_fd.st_dev == st_path.st_dev)
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+/// Replace the history file by the entries of `h` (with the file locked)
+static bool
+history_replace_file(const history_file_t * h, const char *fname)
+{
+	stringbuf_t *tmpname = sbuf_new(h->mem);
+	if (tmpname == NULL)
+		return false;
+	sbuf_appendf(tmpname, "%s.%d.tmp", fname, (int)getpid());
+	bool ok = false;
+	FILE *f = fopen(sbuf_string(tmpname), "w");
+	if (f != NULL) {
+		chmod(sbuf_string(tmpname), S_IRUSR | S_IWUSR);
+		history_write_all(h, f);
+		ok = (fflush(f) == 0 && fsync(fileno(f)) == 0);
+		ok = (fclose(f) == 0 && ok);
+		ok = ok && (rename(sbuf_string(tmpname), fname) == 0);
+		if (!ok)
+			unlink(sbuf_string(tmpname));
+	}
+	sbuf_free(tmpname);
+	return ok;
+}
+
+/// Replace the history file by its entries without the removed ones, and with
+/// the entries of `h` from `seq` on (with the file locked). Returns the number
+/// of entries written, or -1 on error.
+static ssize_t
+history_merge_file(const history_file_t * h, uint32_t seq)
+{
+	/// Reload the file, which includes the entries appended by other processes
+	history_file_t *merged = (history_file_t *)history_file_new(h->mem);
+	if (merged == NULL)
+		return -1;
+	merged->fname = h->fname;
+	merged->max = h->max;
+	history_load_entries(merged);
+	merged->loading = true;     // never searched, so not indexed
+	for (ssize_t i = 0; i < h->removed_count; i++) {
+		ssize_t j = hset_find(merged, h->removed[i], (uint32_t)rpl_hash(h->removed[i]));
+		if (j >= 0)
+			history_delete_seq(merged, merged->set[j].ref - 1);
+	}
+	for (; seq != h->next_seq; seq++) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL)
+			history_file_push(&merged->base, entry);
+	}
+	ssize_t count = (history_replace_file(merged, h->fname) ? merged->count : -1);
+	merged->fname = NULL;
+	history_file_free(&merged->base);
+	return count;
+}
+
+static void
+history_compact_file(history_file_t * h)
+{
+	int fd = history_open_locked(h->fname, O_RDONLY);
+	if (fd < 0)
+		return;
+	ssize_t count = history_merge_file(h, h->next_seq);
+	if (count >= 0)
+		h->journal_count = count;
+	close(fd);
+}
+
+static void
+history_file_save(history_t * hist)
+{
+	history_file_t *h = (history_file_t *)hist;
+	if (h->fname == NULL)
+		return;
+	if (h->rewrite) {
+		int fd = history_open_locked(h->fname, O_RDONLY);
+		if (fd >= 0) {
+			if (history_replace_file(h, h->fname)) {
+				h->rewrite = false;
+				h->saved_seq = h->next_seq;
+				h->journal_count = h->count;
+			}
+			close(fd);
+		}
+		return;
+	}
+	uint32_t seq = h->saved_seq;
+	if (seq - h->first_seq > h->next_seq - h->first_seq)
+		seq = h->first_seq;     // unsaved entries were evicted already
+	if (h->removed_count > 0) {
+		/// Entries in the file were removed: merge, so other processes keep theirs
+		int fd = history_open_locked(h->fname, O_RDONLY);
+		if (fd >= 0) {
+			ssize_t count = history_merge_file(h, seq);
+			if (count >= 0) {
+				history_clear_removed(h);
+				h->saved_seq = h->next_seq;
+				h->journal_count = count;
+			}
+			close(fd);
+		}
+		return;
+	}
+	stringbuf_t *sbuf = sbuf_new(h->mem);
+	if (sbuf == NULL)
+		return;
+	ssize_t records = 0;
+	for (; seq != h->next_seq; seq++) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL) {
+			history_append_record(entry, sbuf);
+			records++;
+		}
+	}
+	if (sbuf_len(sbuf) > 0) {
+		int fd = history_open_locked(h->fname, O_WRONLY | O_APPEND);
+		if (fd >= 0) {
+			const char *buf = sbuf_string(sbuf);
+			ssize_t len = sbuf_len(sbuf);
+			while (len > 0) {
+				ssize_t n = write(fd, buf, to_size_t(len));
+				if (n <= 0)
+					break;      // error
+				buf += n;
+				len -= n;
+			}
+			close(fd);
+			if (len == 0) {
+				h->saved_seq = h->next_seq;
+				h->journal_count += records;
+			}
+		}
+	} else {
+		h->saved_seq = h->next_seq;
+	}
+	sbuf_free(sbuf);
+	if (h->journal_count > 2 * h->max)
+		history_compact_file(h);
+}
+
+#else
+
+static void
+history_compact_file(history_file_t * h)
+{
+	rpl_unused(h);
+}
+
+static void
+history_file_save(history_t * hist)
+{
+	history_file_t *h = (history_file_t *)hist;
+	if (h->fname == NULL)
+		return;
+	FILE *f = fopen(h->fname, "w");
+	if (f == NULL)
+		return;
+	history_write_all(h, f);
 	fclose(f);
+	history_clear_removed(h);
 }
+
+#endif
+
+//-------------------------------------------------------------
+// import/export
+//-------------------------------------------------------------
+
+static bool
+history_file_import(history_t * hist, const history_item_t * items, ssize_t count)
+{
+	history_file_t *h = (history_file_t *)hist;
+	if (h->max <= 0)
+		return false;
+	/// Only the most recent entries fit, and they are indexed once at the end
+	ssize_t i = (count > h->max ? count - h->max : 0);
+	h->loading = true;
+	for (; i < count; i++) {
+		history_file_push(hist, items[i].entry);
+	}
+	h->loading = false;
+	history_index_rebuild(h);
+	history_file_save(hist);
+	return true;
+}
+
+static void
+history_file_for_each(const history_t * hist, history_item_fun_t * fun, void *arg)
+{
+	/// Entries have no timestamps in this backend
+	const history_file_t *h = (const history_file_t *)hist;
+	for (uint32_t seq = h->first_seq; seq != h->next_seq; seq++) {
+		const char *entry = history_at_seq(h, seq);
+		if (entry != NULL && !fun(entry, 0, arg))
+			return;
+	}
+}
+
+static long
+history_file_version(history_t * hist)
+{
+	/// Only this session adds entries to a file history
+	return ((const history_file_t *)hist)->dropped;
+}
+
+static const history_backend_t history_file_backend = {
+	"file",
+	history_file_new,
+	history_file_free,
+	history_file_load_from,
+	history_file_save,
+	history_file_close,
+	history_file_clear,
+	history_file_push,
+	history_file_remove_last,
+	history_file_set_async,
+	history_file_set_max_age,
+	history_file_get_with_prefix,
+	history_file_import,
+	history_file_for_each,
+	history_file_version,
+	history_file_cursor_new,
+	history_file_cursor_new_search,
+	history_file_cursor_free,
+	history_file_cursor_prefix,
+	history_file_cursor_pos,
+	history_file_cursor_prev,
+	history_file_cursor_next,
+	history_file_cursor_entry,
+};
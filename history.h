@@ -3,23 +3,115 @@
 #define RPL_HISTORY_H
 
 #include "common.h"
+#include "stringbuf.h"
 
 //-------------------------------------------------------------
 // History
 //-------------------------------------------------------------
 
-struct history_s;
-typedef struct history_s history_t;
+/// A history is created by a backend, which keeps its own data in a struct
+/// that starts with a history_t (and likewise for its cursors).
+typedef struct history_backend_s history_backend_t;
+typedef struct history_words_s history_words_t;
+typedef struct history_prefetch_s history_prefetch_t;
+typedef struct history_fuzzy_s history_fuzzy_t;
+
+typedef struct history_s {
+	const history_backend_t *backend;
+	history_words_t *words;     // words of the most recent entries (kept by history_push)
+	history_prefetch_t *prefetch;   // lookups done ahead of time (if enabled)
+	history_fuzzy_t *fuzzy;     // entries for fuzzy search (built on first use)
+	long version;               // version of the backend when the caches were filled
+} history_t;
+
+/// A cursor walks the history entries that start with (or, for a search
+/// cursor, contain) a given text, from the most recent to the oldest one.
+/// Returned entries are owned by the cursor and stay valid until it is freed.
+/// The cursor must be freed before the history is modified.
+typedef struct history_cursor_s {
+	const history_backend_t *backend;
+} history_cursor_t;
+
+/// An entry to import, with its timestamp (0 if unknown)
+typedef struct history_item_s {
+	const char *entry;
+	long ts;
+} history_item_t;
+
+/// Called for every exported entry, returns false to stop
+typedef bool (history_item_fun_t) (const char *entry, long ts, void *arg);
+
+/// Operations of a history backend, see the functions of the same name below
+struct history_backend_s {
+	const char *name;
+	history_t *(*create)(alloc_t * mem);
+	void (*free)(history_t * h);
+	void (*load_from)(history_t * h, const char *fname, long max_entries);
+	void (*save)(history_t * h);
+	void (*close)(history_t * h);
+	void (*clear)(history_t * h);
+	bool (*push)(history_t * h, const char *entry);
+	void (*remove_last)(history_t * h);
+	void (*set_async)(history_t * h, bool enable);
+	void (*set_max_age)(history_t * h, long max_age);
+	const char *(*get_with_prefix)(history_t * h, ssize_t n, const char *prefix);
+	/// Add distinct entries, oldest first, as history of earlier sessions
+	bool (*import)(history_t * h, const history_item_t * items, ssize_t count);
+	/// Call `fun` for every distinct entry, oldest first
+	void (*for_each)(const history_t * h, history_item_fun_t * fun, void *arg);
+	/// Catch up with changes of other sessions, returns a number that changes
+	/// whenever entries were added other than by own pushes, or dropped to
+	/// stay within the maximum number or age of entries
+	long (*version)(history_t * h);
+	history_cursor_t *(*cursor_new)(const history_t * h, const char *prefix);
+	history_cursor_t *(*cursor_new_search)(const history_t * h, const char *search);
+	void (*cursor_free)(history_cursor_t * cur);
+	const char *(*cursor_prefix)(const history_cursor_t * cur);
+	ssize_t (*cursor_pos)(const history_cursor_t * cur);
+	const char *(*cursor_prev)(history_cursor_t * cur);
+	const char *(*cursor_next)(history_cursor_t * cur);
+	const char *(*cursor_entry)(const history_cursor_t * cur);
+};
+
+/// Backend by name ("file", or "sqlite" if compiled in), NULL gives the default one
+rpl_private const history_backend_t *history_backend_find(const char *name);
+rpl_private const history_backend_t *history_backend(const history_t * h);
+/// Backend by index (0 is the default one), returns NULL past the last one
+rpl_private const history_backend_t *history_backend_at(ssize_t i);
 
 /// Private API
-rpl_private history_t *history_new(alloc_t * mem);
+/// Create a history with the given backend (NULL for the default one)
+rpl_private history_t *history_new(alloc_t * mem, const history_backend_t * backend);
 rpl_private void history_free(history_t * h);
-rpl_private void history_save(const history_t * h);
-rpl_private ssize_t history_count_with_prefix(const history_t * h,
-                                              const char *prefix);
-rpl_private const char *history_get_with_prefix(const history_t * h, ssize_t n,
+rpl_private void history_save(history_t * h);
+/// The returned entry is owned by the history and stays valid until the
+/// next call or until the history is modified
+rpl_private const char *history_get_with_prefix(history_t * h, ssize_t n,
                                                 const char *prefix);
 
+rpl_private history_cursor_t *history_cursor_new(const history_t * h,
+                                                 const char *prefix);
+/// Cursor over the distinct entries that contain `search` anywhere (incremental search)
+rpl_private history_cursor_t *history_cursor_new_search(const history_t * h,
+                                                        const char *search);
+/// Cursor over the best fuzzy matches of `pattern`, from the best to the worst one
+rpl_private history_cursor_t *history_cursor_new_fuzzy(history_t * h,
+                                                       const char *pattern);
+rpl_private void history_cursor_free(history_cursor_t * cur);
+rpl_private const char *history_cursor_prefix(const history_cursor_t * cur);
+/// Number of entries the cursor has stepped back (0 is before the most recent entry)
+rpl_private ssize_t history_cursor_pos(const history_cursor_t * cur);
+/// Step to the next older entry, returns NULL if there is none (the cursor stays put)
+rpl_private const char *history_cursor_prev(history_cursor_t * cur);
+/// Step to the next newer entry, returns NULL when stepping back to position 0
+rpl_private const char *history_cursor_next(history_cursor_t * cur);
+/// The entry at the current position, or NULL at position 0
+rpl_private const char *history_cursor_entry(const history_cursor_t * cur);
+
+/// The entry that matches `pattern` best as a fuzzy search, or NULL; it stays
+/// valid until the history is modified
+rpl_private const char *history_get_fuzzy(history_t * h, const char *pattern);
+
 /// Called from public repline API:
 rpl_private void history_clear(history_t * h);
 rpl_private void history_close(history_t * h);
@@ -27,5 +119,32 @@ rpl_private void history_load_from(history_t * h, const char *fname,
                                    long max_entries);
 rpl_private bool history_push(history_t * h, const char *entry);
 rpl_private void history_remove_last(history_t * h);
+rpl_private void history_set_async(history_t * h, bool enable);
+/// Drop entries older than `max_age` seconds (0 for no limit), if the backend keeps timestamps
+rpl_private void history_set_max_age(history_t * h, long max_age);
+/// Cache hints and the first entries of history walks, filled ahead of time by
+/// history_prefetch_step() while the user is idle
+rpl_private void history_enable_prefetch(history_t * h, bool enable);
+/// Set the input to prefetch for: its hint and walk, and the hints of the next characters
+rpl_private void history_prefetch_from(history_t * h, const char *input);
+/// Do one lookup for the current input, returns false if there is nothing left to do
+rpl_private bool history_prefetch_step(history_t * h);
+/// Read a bash, zsh or repline history file and add its entries in one go
+rpl_private bool history_import(history_t * h, alloc_t * mem, const char *fname,
+                                rpl_history_format_t format);
+rpl_private bool history_export(const history_t * h, alloc_t * mem, const char *fname,
+                                rpl_history_format_t format);
+
+/// The format of the "file" backend: one entry per line with `\n`, `\t`, `\\`
+/// and `\xHH` escapes (`#` is always escaped, lines starting with it are comments)
+rpl_private bool history_unescape(const char *p, const char *end, char *buf);
+rpl_private void history_append_record(const char *entry, stringbuf_t * sbuf);
+
+/// Word `n` (0 is the last one) of the `i`-th most recent entry (1 is the most recent one),
+/// as a span of the entry with its quotes. Returns NULL past the words of the entry.
+rpl_private const char *history_get_word(const history_t * h, ssize_t i, ssize_t n,
+                                         ssize_t * len);
+/// Number of recent entries whose words are indexed
+rpl_private ssize_t history_word_entries(const history_t * h);
 
 #endif                          // RPL_HISTORY_H
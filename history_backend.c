@@ -0,0 +1,1291 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "repline.h"
+#include "common.h"
+#include "history.h"
+#include "fuzzy.h"
+
+#define RPL_MAX_WORD_ENTRIES (100)
+#define RPL_PREFETCH_SLOTS   (32)
+#define RPL_PREFETCH_WALK    (8)    // entries of a walk that are kept per prefix
+#define RPL_FUZZY_RESULTS    (256)  // entries of a fuzzy search cursor
+
+//-------------------------------------------------------------
+// Word index for Alt-.
+//
+// Every pushed entry is split into shell words once, and the
+// spans of the words are kept next to a copy of the entry for
+// the most recent entries. Stepping through the earlier words is
+// then an array walk that can go on into older entries.
+//-------------------------------------------------------------
+
+typedef struct word_span_s {
+	ssize_t start;
+	ssize_t len;
+} word_span_t;
+
+typedef struct word_entry_s {
+	char *entry;
+	word_span_t *spans;         // words of the entry, from first to last
+	ssize_t count;
+} word_entry_t;
+
+struct history_words_s {
+	word_entry_t entries[RPL_MAX_WORD_ENTRIES]; // ring buffer, oldest first
+	ssize_t first;
+	ssize_t count;
+	alloc_t *mem;
+};
+
+static bool
+word_is_blank(char c)
+{
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+}
+
+/// Split `entry` into words separated by blanks, keeping quoted and escaped blanks
+/// inside a word. Fills in at most `max` spans and returns the number of words.
+static ssize_t
+history_split_words(const char *entry, word_span_t * spans, ssize_t max)
+{
+	ssize_t count = 0;
+	ssize_t i = 0;
+	while (true) {
+		while (word_is_blank(entry[i])) {
+			i++;
+		}
+		if (entry[i] == 0)
+			return count;
+		ssize_t start = i;
+		char quote = 0;
+		for (; entry[i] != 0 && (quote != 0 || !word_is_blank(entry[i])); i++) {
+			if (quote == 0 && (entry[i] == '\'' || entry[i] == '"'))
+				quote = entry[i];
+			else if (entry[i] == quote)
+				quote = 0;
+			else if (entry[i] == '\\' && quote != '\'' && entry[i + 1] != 0)
+				i++;
+		}
+		if (count < max) {
+			spans[count].start = start;
+			spans[count].len = i - start;
+		}
+		count++;
+	}
+}
+
+static void
+word_entry_done(alloc_t * mem, word_entry_t * we)
+{
+	mem_free(mem, we->entry);
+	mem_free(mem, we->spans);
+	we->entry = NULL;
+	we->spans = NULL;
+	we->count = 0;
+}
+
+static history_words_t *
+history_words_new(alloc_t * mem)
+{
+	history_words_t *words = mem_zalloc_tp(mem, history_words_t);
+	if (words != NULL)
+		words->mem = mem;
+	return words;
+}
+
+static void
+history_words_clear(history_words_t * words)
+{
+	for (ssize_t i = 0; i < words->count; i++) {
+		word_entry_done(words->mem, &words->entries[(words->first + i) % RPL_MAX_WORD_ENTRIES]);
+	}
+	words->first = 0;
+	words->count = 0;
+}
+
+static void
+history_words_push(history_words_t * words, const char *entry)
+{
+	/// Entries without words are kept too, so removing the last entry stays in step
+	ssize_t count = history_split_words(entry, NULL, 0);
+	word_entry_t we;
+	we.entry = mem_strdup(words->mem, entry);
+	we.spans = (count > 0 ? mem_malloc_tp_n(words->mem, word_span_t, count) : NULL);
+	we.count = count;
+	if (we.entry == NULL || (count > 0 && we.spans == NULL)) {
+		word_entry_done(words->mem, &we);
+		return;
+	}
+	history_split_words(entry, we.spans, count);
+	if (words->count == RPL_MAX_WORD_ENTRIES) {
+		word_entry_done(words->mem, &words->entries[words->first]);
+		words->first = (words->first + 1) % RPL_MAX_WORD_ENTRIES;
+		words->count--;
+	}
+	words->entries[(words->first + words->count) % RPL_MAX_WORD_ENTRIES] = we;
+	words->count++;
+}
+
+/// Drop the most recent entry if it is `entry`
+static void
+history_words_pop(history_words_t * words, const char *entry)
+{
+	if (words->count == 0)
+		return;
+	word_entry_t *last = &words->entries[(words->first + words->count - 1) % RPL_MAX_WORD_ENTRIES];
+	if (strcmp(last->entry, entry) != 0)
+		return;
+	words->count--;
+	word_entry_done(words->mem, &words->entries[(words->first + words->count) % RPL_MAX_WORD_ENTRIES]);
+}
+
+/// Index the words of the most recent entries of a loaded history
+static void
+history_words_load(history_t * h)
+{
+	const char *entries[RPL_MAX_WORD_ENTRIES];
+	history_cursor_t *cur = history_cursor_new(h, "");
+	ssize_t count = 0;
+	while (cur != NULL && count < RPL_MAX_WORD_ENTRIES
+	       && (entries[count] = history_cursor_prev(cur)) != NULL) {
+		count++;
+	}
+	history_words_clear(h->words);
+	while (count > 0) {
+		const char *entry = entries[--count];
+		if (entry[0] != 0)
+			history_words_push(h->words, entry);
+	}
+	history_cursor_free(cur);
+}
+
+rpl_private const char *
+history_get_word(const history_t * h, ssize_t i, ssize_t n, ssize_t * len)
+{
+	const history_words_t *words = h->words;
+	if (words == NULL || i <= 0 || i > words->count)
+		return NULL;
+	const word_entry_t *we = &words->entries[(words->first + words->count - i) % RPL_MAX_WORD_ENTRIES];
+	if (n < 0 || n >= we->count)
+		return NULL;
+	const word_span_t *span = &we->spans[we->count - 1 - n];
+	*len = span->len;
+	return we->entry + span->start;
+}
+
+rpl_private ssize_t
+history_word_entries(const history_t * h)
+{
+	return (h->words == NULL ? 0 : h->words->count);
+}
+
+//-------------------------------------------------------------
+// Prefetch cache
+//
+// While the editor waits for a key, history_prefetch_step() looks
+// up the hint and the first walk entries (Ctrl-P) of the current
+// input, and then the hints of the input extended by each of the
+// characters that these entries continue with. The results are
+// kept per prefix in a few slots that are reused round robin, and
+// every change of the history drops them, also one by another
+// session (see history_check_version). The lookups run on the
+// editing thread between polls of the terminal, as the backends
+// are not thread safe.
+//-------------------------------------------------------------
+
+typedef struct prefetch_slot_s {
+	char *prefix;               // NULL if the slot is unused
+	bool has_hint;              // was the hint looked up?
+	char *hint;                 // most recent entry with the prefix (or NULL)
+	ssize_t walk_count;         // number of walk entries, -1 if not looked up
+	bool walk_complete;         // are these all the entries with the prefix?
+	char *walk[RPL_PREFETCH_WALK];
+} prefetch_slot_t;
+
+struct history_prefetch_s {
+	prefetch_slot_t slots[RPL_PREFETCH_SLOTS];
+	ssize_t next;               // slot to reuse next
+	char *input;                // input to prefetch for
+	ssize_t step;               // next step for the input (0 is its own hint and walk)
+	alloc_t *mem;
+};
+
+static void
+prefetch_slot_done(alloc_t * mem, prefetch_slot_t * slot)
+{
+	mem_free(mem, slot->prefix);
+	mem_free(mem, slot->hint);
+	for (ssize_t i = 0; i < slot->walk_count; i++) {
+		mem_free(mem, slot->walk[i]);
+	}
+	memset(slot, 0, sizeof(*slot));
+	slot->walk_count = -1;
+}
+
+static void
+history_prefetch_clear(history_prefetch_t * pf)
+{
+	if (pf == NULL)
+		return;
+	for (ssize_t i = 0; i < RPL_PREFETCH_SLOTS; i++) {
+		prefetch_slot_done(pf->mem, &pf->slots[i]);
+	}
+	pf->step = 0;
+}
+
+static void history_fuzzy_clear(history_fuzzy_t * fz);
+
+/// Drop the prefetched lookups and the fuzzy index if the backend changed
+/// since they were made
+static void
+history_check_version(history_t * h)
+{
+	long version = h->backend->version(h);
+	if (version == h->version)
+		return;
+	h->version = version;
+	history_prefetch_clear(h->prefetch);
+	history_fuzzy_clear(h->fuzzy);
+}
+
+static prefetch_slot_t *
+prefetch_find(history_prefetch_t * pf, const char *prefix)
+{
+	for (ssize_t i = 0; i < RPL_PREFETCH_SLOTS; i++) {
+		if (pf->slots[i].prefix != NULL && strcmp(pf->slots[i].prefix, prefix) == 0)
+			return &pf->slots[i];
+	}
+	return NULL;
+}
+
+/// The slot of `prefix`, taking over the next slot in turn if there is none yet
+static prefetch_slot_t *
+prefetch_slot(history_prefetch_t * pf, const char *prefix)
+{
+	prefetch_slot_t *slot = prefetch_find(pf, prefix);
+	if (slot != NULL)
+		return slot;
+	slot = &pf->slots[pf->next];
+	pf->next = (pf->next + 1) % RPL_PREFETCH_SLOTS;
+	prefetch_slot_done(pf->mem, slot);
+	slot->prefix = mem_strdup(pf->mem, prefix);
+	return (slot->prefix == NULL ? NULL : slot);
+}
+
+static void
+prefetch_set_hint(history_prefetch_t * pf, const char *prefix, const char *hint)
+{
+	prefetch_slot_t *slot = prefetch_slot(pf, prefix);
+	if (slot == NULL)
+		return;
+	mem_free(pf->mem, slot->hint);
+	slot->hint = (hint == NULL ? NULL : mem_strdup(pf->mem, hint));
+	slot->has_hint = (hint == NULL || slot->hint != NULL);
+}
+
+static void
+prefetch_walk(history_t * h, const char *prefix)
+{
+	history_prefetch_t *pf = h->prefetch;
+	history_cursor_t *cur = h->backend->cursor_new(h, prefix);
+	if (cur == NULL)
+		return;
+	prefetch_slot_t *slot = prefetch_slot(pf, prefix);
+	if (slot != NULL && slot->walk_count < 0) {
+		slot->walk_count = 0;
+		slot->walk_complete = false;
+		while (slot->walk_count < RPL_PREFETCH_WALK) {
+			const char *entry = h->backend->cursor_prev(cur);
+			char *copy = (entry == NULL ? NULL : mem_strdup(pf->mem, entry));
+			if (copy == NULL) {
+				slot->walk_complete = (entry == NULL);
+				break;
+			}
+			slot->walk[slot->walk_count++] = copy;
+		}
+	}
+	h->backend->cursor_free(cur);
+}
+
+rpl_private void
+history_enable_prefetch(history_t * h, bool enable)
+{
+	if (!enable) {
+		if (h->prefetch != NULL) {
+			history_prefetch_clear(h->prefetch);
+			mem_free(h->prefetch->mem, h->prefetch->input);
+			mem_free(h->prefetch->mem, h->prefetch);
+			h->prefetch = NULL;
+		}
+		return;
+	}
+	if (h->prefetch != NULL || h->words == NULL)
+		return;
+	h->prefetch = mem_zalloc_tp(h->words->mem, history_prefetch_t);
+	if (h->prefetch == NULL)
+		return;
+	h->prefetch->mem = h->words->mem;
+	history_prefetch_clear(h->prefetch);
+}
+
+rpl_private void
+history_prefetch_from(history_t * h, const char *input)
+{
+	history_prefetch_t *pf = h->prefetch;
+	if (pf == NULL || (pf->input != NULL && strcmp(pf->input, input) == 0))
+		return;
+	mem_free(pf->mem, pf->input);
+	pf->input = mem_strdup(pf->mem, input);
+	pf->step = 0;
+}
+
+rpl_private bool
+history_prefetch_step(history_t * h)
+{
+	history_prefetch_t *pf = h->prefetch;
+	if (pf == NULL || pf->input == NULL)
+		return false;
+	history_check_version(h);
+	if (pf->step == 0) {
+		pf->step++;
+		prefetch_slot_t *slot = prefetch_find(pf, pf->input);
+		if (slot == NULL || !slot->has_hint)
+			prefetch_set_hint(pf, pf->input, h->backend->get_with_prefix(h, 1, pf->input));
+		slot = prefetch_find(pf, pf->input);
+		if (slot == NULL || slot->walk_count < 0)
+			prefetch_walk(h, pf->input);
+		return true;
+	}
+	/// Then the hints for one more character, as the known entries continue
+	prefetch_slot_t *slot = prefetch_find(pf, pf->input);
+	if (slot == NULL || slot->walk_count < 0)
+		return false;
+	ssize_t len = rpl_strlen(pf->input);
+	while (pf->step <= slot->walk_count + 1) {
+		const char *entry = (pf->step == 1 ? slot->hint : slot->walk[pf->step - 2]);
+		pf->step++;
+		if (entry == NULL || rpl_strlen(entry) <= len)
+			continue;
+		ssize_t next = len + 1;
+		while (entry[next] != 0 && utf8_is_cont((uint8_t) entry[next])) {
+			next++;
+		}
+		char *prefix = mem_strndup(pf->mem, entry, next);
+		if (prefix == NULL)
+			return false;
+		prefetch_slot_t *pslot = prefetch_find(pf, prefix);
+		bool done = (pslot != NULL && pslot->has_hint);
+		if (!done)
+			prefetch_set_hint(pf, prefix, h->backend->get_with_prefix(h, 1, prefix));
+		mem_free(pf->mem, prefix);
+		if (!done)
+			return true;
+	}
+	return false;
+}
+
+/// A cursor that returns the prefetched entries of a walk first and only
+/// then continues with a cursor of the backend
+typedef struct prefetch_cursor_s {
+	history_cursor_t base;
+	const history_t *h;
+	char *prefix;
+	char *walk[RPL_PREFETCH_WALK];  // copies, a new walk may reuse the slot
+	ssize_t walk_count;
+	bool walk_complete;
+	ssize_t pos;
+	history_cursor_t *cur;      // cursor of the backend, past the prefetched entries
+	alloc_t *mem;
+} prefetch_cursor_t;
+
+static const history_backend_t prefetch_cursor_backend;
+
+static history_cursor_t *
+prefetch_cursor_new(const history_t * h, const prefetch_slot_t * slot)
+{
+	alloc_t *mem = h->prefetch->mem;
+	prefetch_cursor_t *cur = mem_zalloc_tp(mem, prefetch_cursor_t);
+	if (cur == NULL)
+		return NULL;
+	cur->base.backend = &prefetch_cursor_backend;
+	cur->h = h;
+	cur->mem = mem;
+	cur->prefix = mem_strdup(mem, slot->prefix);
+	cur->walk_complete = slot->walk_complete;
+	for (ssize_t i = 0; i < slot->walk_count; i++) {
+		cur->walk[i] = mem_strdup(mem, slot->walk[i]);
+		if (cur->walk[i] == NULL)
+			break;
+		cur->walk_count++;
+	}
+	if (cur->prefix == NULL || cur->walk_count < slot->walk_count) {
+		history_cursor_free(&cur->base);
+		return NULL;
+	}
+	return &cur->base;
+}
+
+static void
+prefetch_cursor_free(history_cursor_t * hcur)
+{
+	prefetch_cursor_t *cur = (prefetch_cursor_t *) hcur;
+	history_cursor_free(cur->cur);
+	for (ssize_t i = 0; i < cur->walk_count; i++) {
+		mem_free(cur->mem, cur->walk[i]);
+	}
+	mem_free(cur->mem, cur->prefix);
+	mem_free(cur->mem, cur);
+}
+
+static const char *
+prefetch_cursor_prefix(const history_cursor_t * hcur)
+{
+	return ((const prefetch_cursor_t *)hcur)->prefix;
+}
+
+static ssize_t
+prefetch_cursor_pos(const history_cursor_t * hcur)
+{
+	return ((const prefetch_cursor_t *)hcur)->pos;
+}
+
+static const char *
+prefetch_cursor_entry(const history_cursor_t * hcur)
+{
+	const prefetch_cursor_t *cur = (const prefetch_cursor_t *)hcur;
+	if (cur->cur != NULL)
+		return history_cursor_entry(cur->cur);
+	return (cur->pos == 0 ? NULL : cur->walk[cur->pos - 1]);
+}
+
+static const char *
+prefetch_cursor_prev(history_cursor_t * hcur)
+{
+	prefetch_cursor_t *cur = (prefetch_cursor_t *) hcur;
+	if (cur->cur == NULL) {
+		if (cur->pos < cur->walk_count)
+			return cur->walk[cur->pos++];
+		if (cur->walk_complete)
+			return NULL;
+		/// Past the prefetched entries: catch up with a cursor of the backend
+		cur->cur = cur->h->backend->cursor_new(cur->h, cur->prefix);
+		if (cur->cur == NULL)
+			return NULL;
+		while (history_cursor_pos(cur->cur) < cur->pos) {
+			if (history_cursor_prev(cur->cur) == NULL)
+				break;
+		}
+	}
+	const char *entry = history_cursor_prev(cur->cur);
+	cur->pos = history_cursor_pos(cur->cur);
+	return entry;
+}
+
+static const char *
+prefetch_cursor_next(history_cursor_t * hcur)
+{
+	prefetch_cursor_t *cur = (prefetch_cursor_t *) hcur;
+	if (cur->cur != NULL) {
+		const char *entry = history_cursor_next(cur->cur);
+		cur->pos = history_cursor_pos(cur->cur);
+		return entry;
+	}
+	if (cur->pos == 0)
+		return NULL;
+	cur->pos--;
+	return (cur->pos == 0 ? NULL : cur->walk[cur->pos - 1]);
+}
+
+static const history_backend_t prefetch_cursor_backend = {
+	.name = "prefetch",
+	.cursor_free = prefetch_cursor_free,
+	.cursor_prefix = prefetch_cursor_prefix,
+	.cursor_pos = prefetch_cursor_pos,
+	.cursor_prev = prefetch_cursor_prev,
+	.cursor_next = prefetch_cursor_next,
+	.cursor_entry = prefetch_cursor_entry,
+};
+
+//-------------------------------------------------------------
+// Fuzzy search
+//
+// The first fuzzy search copies every distinct entry (oldest
+// first) into blocks that never move, next to the character mask
+// of each entry, and pushed entries are appended. Searches then
+// rank the whole index at once (see fuzzy_rank) instead of going
+// through the backend. A pushed entry that was already in the
+// history is found in a hash set and its older copy gets an empty
+// mask, which no pattern matches. The index is built again once
+// most copies are dead, or when the backend version changes (other
+// sessions pushed entries, or old ones were pruned).
+//-------------------------------------------------------------
+
+typedef struct fuzzy_block_s {
+	struct fuzzy_block_s *next; // older block
+	ssize_t size;
+	ssize_t used;
+	// followed by `size` bytes
+} fuzzy_block_t;
+
+struct history_fuzzy_s {
+	bool built;
+	const char **entries;       // oldest first
+	uint64_t *masks;            // 0 for an entry that was pushed again later
+	ssize_t count;
+	ssize_t len;
+	ssize_t dead;               // entries that were pushed again later
+	ssize_t *set;               // hash set of the live entries (index + 1)
+	ssize_t set_len;
+	fuzzy_block_t *blocks;      // newest block first
+	alloc_t *mem;
+};
+
+static void
+history_fuzzy_clear(history_fuzzy_t * fz)
+{
+	if (fz == NULL)
+		return;
+	while (fz->blocks != NULL) {
+		fuzzy_block_t *block = fz->blocks;
+		fz->blocks = block->next;
+		mem_free(fz->mem, block);
+	}
+	mem_free(fz->mem, fz->entries);
+	mem_free(fz->mem, fz->masks);
+	mem_free(fz->mem, fz->set);
+	fz->entries = NULL;
+	fz->masks = NULL;
+	fz->set = NULL;
+	fz->count = 0;
+	fz->len = 0;
+	fz->dead = 0;
+	fz->set_len = 0;
+	fz->built = false;
+}
+
+static bool
+history_fuzzy_eq(const void *arg, ssize_t index, const char *entry, uint64_t hash)
+{
+	rpl_unused(hash);
+	return (strcmp(((const history_fuzzy_t *)arg)->entries[index], entry) == 0);
+}
+
+// slot of `entry` in the set, or the empty slot where it belongs
+static ssize_t
+history_fuzzy_find(const history_fuzzy_t * fz, const char *entry, uint64_t hash)
+{
+	return rpl_hset_find(fz->set, fz->set_len, entry, hash, &history_fuzzy_eq, fz);
+}
+
+static bool
+history_fuzzy_add(history_fuzzy_t * fz, const char *entry)
+{
+	if (entry == NULL || entry[0] == 0)
+		return true;
+	if (fz->count >= fz->len) {
+		ssize_t newlen = (fz->len <= 0 ? 1024 : 2 * fz->len);
+		const char **entries = mem_realloc_tp(fz->mem, const char *, fz->entries, newlen);
+		if (entries == NULL)
+			return false;
+		fz->entries = entries;
+		uint64_t *masks = mem_realloc_tp(fz->mem, uint64_t, fz->masks, newlen);
+		if (masks == NULL)
+			return false;
+		fz->masks = masks;
+		fz->len = newlen;
+	}
+	ssize_t live = fz->count - fz->dead;
+	if (2 * (live + 1) >= fz->set_len) {
+		if (!rpl_hset_reset(fz->mem, &fz->set, &fz->set_len, live + 1))
+			return false;
+		for (ssize_t i = 0; i < fz->count; i++) {
+			if (fz->masks[i] != 0)
+				fz->set[history_fuzzy_find(fz, fz->entries[i], rpl_hash(fz->entries[i]))] = i + 1;
+		}
+	}
+	ssize_t slot = history_fuzzy_find(fz, entry, rpl_hash(entry));
+	ssize_t n = rpl_strlen(entry) + 1;
+	fuzzy_block_t *block = fz->blocks;
+	if (block == NULL || block->size - block->used < n) {
+		ssize_t size = (block == NULL ? 4096 : 2 * block->size);
+		while (size < n) {
+			size *= 2;
+		}
+		block = (fuzzy_block_t *) mem_malloc(fz->mem, ssizeof(fuzzy_block_t) + size);
+		if (block == NULL)
+			return false;
+		block->next = fz->blocks;
+		block->size = size;
+		block->used = 0;
+		fz->blocks = block;
+	}
+	char *copy = (char *)(block + 1) + block->used;
+	memcpy(copy, entry, to_size_t(n));
+	block->used += n;
+	fz->entries[fz->count] = copy;
+	fz->masks[fz->count] = fuzzy_mask(copy);
+	if (fz->set[slot] != 0) {
+		fz->masks[fz->set[slot] - 1] = 0;
+		fz->dead++;
+	}
+	fz->count++;
+	fz->set[slot] = fz->count;
+	return true;
+}
+
+static bool
+history_fuzzy_add_item(const char *entry, long ts, void *arg)
+{
+	rpl_unused(ts);
+	return history_fuzzy_add((history_fuzzy_t *) arg, entry);
+}
+
+static history_fuzzy_t *
+history_fuzzy_index(history_t * h)
+{
+	history_fuzzy_t *fz = h->fuzzy;
+	if (fz == NULL)
+		return NULL;
+	history_check_version(h);
+	if (fz->built && 2 * fz->dead > fz->count)
+		history_fuzzy_clear(fz);
+	if (fz->built)
+		return fz;
+	h->backend->for_each(h, &history_fuzzy_add_item, fz);
+	fz->built = true;
+	return fz;
+}
+
+/// Rank the index and keep the best `max` hits in `top` (which must be freed
+/// with fuzzy_topk_done if the returned count is not 0)
+static ssize_t
+history_fuzzy_rank(history_t * h, const char *pattern, fuzzy_topk_t * top,
+                   ssize_t max)
+{
+	history_fuzzy_t *fz = history_fuzzy_index(h);
+	if (fz == NULL || pattern == NULL || pattern[0] == 0)
+		return 0;
+	if (!fuzzy_topk_init(top, fz->mem, max))
+		return 0;
+	if (!fuzzy_rank(top, pattern, fz->entries, fz->masks, fz->count) || top->count == 0) {
+		fuzzy_topk_done(top);
+		return 0;
+	}
+	return top->count;
+}
+
+/// A cursor over the best fuzzy matches, from the best to the worst one
+typedef struct fuzzy_cursor_s {
+	history_cursor_t base;
+	char *pattern;
+	const char **entries;       // copies, as the index may be built again meanwhile
+	ssize_t count;
+	ssize_t pos;
+	alloc_t *mem;
+} fuzzy_cursor_t;
+
+static const history_backend_t fuzzy_cursor_backend;
+
+static void
+fuzzy_cursor_free(history_cursor_t * hcur)
+{
+	fuzzy_cursor_t *cur = (fuzzy_cursor_t *) hcur;
+	mem_free(cur->mem, cur->entries);
+	mem_free(cur->mem, cur->pattern);
+	mem_free(cur->mem, cur);
+}
+
+static const char *
+fuzzy_cursor_prefix(const history_cursor_t * hcur)
+{
+	return ((const fuzzy_cursor_t *)hcur)->pattern;
+}
+
+static ssize_t
+fuzzy_cursor_pos(const history_cursor_t * hcur)
+{
+	return ((const fuzzy_cursor_t *)hcur)->pos;
+}
+
+static const char *
+fuzzy_cursor_entry(const history_cursor_t * hcur)
+{
+	const fuzzy_cursor_t *cur = (const fuzzy_cursor_t *)hcur;
+	return (cur->pos == 0 ? NULL : cur->entries[cur->pos - 1]);
+}
+
+static const char *
+fuzzy_cursor_prev(history_cursor_t * hcur)
+{
+	fuzzy_cursor_t *cur = (fuzzy_cursor_t *) hcur;
+	if (cur->pos >= cur->count)
+		return NULL;
+	return cur->entries[cur->pos++];
+}
+
+static const char *
+fuzzy_cursor_next(history_cursor_t * hcur)
+{
+	fuzzy_cursor_t *cur = (fuzzy_cursor_t *) hcur;
+	if (cur->pos == 0)
+		return NULL;
+	cur->pos--;
+	return (cur->pos == 0 ? NULL : cur->entries[cur->pos - 1]);
+}
+
+static const history_backend_t fuzzy_cursor_backend = {
+	.name = "fuzzy",
+	.cursor_free = fuzzy_cursor_free,
+	.cursor_prefix = fuzzy_cursor_prefix,
+	.cursor_pos = fuzzy_cursor_pos,
+	.cursor_prev = fuzzy_cursor_prev,
+	.cursor_next = fuzzy_cursor_next,
+	.cursor_entry = fuzzy_cursor_entry,
+};
+
+rpl_private history_cursor_t *
+history_cursor_new_fuzzy(history_t * h, const char *pattern)
+{
+	if (h->fuzzy == NULL)
+		return history_cursor_new_search(h, pattern);
+	alloc_t *mem = h->fuzzy->mem;
+	fuzzy_cursor_t *cur = mem_zalloc_tp(mem, fuzzy_cursor_t);
+	if (cur == NULL)
+		return NULL;
+	cur->base.backend = &fuzzy_cursor_backend;
+	cur->mem = mem;
+	cur->pattern = mem_strdup(mem, pattern);
+	fuzzy_topk_t top;
+	ssize_t count = history_fuzzy_rank(h, pattern, &top, RPL_FUZZY_RESULTS);
+	if (count > 0) {
+		/// The pointers and the strings share one allocation
+		ssize_t size = count * ssizeof(const char *);
+		for (ssize_t i = 0; i < count; i++) {
+			size += rpl_strlen(h->fuzzy->entries[top.hits[i].index]) + 1;
+		}
+		cur->entries = (const char **)mem_malloc(mem, size);
+		if (cur->entries != NULL) {
+			char *p = (char *)(cur->entries + count);
+			for (ssize_t i = 0; i < count; i++) {
+				const char *entry = h->fuzzy->entries[top.hits[i].index];
+				ssize_t n = rpl_strlen(entry) + 1;
+				memcpy(p, entry, to_size_t(n));
+				cur->entries[i] = p;
+				p += n;
+			}
+			cur->count = count;
+		}
+		fuzzy_topk_done(&top);
+	}
+	if (cur->pattern == NULL || cur->count < count) {
+		fuzzy_cursor_free(&cur->base);
+		return NULL;
+	}
+	return &cur->base;
+}
+
+rpl_private const char *
+history_get_fuzzy(history_t * h, const char *pattern)
+{
+	fuzzy_topk_t top;
+	if (history_fuzzy_rank(h, pattern, &top, 1) == 0)
+		return NULL;
+	const char *entry = h->fuzzy->entries[top.hits[0].index];
+	fuzzy_topk_done(&top);
+	return entry;
+}
+
+//-------------------------------------------------------------
+// History backends
+//
+// The backends are compiled in together and selected at runtime:
+// every history (and cursor) starts with a pointer to the backend
+// that created it, and the functions below dispatch through it.
+//-------------------------------------------------------------
+
+/// Compiled in backends, the first one is the default
+static const history_backend_t *history_backends[] = {
+#ifdef RPL_HIST_IMPL_SQLITE
+	&history_sqlite_backend,
+#endif
+	&history_file_backend,
+	NULL
+};
+
+rpl_private const history_backend_t *
+history_backend_at(ssize_t i)
+{
+	ssize_t count = (ssize_t) (sizeof(history_backends) / sizeof(history_backends[0])) - 1;
+	return (i < 0 || i >= count ? NULL : history_backends[i]);
+}
+
+rpl_private const history_backend_t *
+history_backend_find(const char *name)
+{
+	if (name == NULL)
+		return history_backends[0];
+	for (const history_backend_t ** b = history_backends; *b != NULL; b++) {
+		if (strcmp((*b)->name, name) == 0)
+			return *b;
+	}
+	return NULL;
+}
+
+rpl_private const history_backend_t *
+history_backend(const history_t * h)
+{
+	return h->backend;
+}
+
+rpl_private history_t *
+history_new(alloc_t * mem, const history_backend_t * backend)
+{
+	if (backend == NULL)
+		backend = history_backends[0];
+	history_t *h = backend->create(mem);
+	if (h != NULL) {
+		h->words = history_words_new(mem);
+		h->prefetch = NULL;
+		h->fuzzy = mem_zalloc_tp(mem, history_fuzzy_t);
+		if (h->fuzzy != NULL)
+			h->fuzzy->mem = mem;
+	}
+	return h;
+}
+
+rpl_private void
+history_free(history_t * h)
+{
+	if (h == NULL)
+		return;
+	history_enable_prefetch(h, false);
+	if (h->fuzzy != NULL) {
+		history_fuzzy_clear(h->fuzzy);
+		mem_free(h->fuzzy->mem, h->fuzzy);
+		h->fuzzy = NULL;
+	}
+	if (h->words != NULL) {
+		history_words_clear(h->words);
+		mem_free(h->words->mem, h->words);
+		h->words = NULL;
+	}
+	h->backend->free(h);
+}
+
+rpl_private void
+history_load_from(history_t * h, const char *fname, long max_entries)
+{
+	history_prefetch_clear(h->prefetch);
+	history_fuzzy_clear(h->fuzzy);
+	h->backend->load_from(h, fname, max_entries);
+	if (h->words != NULL)
+		history_words_load(h);
+}
+
+rpl_private void
+history_save(history_t * h)
+{
+	h->backend->save(h);
+}
+
+rpl_private void
+history_close(history_t * h)
+{
+	h->backend->close(h);
+}
+
+rpl_private void
+history_clear(history_t * h)
+{
+	history_prefetch_clear(h->prefetch);
+	history_fuzzy_clear(h->fuzzy);
+	h->backend->clear(h);
+	if (h->words != NULL)
+		history_words_clear(h->words);
+}
+
+rpl_private bool
+history_push(history_t * h, const char *entry)
+{
+	history_prefetch_clear(h->prefetch);
+	bool ok = h->backend->push(h, entry);
+	if (ok && h->words != NULL && entry[0] != 0)
+		history_words_push(h->words, entry);
+	if (ok && h->fuzzy != NULL && h->fuzzy->built && !history_fuzzy_add(h->fuzzy, entry))
+		history_fuzzy_clear(h->fuzzy);
+	return ok;
+}
+
+rpl_private void
+history_remove_last(history_t * h)
+{
+	history_prefetch_clear(h->prefetch);
+	history_fuzzy_clear(h->fuzzy);
+	if (h->words != NULL) {
+		// empty entries are not indexed, so the last indexed one may be older
+		const char *last = h->backend->get_with_prefix(h, 1, "");
+		if (last != NULL)
+			history_words_pop(h->words, last);
+	}
+	h->backend->remove_last(h);
+}
+
+rpl_private void
+history_set_async(history_t * h, bool enable)
+{
+	h->backend->set_async(h, enable);
+}
+
+rpl_private void
+history_set_max_age(history_t * h, long max_age)
+{
+	h->backend->set_max_age(h, max_age);
+}
+
+rpl_private const char *
+history_get_with_prefix(history_t * h, ssize_t n, const char *prefix)
+{
+	if (h->prefetch == NULL || n != 1)
+		return h->backend->get_with_prefix(h, n, prefix);
+	history_check_version(h);
+	prefetch_slot_t *slot = prefetch_find(h->prefetch, prefix);
+	if (slot != NULL && slot->has_hint)
+		return slot->hint;
+	const char *entry = h->backend->get_with_prefix(h, n, prefix);
+	prefetch_set_hint(h->prefetch, prefix, entry);
+	return entry;
+}
+
+//-------------------------------------------------------------
+// History cursor
+//-------------------------------------------------------------
+
+rpl_private history_cursor_t *
+history_cursor_new(const history_t * h, const char *prefix)
+{
+	if (h->prefetch != NULL) {
+		/// The caches are not part of the entries, so dropping them is fine here
+		history_check_version((history_t *) h);
+		const prefetch_slot_t *slot = prefetch_find(h->prefetch, prefix);
+		if (slot != NULL && slot->walk_count >= 0)
+			return prefetch_cursor_new(h, slot);
+	}
+	return h->backend->cursor_new(h, prefix);
+}
+
+rpl_private history_cursor_t *
+history_cursor_new_search(const history_t * h, const char *search)
+{
+	return h->backend->cursor_new_search(h, search);
+}
+
+rpl_private void
+history_cursor_free(history_cursor_t * cur)
+{
+	if (cur == NULL)
+		return;
+	cur->backend->cursor_free(cur);
+}
+
+rpl_private const char *
+history_cursor_prefix(const history_cursor_t * cur)
+{
+	return cur->backend->cursor_prefix(cur);
+}
+
+rpl_private ssize_t
+history_cursor_pos(const history_cursor_t * cur)
+{
+	return cur->backend->cursor_pos(cur);
+}
+
+rpl_private const char *
+history_cursor_prev(history_cursor_t * cur)
+{
+	return cur->backend->cursor_prev(cur);
+}
+
+rpl_private const char *
+history_cursor_next(history_cursor_t * cur)
+{
+	return cur->backend->cursor_next(cur);
+}
+
+rpl_private const char *
+history_cursor_entry(const history_cursor_t * cur)
+{
+	return cur->backend->cursor_entry(cur);
+}
+
+//-------------------------------------------------------------
+// Import and export
+//
+// An imported file is read into one buffer and its entries are
+// decoded in place (decoding never makes an entry longer), then
+// duplicates are merged with a hash set before the backend adds
+// everything at once.
+//-------------------------------------------------------------
+
+typedef struct import_s {
+	history_item_t *items;
+	ssize_t count;
+	ssize_t len;
+	alloc_t *mem;
+} import_t;
+
+static bool
+import_add(import_t * imp, const char *entry, long ts)
+{
+	if (entry[0] == 0)
+		return true;
+	if (imp->count >= imp->len) {
+		ssize_t newlen = (imp->len <= 0 ? 1024 : 2 * imp->len);
+		history_item_t *newitems = mem_realloc_tp(imp->mem, history_item_t, imp->items, newlen);
+		if (newitems == NULL)
+			return false;
+		imp->items = newitems;
+		imp->len = newlen;
+	}
+	imp->items[imp->count].entry = entry;
+	imp->items[imp->count].ts = ts;
+	imp->count++;
+	return true;
+}
+
+/// Parse a decimal number at `p`, returns NULL if there is none
+static char *
+import_number(char *p, long *n)
+{
+	if (*p < '0' || *p > '9')
+		return NULL;
+	*n = 0;
+	while (*p >= '0' && *p <= '9') {
+		*n = 10 * *n + (*p++ - '0');
+	}
+	return p;
+}
+
+/// One entry per line, with optional `#<time>` lines before an entry. From the
+/// first `#<time>` line on, all lines up to the next one are one entry (as bash
+/// reads them with `shopt -s lithist`), so multi-line entries stay whole.
+static bool
+import_bash(import_t * imp, char *p)
+{
+	long ts = 0;
+	bool timed = false;
+	char *entry = NULL;         // lines since the last `#<time>` line
+	while (*p != 0) {
+		char *eol = strchr(p, '\n');
+		if (eol != NULL)
+			*eol = 0;
+		long n;
+		char *end = (p[0] == '#' ? import_number(p + 1, &n) : NULL);
+		if (end != NULL && *end == 0) {
+			if (entry != NULL && !import_add(imp, entry, ts))
+				return false;
+			entry = NULL;
+			ts = n;
+			timed = true;
+		} else if (entry != NULL) {
+			p[-1] = '\n';        // the entry goes on
+		} else if (timed) {
+			entry = p;
+		} else if (!import_add(imp, p, 0)) {
+			return false;
+		}
+		if (eol == NULL)
+			break;
+		p = eol + 1;
+	}
+	return (entry == NULL || import_add(imp, entry, ts));
+}
+
+/// Lines ending in a backslash continue the entry. Extended entries start with
+/// `: <time>:<duration>;`, and zsh "metafies" bytes 0x83-0xA2 as 0x83 followed by the byte xor 32.
+static bool
+import_zsh(import_t * imp, char *p)
+{
+	while (*p != 0) {
+		long ts = 0;
+		long duration;
+		char *q = (p[0] == ':' && p[1] == ' ' ? import_number(p + 2, &ts) : NULL);
+		if (q != NULL && *q == ':' && (q = import_number(q + 1, &duration)) != NULL && *q == ';')
+			p = q + 1;
+		else
+			ts = 0;
+		char *entry = p;
+		char *out = p;
+		while (*p != 0 && *p != '\n') {
+			if (p[0] == '\\' && p[1] == '\n') {
+				*out++ = '\n';
+				p += 2;
+			} else if ((uint8_t) p[0] == 0x83 && p[1] != 0) {
+				*out++ = (char)(p[1] ^ 32);
+				p += 2;
+			} else {
+				*out++ = *p++;
+			}
+		}
+		bool more = (*p != 0);
+		*out = 0;
+		if (!import_add(imp, entry, ts))
+			return false;
+		if (!more)
+			break;
+		p++;
+	}
+	return true;
+}
+
+/// The format of the file backend
+static bool
+import_repline(import_t * imp, char *p)
+{
+	while (*p != 0) {
+		char *eol = strchr(p, '\n');
+		char *end = (eol != NULL ? eol : p + strlen(p));
+		// a comment, unlike an entry starting with an escaped `#`
+		bool comment = (p[0] == '#');
+		if (!history_unescape(p, end, p))
+			return false;
+		if (!comment && !import_add(imp, p, 0))
+			return false;
+		if (eol == NULL)
+			break;
+		p = eol + 1;
+	}
+	return true;
+}
+
+static bool
+import_eq(const void *arg, ssize_t index, const char *entry, uint64_t hash)
+{
+	rpl_unused(hash);
+	return (strcmp(((const import_t *)arg)->items[index].entry, entry) == 0);
+}
+
+/// Keep only the last occurrence of every entry (with the latest timestamp)
+static bool
+import_dedup(import_t * imp)
+{
+	ssize_t *set = NULL;        // item index + 1, 0 is empty
+	ssize_t len = 0;
+	if (!rpl_hset_reset(imp->mem, &set, &len, imp->count))
+		return false;
+	for (ssize_t i = 0; i < imp->count; i++) {
+		history_item_t *item = &imp->items[i];
+		ssize_t j = rpl_hset_find(set, len, item->entry, rpl_hash(item->entry),
+		                          &import_eq, imp);
+		if (set[j] != 0) {
+			history_item_t *prev = &imp->items[set[j] - 1];
+			if (prev->ts > item->ts)
+				item->ts = prev->ts;
+			prev->ts = -1;      // superseded
+		}
+		set[j] = i + 1;
+	}
+	mem_free(imp->mem, set);
+	ssize_t n = 0;
+	for (ssize_t i = 0; i < imp->count; i++) {
+		if (imp->items[i].ts >= 0)
+			imp->items[n++] = imp->items[i];
+	}
+	imp->count = n;
+	return true;
+}
+
+/// Read a whole file into a zero terminated buffer
+static char *
+import_read_file(alloc_t * mem, const char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL)
+		return NULL;
+	char *buf = NULL;
+	long size = (fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1);
+	if (size >= 0 && fseek(f, 0, SEEK_SET) == 0
+	    && (buf = mem_malloc_tp_n(mem, char, size + 1)) != NULL) {
+		size_t n = fread(buf, 1, (size_t)size, f);
+		buf[n] = 0;
+	}
+	fclose(f);
+	return buf;
+}
+
+rpl_private bool
+history_import(history_t * h, alloc_t * mem, const char *fname,
+               rpl_history_format_t format)
+{
+	char *buf = import_read_file(mem, fname);
+	if (buf == NULL)
+		return false;
+	import_t imp = { NULL, 0, 0, mem };
+	bool ok;
+	if (format == RPL_HISTORY_BASH)
+		ok = import_bash(&imp, buf);
+	else if (format == RPL_HISTORY_ZSH)
+		ok = import_zsh(&imp, buf);
+	else
+		ok = import_repline(&imp, buf);
+	history_prefetch_clear(h->prefetch);
+	history_fuzzy_clear(h->fuzzy);
+	ok = ok && import_dedup(&imp) && h->backend->import(h, imp.items, imp.count);
+	mem_free(mem, imp.items);
+	mem_free(mem, buf);
+	if (h->words != NULL)
+		history_words_load(h);
+	return ok;
+}
+
+typedef struct export_s {
+	FILE *f;
+	rpl_history_format_t format;
+	stringbuf_t *sbuf;
+	long now;                   // for entries without a timestamp (bash and zsh get one)
+} export_t;
+
+static bool
+export_entry(const char *entry, long ts, void *arg)
+{
+	export_t *exp = (export_t *) arg;
+	sbuf_clear(exp->sbuf);
+	if (exp->format == RPL_HISTORY_BASH) {
+		// every entry gets a time, which also marks where multi-line entries end
+		sbuf_appendf(exp->sbuf, "#%ld\n", (ts > 0 ? ts : exp->now));
+		sbuf_append(exp->sbuf, entry);
+		sbuf_append(exp->sbuf, "\n");
+	} else if (exp->format == RPL_HISTORY_ZSH) {
+		sbuf_appendf(exp->sbuf, ": %ld:0;", (ts > 0 ? ts : exp->now));
+		for (const char *p = entry; *p != 0; p++) {
+			if (*p == '\n') {
+				sbuf_append(exp->sbuf, "\\\n");
+			} else if ((uint8_t) * p >= 0x83 && (uint8_t) * p <= 0xA2) {
+				sbuf_append_char(exp->sbuf, (char)0x83);
+				sbuf_append_char(exp->sbuf, (char)(*p ^ 32));
+			} else {
+				sbuf_append_char(exp->sbuf, *p);
+			}
+		}
+		sbuf_append(exp->sbuf, "\n");
+	} else {
+		history_append_record(entry, exp->sbuf);
+	}
+	return (fputs(sbuf_string(exp->sbuf), exp->f) >= 0);
+}
+
+rpl_private bool
+history_export(const history_t * h, alloc_t * mem, const char *fname,
+               rpl_history_format_t format)
+{
+	FILE *f = fopen(fname, "w");
+	if (f == NULL)
+		return false;
+	export_t exp = { f, format, sbuf_new(mem), (long)time(NULL) };
+	if (exp.sbuf != NULL) {
+		h->backend->for_each(h, &export_entry, &exp);
+		sbuf_free(exp.sbuf);
+	}
+	return (fclose(f) == 0 && exp.sbuf != NULL);
+}
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sqlite3.h>
 
 #include "repline.h"
@@ -23,20 +25,106 @@ struct db_query_t {
 	const char *query;
 };
 
-struct history_s {
+typedef struct history_sqlite_s history_sqlite_t;
+typedef struct history_sqlite_cursor_s history_sqlite_cursor_t;
+typedef struct trie_node_s trie_node_t;
+typedef struct history_writer_s history_writer_t;
+
+typedef struct pending_entry_s {
+	long seq;                   // sequence number in the writer queue
+	char *entry;
+} pending_entry_t;
+
+/// Entry committed by another session while this one is open
+typedef struct shared_entry_s {
+	int ts;
+	int cid;
+	char *entry;
+} shared_entry_t;
+
+struct history_sqlite_s {
+	history_t base;
 	const char *fname;          // history file
 	struct db_t db;
+	trie_node_t *trie;          // prefix trie of all distinct commands (for hints)
+	bool has_fts;               // is the trigram index cmds_fts available?
+	bool async;                 // write pushed entries on a background thread?
+	history_writer_t *writer;   // background writer (if async and loaded)
+	int last_cid;               // provisional cid of the last queued entry
+	pending_entry_t *pending;   // queued entries not yet committed by the writer
+	ssize_t pending_count;
+	ssize_t pending_len;
+	int data_version;           // PRAGMA data_version when the shared entries were fetched
+	long changes;               // number of changes by other sessions or pruning
+	int shared_ts;              // summary rows from this timestamp on may be new
+	int shared_cid;             // rows above this cid are new
+	shared_entry_t *shared;     // entries of other sessions, oldest first
+	ssize_t shared_count;
+	ssize_t shared_len;
+	char *entry;                // last result of history_sqlite_get_with_prefix()
+	long max_entries;           // keep at most this many rows (0 for no limit, the default)
+	long max_age;               // drop rows older than this many seconds (0 for no limit)
+	long excess;                // rows over max_entries, as far as this session knows
 	alloc_t *mem;
 };
 
+static const history_backend_t history_sqlite_backend;
+
+static void history_sync(const history_sqlite_t * h);
+static void history_stop_writer(history_sqlite_t * h);
+static void history_prune_pending(history_sqlite_t * h);
+
 static const char *db_tables[] = {
-	"create table if not exists cmds (cid integer, ts integer, pid integer, cmd text)",
+	/// Commands are looked up by the hash of their text, the text is only compared on a hit
+	"create table if not exists cmds (cid integer, ts integer, pid integer, cmd text, hash integer)",
 	"create index if not exists cmdididx on cmds(cid, ts, pid)",
-	"create index if not exists cmdtxtidx on cmds(pid, cmd)",
-	"create index if not exists cmdidx on cmds(cmd)",
+	"create index if not exists cmdhashidx on cmds(hash, pid)",
+	"create index if not exists cmdpidtsidx on cmds(pid, ts, cid)",
+	/// One row per distinct command: the key of its most recent row and how often it was used
+	"create table if not exists cmdstats (cmd text primary key, last_ts integer, last_cid integer, use_count integer) without rowid",
+	"create index if not exists cmdstatstsidx on cmdstats(last_ts, last_cid, cmd)",
+	NULL
+};
+
+/// Databases of older versions index the text of the commands instead of its hash
+static const char *db_hash_migration[] = {
+	"alter table cmds add column hash integer",
+	"update cmds set hash = cmd_hash(cmd)",
+	"drop index if exists cmdtxtidx",
+	"drop index if exists cmdidx",
 	NULL
 };
 
+/// Fill the summary table from an existing history (once, when the table is new)
+static const char *db_stats_init =
+	"insert into cmdstats select cmd, max(ts), max(cid), count(cid) from cmds group by cmd";
+
+/// Trigram index for substring search (needs FTS5), kept in sync with triggers
+static const char *db_fts_tables[] = {
+	"create virtual table cmds_fts using fts5(cmd, content='cmds', content_rowid='rowid', tokenize='trigram case_sensitive 1')",
+	"create trigger cmds_fts_ins after insert on cmds begin insert into cmds_fts(rowid, cmd) values (new.rowid, new.cmd); end",
+	"create trigger cmds_fts_del after delete on cmds begin insert into cmds_fts(cmds_fts, rowid, cmd) values ('delete', old.rowid, old.cmd); end",
+	"create trigger cmds_fts_upd after update of cmd on cmds begin insert into cmds_fts(cmds_fts, rowid, cmd) values ('delete', old.rowid, old.cmd); insert into cmds_fts(rowid, cmd) values (new.rowid, new.cmd); end",
+	"insert into cmds_fts(cmds_fts) values ('rebuild')",
+	NULL
+};
+
+/// A page of the distinct commands older than a key, most recent first,
+/// with whether they contain a text
+#define DB_SEARCH_SCAN \
+	"select cmd, last_ts, last_cid, instr(cmd, ?1) > 0 from cmdstats where (last_ts, last_cid) < (?2, ?3) order by last_ts desc, last_cid desc limit ?4"
+/// Distinct commands containing a text through the trigram index, older than a key, most recent first
+#define DB_SEARCH_FTS \
+	"select cmd, last_ts, last_cid, 1 from cmdstats where (last_ts, last_cid) < (?2, ?3) and cmd in (select cmd from cmds where rowid in (select rowid from cmds_fts where cmds_fts match ?1)) order by last_ts desc, last_cid desc limit ?4"
+#define DB_SEARCH_WINDOW    256     // rows per page
+#define DB_SEARCH_SCAN_MAX  4096    // rows scanned before older matches are looked up in the trigram index
+
+#define RPL_PRUNE_PUSH         (4)   // rows pruned per push, each costs about 0.1ms with the trigram index
+#define RPL_PRUNE_CLOSE        (256) // rows pruned per transaction on close
+#define RPL_PRUNE_CLOSE_BATCHES (4)
+#define RPL_IMPORT_BULK_FTS    (1000)  // index larger imports for search in one statement
+#define RPL_WRITER_RETRIES     (8)   // attempts to commit a batch, each waits up to the busy timeout
+
 enum db_rc {
 	DB_ERROR = 0,
 	DB_OK,
@@ -49,7 +137,6 @@ enum db_stmt {
 	DB_COUNT_CMD,
 	DB_GET_PREV_CNT,
 	DB_GET_PREV_CMD,
-	DB_GET_PREF_CNT,
 	DB_GET_PREF_CMD,
 	DB_GET_DBL_PIDS,
 	DB_GET_CMD_ID,
@@ -57,27 +144,62 @@ enum db_stmt {
 	DB_DEL_ALL,
 	DB_UPD_TS,
 	DB_SET_PID_NULL,
+	DB_GET_ALL_CMDS,
+	DB_GET_CID_CMD,
+	DB_GET_CMD_KEY,
+	DB_GET_PREV_KEY,
+	DB_UPS_STATS,
+	DB_SET_STATS_KEY,
+	DB_DEL_STATS,
+	DB_DEL_ALL_STATS,
+	DB_DATA_VERSION,
+	DB_GET_NEW_STATS,
+	DB_GET_NEW_CMDS,
+	DB_MAX_STATS_TS,
+	DB_GET_OLD_CMDS,
+	DB_GET_GLOBAL_CMD,
+	DB_GET_ALL_STATS,
 	DB_STMT_CNT,
 };
 
 static const struct db_query_t db_queries[] = {
-	{DB_INS_CMD, "insert into cmds values (?,?,?,?)"},
+	{DB_INS_CMD, "insert into cmds (cid, ts, pid, cmd, hash) values (?,?,?,?,?)"},
 	{DB_MAX_ID_CMD, "select max(cid) from cmds"},
 	{DB_COUNT_CMD, "select count(cid) from cmds"},
 	{DB_GET_PREV_CNT,
 	 "select count(cmd) from cmds where pid = ?"},
 	{DB_GET_PREV_CMD,
 	 "select cmd from cmds where pid = ? order by pid desc, ts desc, cid desc limit 1 offset ?"},
-	{DB_GET_PREF_CNT, "select count(cmd) from cmds where cmd like ?"},
 	{DB_GET_PREF_CMD,
-	 "select cmd, max(ts) as mts, max(cid) as mcid from cmds where cmd like ? group by cmd order by mts desc, mcid desc limit 1 offset ?"},
+	 "select cmd from cmdstats where cmd >= ?1 and cmd < ?2 order by last_ts desc, last_cid desc limit 1 offset ?3"},
+	/// The cross join keeps the session rows in the outer loop, so the cost does not depend on the global history
 	{DB_GET_DBL_PIDS,
-	 "select cpid.cid, cpid.ts, cnull.cid, cnull.ts from cmds as cpid, cmds as cnull where cpid.pid = ? and cnull.pid is NULL and cpid.cmd = cnull.cmd"},
-	{DB_GET_CMD_ID, "select cid, pid from cmds where cmd = ? and pid = ? order by pid desc, ts desc, cid desc limit 1"},
+	 "select cpid.cid, cpid.ts, cnull.cid, cnull.ts, cpid.cmd from cmds as cpid cross join cmds as cnull where cpid.pid = ? and cnull.hash = cpid.hash and cnull.pid is NULL and cpid.cmd = cnull.cmd"},
+	/// A process has at most one row per command, so there is nothing to order
+	{DB_GET_CMD_ID, "select cid, pid from cmds where hash = ?3 and pid = ?2 and cmd = ?1 limit 1"},
 	{DB_DEL_CMD_ID, "delete from cmds where cid = ?"},
 	{DB_DEL_ALL, "delete from cmds"},
 	{DB_UPD_TS, "update cmds set ts = ? where cid = ?"},
 	{DB_SET_PID_NULL, "update cmds set pid = NULL where pid = ?"},
+	{DB_GET_ALL_CMDS, "select cmd, last_ts, last_cid from cmdstats"},
+	{DB_GET_CID_CMD, "select cmd from cmds where cid = ?"},
+	{DB_GET_CMD_KEY, "select count(cid), max(ts), max(cid) from cmds where hash = ?2 and cmd = ?1"},
+	{DB_GET_PREV_KEY,
+	 "select cmd, ts, cid from cmds where pid = ?1 and (ts, cid) < (?2, ?3) order by ts desc, cid desc limit 1"},
+	{DB_UPS_STATS,
+	 "insert into cmdstats values (?1, ?2, ?3, 1) on conflict(cmd) do update set last_ts = max(last_ts, excluded.last_ts), last_cid = max(last_cid, excluded.last_cid), use_count = use_count + 1"},
+	{DB_SET_STATS_KEY,
+	 "update cmdstats set last_ts = ?2, last_cid = ?3, use_count = max(use_count - ?4, 1) where cmd = ?1"},
+	{DB_DEL_STATS, "delete from cmdstats where cmd = ?"},
+	{DB_DEL_ALL_STATS, "delete from cmdstats"},
+	{DB_DATA_VERSION, "pragma data_version"},
+	{DB_GET_NEW_STATS, "select cmd, last_ts, last_cid from cmdstats where last_ts >= ?"},
+	{DB_GET_NEW_CMDS, "select cmd, ts, cid from cmds where cid > ?1 and pid <> ?2 order by cid"},
+	{DB_MAX_STATS_TS, "select max(last_ts) from cmdstats"},
+	/// Only rows of closed sessions are pruned, the index on (pid, ts, cid) gives them oldest first
+	{DB_GET_OLD_CMDS, "select cid, ts, cmd from cmds where pid is NULL order by ts, cid limit ?"},
+	{DB_GET_GLOBAL_CMD, "select cid, ts from cmds where hash = ?2 and pid is NULL and cmd = ?1 limit 1"},
+	{DB_GET_ALL_STATS, "select cmd, last_ts from cmdstats order by last_ts, last_cid"},
 	{DB_STMT_CNT, ""},
 };
 
@@ -109,6 +231,25 @@ db_exec_str(struct db_t *db, const char *query)
 	return true;
 }
 
+/// 64-bit FNV-1a hash of a command, as stored in the hash column
+static sqlite3_int64
+db_cmd_hash(const char *cmd)
+{
+	return (sqlite3_int64) rpl_hash(cmd);
+}
+
+/// SQL function cmd_hash(text), used to migrate older databases
+static void
+db_sql_cmd_hash(sqlite3_context * ctx, int argc, sqlite3_value ** argv)
+{
+	rpl_unused(argc);
+	const char *cmd = (const char *)sqlite3_value_text(argv[0]);
+	if (cmd == NULL)
+		sqlite3_result_null(ctx);
+	else
+		sqlite3_result_int64(ctx, db_cmd_hash(cmd));
+}
+
 static int
 db_open(struct db_t *db, const char *fname)
 {
@@ -119,6 +260,10 @@ db_open(struct db_t *db, const char *fname)
 	}
 	/// Turn on case sensitive queries with like operator when searching the history
 	db_exec_str(db, "PRAGMA case_sensitive_like = true;");
+	/// Wait for other connections (e.g. the writer thread) instead of failing
+	sqlite3_busy_timeout(db->dbh, 1000);
+	sqlite3_create_function(db->dbh, "cmd_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+	                        NULL, db_sql_cmd_hash, NULL, NULL);
 	return rc;
 }
 
@@ -131,15 +276,98 @@ db_close(struct db_t *db)
 	return DB_OK;
 }
 
+static bool
+db_table_exists(struct db_t *db, const char *name)
+{
+	sqlite3_stmt *stmt = NULL;
+	bool exists = false;
+	if (sqlite3_prepare_v2(db->dbh, "select 1 from sqlite_master where name = ?",
+	                       -1, &stmt, 0) == SQLITE_OK) {
+		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+		exists = (sqlite3_step(stmt) == SQLITE_ROW);
+		sqlite3_finalize(stmt);
+	}
+	return exists;
+}
+
+static bool
+db_column_exists(struct db_t *db, const char *table, const char *name)
+{
+	sqlite3_stmt *stmt = NULL;
+	bool exists = false;
+	if (sqlite3_prepare_v2(db->dbh, "select 1 from pragma_table_info(?) where name = ?",
+	                       -1, &stmt, 0) == SQLITE_OK) {
+		sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+		exists = (sqlite3_step(stmt) == SQLITE_ROW);
+		sqlite3_finalize(stmt);
+	}
+	return exists;
+}
+
+/// Let the file shrink as old rows are pruned. This has to be set before the
+/// first table is created, so databases of older versions are rebuilt once,
+/// but only if `rebuild` is set (when entries are pruned at all). The rebuild
+/// fails while another session uses the database and is tried again on the
+/// next open.
+static void
+db_enable_auto_vacuum(struct db_t *db, bool rebuild)
+{
+	sqlite3_stmt *stmt = NULL;
+	int mode = 0;
+	if (sqlite3_prepare_v2(db->dbh, "PRAGMA auto_vacuum", -1, &stmt, 0) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			mode = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	if (mode == 2)
+		return;
+	bool is_new = !db_table_exists(db, "cmds");
+	if (!is_new && !rebuild)
+		return;
+	db_exec_str(db, "PRAGMA auto_vacuum = INCREMENTAL");
+	if (!is_new)
+		db_exec_str(db, "VACUUM");
+}
+
 static bool
 create_tables(struct db_t *db)
 {
+	bool has_stats = db_table_exists(db, "cmdstats");
+	bool has_hash = (!db_table_exists(db, "cmds") || db_column_exists(db, "cmds", "hash"));
+	db_exec_str(db, "BEGIN TRANSACTION");
+	if (!has_hash) {
+		for (int i = 0; db_hash_migration[i]; i++) {
+			db_exec_str(db, db_hash_migration[i]);
+		}
+	}
 	for (int i = 0; db_tables[i]; i++) {
 		db_exec_str(db, db_tables[i]);
 	}
+	/// Databases of older versions only have the cmds table
+	if (!has_stats)
+		db_exec_str(db, db_stats_init);
+	db_exec_str(db, "COMMIT");
 	return true;
 }
 
+/// Create the trigram index if FTS5 is available, returns whether it can be used
+static bool
+create_fts_tables(struct db_t *db)
+{
+	if (db_table_exists(db, "cmds_fts"))
+		return true;
+	/// Index existing history once, in a single transaction
+	db_exec_str(db, "BEGIN TRANSACTION");
+	for (int i = 0; db_fts_tables[i]; i++) {
+		if (!db_exec_str(db, db_fts_tables[i])) {
+			db_exec_str(db, "ROLLBACK");
+			return false;
+		}
+	}
+	return db_exec_str(db, "COMMIT");
+}
+
 static int
 db_prepare_stmts(struct db_t *db, const struct db_query_t db_queries[],
                  size_t n)
@@ -152,7 +380,6 @@ db_prepare_stmts(struct db_t *db, const struct db_query_t db_queries[],
 			debug_msg("db query strings and ids are inconsistent\n");
 			exit(EXIT_FAILURE);
 		}
-		db->stmts[i] = calloc(1, sizeof(sqlite3_stmt *));
 		rc = db_rc(sqlite3_prepare_v2
 		           (db->dbh, db_queries[i].query, -1, &db->stmts[i], 0));
 		if (rc != DB_OK) {
@@ -171,7 +398,6 @@ db_free_stmts(struct db_t *db)
 	int rc = DB_OK;
 	for (size_t i = 0; i < db->stmtcnt; i++) {
 		rc = db_rc(sqlite3_finalize(db->stmts[i]));
-		free(db->stmts[i]);
 		if (rc != DB_OK)
 			break;
 	}
@@ -197,6 +423,18 @@ db_in_txt(const struct db_t *db, int stmt, int pos, const char *val)
 	return db_rc(sqlite3_bind_text(db->stmts[stmt], pos, val, -1, NULL));
 }
 
+static int
+db_in_null(const struct db_t *db, int stmt, int pos)
+{
+	return db_rc(sqlite3_bind_null(db->stmts[stmt], pos));
+}
+
+static int
+db_in_hash(const struct db_t *db, int stmt, int pos, const char *cmd)
+{
+	return db_rc(sqlite3_bind_int64(db->stmts[stmt], pos, db_cmd_hash(cmd)));
+}
+
 static int
 db_out_int(const struct db_t *db, int stmt, int pos)
 {
@@ -215,42 +453,489 @@ db_reset(const struct db_t *db, int stmt)
 	return db_rc(sqlite3_reset(db->stmts[stmt]));
 }
 
-rpl_private history_t *
-history_new(alloc_t * mem)
+//-------------------------------------------------------------
+// Prefix trie of distinct commands
+//
+// Hints only need the most recent command starting with the
+// current input, so we keep a radix trie of all distinct commands
+// in memory. Every node caches the terminal node with the greatest
+// (ts, cid) key in its subtree, which makes a hint lookup cost
+// O(prefix length) without touching the database.
+//-------------------------------------------------------------
+
+struct trie_node_s {
+	const char *label;          // edge label, points into the `cmd` of a descendant
+	ssize_t label_len;
+	trie_node_t *child;         // first child
+	trie_node_t *next;          // next sibling
+	const char *cmd;            // command ending at this node (or NULL)
+	int ts;                     // max(ts) of `cmd`
+	int cid;                    // max(cid) of `cmd`, -1 if `cmd` is not in the history (anymore)
+	const trie_node_t *best;    // terminal node with the greatest key in this subtree
+};
+
+static bool
+trie_key_gt(const trie_node_t * n1, const trie_node_t * n2)
+{
+	if (n2 == NULL)
+		return true;
+	return (n1->ts > n2->ts || (n1->ts == n2->ts && n1->cid > n2->cid));
+}
+
+static trie_node_t *
+trie_node_new(alloc_t * mem, const char *label, ssize_t label_len)
+{
+	trie_node_t *node = mem_zalloc_tp(mem, trie_node_t);
+	if (node == NULL)
+		return NULL;
+	node->label = label;
+	node->label_len = label_len;
+	node->cid = -1;
+	return node;
+}
+
+static void
+trie_free(alloc_t * mem, trie_node_t * node)
+{
+	while (node != NULL) {
+		trie_node_t *next = node->next;
+		trie_free(mem, node->child);
+		mem_free(mem, node->cmd);
+		mem_free(mem, node);
+		node = next;
+	}
+}
+
+static trie_node_t *
+trie_find_child(const trie_node_t * node, char c)
+{
+	trie_node_t *child = node->child;
+	while (child != NULL && child->label[0] != c) {
+		child = child->next;
+	}
+	return child;
+}
+
+/// Insert `cmd` or merge its key with an existing entry by taking the
+/// maximum of ts and cid (just like the `group by cmd` queries do).
+static void
+trie_insert(alloc_t * mem, trie_node_t * root, const char *cmd, int ts, int cid)
+{
+	if (root == NULL || cmd == NULL || *cmd == 0)
+		return;
+	/// Remember the path, so the cached best entries can be updated afterwards
+	ssize_t len = rpl_strlen(cmd);
+	trie_node_t **path = mem_malloc_tp_n(mem, trie_node_t *, len + 1);
+	if (path == NULL)
+		return;
+	ssize_t depth = 0;
+	trie_node_t *node = root;
+	const char *p = cmd;
+	path[depth++] = node;
+	while (*p != 0) {
+		trie_node_t *child = trie_find_child(node, *p);
+		if (child == NULL) {
+			/// New leaf for the remaining suffix, its label points into its own command
+			char *leaf_cmd = mem_strdup(mem, cmd);
+			child = trie_node_new(mem, leaf_cmd + (p - cmd), rpl_strlen(p));
+			if (leaf_cmd == NULL || child == NULL) {
+				mem_free(mem, leaf_cmd);
+				mem_free(mem, child);
+				break;
+			}
+			child->cmd = leaf_cmd;
+			child->next = node->child;
+			node->child = child;
+			p += child->label_len;
+		} else {
+			ssize_t i = 1;
+			while (i < child->label_len && p[i] != 0 && p[i] == child->label[i]) {
+				i++;
+			}
+			if (i < child->label_len) {
+				/// Split the edge at the first differing character
+				trie_node_t *mid = trie_node_new(mem, child->label, i);
+				if (mid == NULL)
+					break;
+				mid->best = child->best;
+				mid->next = child->next;
+				mid->child = child;
+				child->next = NULL;
+				child->label += i;
+				child->label_len -= i;
+				if (node->child == child) {
+					node->child = mid;
+				} else {
+					trie_node_t *prev = node->child;
+					while (prev->next != child) {
+						prev = prev->next;
+					}
+					prev->next = mid;
+				}
+				child = mid;
+			}
+			p += i;
+		}
+		node = child;
+		path[depth++] = node;
+	}
+	if (*p == 0) {
+		if (node->cmd == NULL)
+			node->cmd = mem_strdup(mem, cmd);
+		if (node->cid < 0) {
+			node->ts = ts;
+			node->cid = cid;
+		} else {
+			node->ts = (ts > node->ts ? ts : node->ts);
+			node->cid = (cid > node->cid ? cid : node->cid);
+		}
+		for (ssize_t i = 0; i < depth; i++) {
+			if (trie_key_gt(node, path[i]->best))
+				path[i]->best = node;
+		}
+	}
+	mem_free(mem, path);
+}
+
+static void
+trie_recompute_best(trie_node_t * node)
+{
+	node->best = (node->cmd != NULL && node->cid >= 0 ? node : NULL);
+	for (trie_node_t * child = node->child; child != NULL; child = child->next) {
+		if (child->best != NULL && trie_key_gt(child->best, node->best))
+			node->best = child->best;
+	}
+}
+
+/// Set the key of `cmd` (use cid = -1 if it was removed) and recompute
+/// the cached best entries along its path.
+static bool
+trie_update(trie_node_t * node, const char *cmd, int ts, int cid)
+{
+	if (*cmd == 0) {
+		if (node->cmd == NULL)
+			return false;
+		node->ts = ts;
+		node->cid = cid;
+	} else {
+		trie_node_t *child = trie_find_child(node, *cmd);
+		if (child == NULL || strncmp(cmd, child->label, child->label_len) != 0)
+			return false;
+		if (!trie_update(child, cmd + child->label_len, ts, cid))
+			return false;
+	}
+	trie_recompute_best(node);
+	return true;
+}
+
+/// Returns the node whose subtree holds all commands that start with `prefix`
+static const trie_node_t *
+trie_find_prefix(const trie_node_t * root, const char *prefix)
+{
+	const trie_node_t *node = root;
+	const char *p = prefix;
+	while (node != NULL && *p != 0) {
+		node = trie_find_child(node, *p);
+		if (node == NULL)
+			return NULL;
+		ssize_t i = 1;
+		while (i < node->label_len && p[i] != 0) {
+			if (p[i] != node->label[i])
+				return NULL;
+			i++;
+		}
+		p += i;
+	}
+	return node;
+}
+
+/// Returns the most recent command that starts with `prefix`
+static const char *
+trie_lookup(const trie_node_t * root, const char *prefix)
+{
+	const trie_node_t *node = trie_find_prefix(root, prefix);
+	if (node == NULL || node->best == NULL)
+		return NULL;
+	return node->best->cmd;
+}
+
+//-------------------------------------------------------------
+// Enumerate the commands of a subtree from the most recent to
+// the oldest one. This is a best-first search with a max-heap of
+// subtrees (keyed by their cached best entry) and single entries,
+// so each step only costs O(log n) instead of sorting all matches.
+//-------------------------------------------------------------
+
+typedef struct trie_heap_item_s {
+	const trie_node_t *node;
+	bool terminal;              // only the entry of `node` itself, not its subtree
+} trie_heap_item_t;
+
+typedef struct trie_heap_s {
+	trie_heap_item_t *items;
+	ssize_t count;
+	ssize_t len;
+	alloc_t *mem;
+} trie_heap_t;
+
+static const trie_node_t *
+trie_heap_key(const trie_heap_item_t * item)
+{
+	return (item->terminal ? item->node : item->node->best);
+}
+
+static bool
+trie_heap_push(trie_heap_t * heap, const trie_node_t * node, bool terminal)
+{
+	if (heap->count >= heap->len) {
+		ssize_t newlen = (heap->len <= 0 ? 16 : heap->len * 2);
+		trie_heap_item_t *newitems =
+		    mem_realloc_tp(heap->mem, trie_heap_item_t, heap->items, newlen);
+		if (newitems == NULL)
+			return false;
+		heap->items = newitems;
+		heap->len = newlen;
+	}
+	ssize_t i = heap->count++;
+	heap->items[i].node = node;
+	heap->items[i].terminal = terminal;
+	while (i > 0) {
+		ssize_t parent = (i - 1) / 2;
+		if (!trie_key_gt(trie_heap_key(&heap->items[i]),
+		                 trie_heap_key(&heap->items[parent])))
+			break;
+		trie_heap_item_t tmp = heap->items[i];
+		heap->items[i] = heap->items[parent];
+		heap->items[parent] = tmp;
+		i = parent;
+	}
+	return true;
+}
+
+static bool
+trie_heap_pop(trie_heap_t * heap, trie_heap_item_t * item)
+{
+	if (heap->count <= 0)
+		return false;
+	*item = heap->items[0];
+	heap->items[0] = heap->items[--heap->count];
+	ssize_t i = 0;
+	while (true) {
+		ssize_t largest = i;
+		ssize_t l = 2 * i + 1;
+		ssize_t r = 2 * i + 2;
+		if (l < heap->count
+		    && trie_key_gt(trie_heap_key(&heap->items[l]),
+		                   trie_heap_key(&heap->items[largest])))
+			largest = l;
+		if (r < heap->count
+		    && trie_key_gt(trie_heap_key(&heap->items[r]),
+		                   trie_heap_key(&heap->items[largest])))
+			largest = r;
+		if (largest == i)
+			break;
+		trie_heap_item_t tmp = heap->items[i];
+		heap->items[i] = heap->items[largest];
+		heap->items[largest] = tmp;
+		i = largest;
+	}
+	return true;
+}
+
+/// Returns the next command in order of recency, or NULL if all are done
+static const char *
+trie_heap_next(trie_heap_t * heap)
+{
+	trie_heap_item_t item;
+	while (trie_heap_pop(heap, &item)) {
+		if (item.terminal)
+			return item.node->cmd;
+		if (item.node->cmd != NULL && item.node->cid >= 0)
+			trie_heap_push(heap, item.node, true);
+		for (const trie_node_t * child = item.node->child; child != NULL;
+		     child = child->next) {
+			if (child->best != NULL)
+				trie_heap_push(heap, child, false);
+		}
+	}
+	return NULL;
+}
+
+static void
+history_trie_load(history_sqlite_t * h)
+{
+	trie_free(h->mem, h->trie);
+	h->trie = trie_node_new(h->mem, "", 0);
+	while (db_exec(&h->db, DB_GET_ALL_CMDS) == DB_ROW) {
+		trie_insert(h->mem, h->trie,
+		            (const char *)db_out_txt(&h->db, DB_GET_ALL_CMDS, 1),
+		            db_out_int(&h->db, DB_GET_ALL_CMDS, 2),
+		            db_out_int(&h->db, DB_GET_ALL_CMDS, 3));
+	}
+	db_reset(&h->db, DB_GET_ALL_CMDS);
+}
+
+//-------------------------------------------------------------
+// Sharing with other sessions
+//
+// Other sessions commit to the same database while this one is
+// open. PRAGMA data_version only changes when another connection
+// committed, so that is checked first. Then the summary rows that
+// were touched since the last look are merged into the trie, and
+// the rows added by other sessions are kept as shared entries, which
+// the walk over the session interleaves with its own rows.
+//-------------------------------------------------------------
+
+static int
+db_data_version(const struct db_t *db)
+{
+	db_exec(db, DB_DATA_VERSION);
+	int version = db_out_int(db, DB_DATA_VERSION, 1);
+	db_reset(db, DB_DATA_VERSION);
+	return version;
+}
+
+/// Share only what is committed from now on, the rest is loaded already
+static void
+history_shared_init(history_sqlite_t * h)
+{
+	h->data_version = db_data_version(&h->db);
+	db_exec(&h->db, DB_MAX_STATS_TS);
+	h->shared_ts = db_out_int(&h->db, DB_MAX_STATS_TS, 1);
+	db_reset(&h->db, DB_MAX_STATS_TS);
+	db_exec(&h->db, DB_MAX_ID_CMD);
+	h->shared_cid = db_out_int(&h->db, DB_MAX_ID_CMD, 1);
+	db_reset(&h->db, DB_MAX_ID_CMD);
+}
+
+static void
+history_shared_clear(history_sqlite_t * h)
+{
+	for (ssize_t i = 0; i < h->shared_count; i++) {
+		mem_free(h->mem, h->shared[i].entry);
+	}
+	h->shared_count = 0;
+}
+
+/// Number of shared entries with a key below (ts, cid)
+static ssize_t
+history_shared_lower_bound(const history_sqlite_t * h, int ts, int cid)
+{
+	ssize_t lo = 0;
+	ssize_t hi = h->shared_count;
+	while (lo < hi) {
+		ssize_t mid = lo + (hi - lo) / 2;
+		const shared_entry_t *e = &h->shared[mid];
+		if (e->ts < ts || (e->ts == ts && e->cid < cid))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+history_add_shared(history_sqlite_t * h, const char *entry, int ts, int cid)
+{
+	if (h->shared_count >= h->shared_len) {
+		ssize_t newlen = (h->shared_len <= 0 ? 16 : h->shared_len * 2);
+		shared_entry_t *newshared =
+		    mem_realloc_tp(h->mem, shared_entry_t, h->shared, newlen);
+		if (newshared == NULL)
+			return;
+		h->shared = newshared;
+		h->shared_len = newlen;
+	}
+	char *copy = mem_strdup(h->mem, entry);
+	if (copy == NULL)
+		return;
+	/// Rows come in cid order, which is nearly the order of their time stamps
+	ssize_t i = history_shared_lower_bound(h, ts, cid);
+	rpl_memmove(h->shared + i + 1, h->shared + i,
+	            (h->shared_count - i) * ssizeof(shared_entry_t));
+	h->shared[i].ts = ts;
+	h->shared[i].cid = cid;
+	h->shared[i].entry = copy;
+	h->shared_count++;
+}
+
+/// Merge what other sessions committed since the last call
+static void
+history_refresh(history_sqlite_t * h)
 {
-	history_t *h = mem_zalloc_tp(mem, history_t);
+	if (h->db.stmts == NULL)
+		return;
+	int version = db_data_version(&h->db);
+	if (version == h->data_version)
+		return;
+	h->data_version = version;
+	h->changes++;
+	/// Time stamps have a resolution of a second, so the last one is read again
+	int max_ts = h->shared_ts;
+	db_in_int(&h->db, DB_GET_NEW_STATS, 1, h->shared_ts);
+	while (db_exec(&h->db, DB_GET_NEW_STATS) == DB_ROW) {
+		int ts = db_out_int(&h->db, DB_GET_NEW_STATS, 2);
+		trie_insert(h->mem, h->trie,
+		            (const char *)db_out_txt(&h->db, DB_GET_NEW_STATS, 1),
+		            ts, db_out_int(&h->db, DB_GET_NEW_STATS, 3));
+		if (ts > max_ts)
+			max_ts = ts;
+	}
+	db_reset(&h->db, DB_GET_NEW_STATS);
+	h->shared_ts = max_ts;
+	db_in_int(&h->db, DB_GET_NEW_CMDS, 1, h->shared_cid);
+	db_in_int(&h->db, DB_GET_NEW_CMDS, 2, getpid());
+	while (db_exec(&h->db, DB_GET_NEW_CMDS) == DB_ROW) {
+		int cid = db_out_int(&h->db, DB_GET_NEW_CMDS, 3);
+		history_add_shared(h, (const char *)db_out_txt(&h->db, DB_GET_NEW_CMDS, 1),
+		                   db_out_int(&h->db, DB_GET_NEW_CMDS, 2), cid);
+		h->shared_cid = cid;
+	}
+	db_reset(&h->db, DB_GET_NEW_CMDS);
+}
+
+static history_t *
+history_sqlite_new(alloc_t * mem)
+{
+	history_sqlite_t *h = mem_zalloc_tp(mem, history_sqlite_t);
+	if (h == NULL)
+		return NULL;
+	h->base.backend = &history_sqlite_backend;
 	h->mem = mem;
-	return h;
+	return &h->base;
 }
 
-rpl_private void
-history_free(history_t * h)
+static void
+history_sqlite_free(history_t * hist)
 {
+	history_sqlite_t *h = (history_sqlite_t *)hist;
 	if (h == NULL)
 		return;
+	history_stop_writer(h);
+	history_prune_pending(h);
+	mem_free(h->mem, h->pending);
+	history_shared_clear(h);
+	mem_free(h->mem, h->shared);
+	mem_free(h->mem, h->entry);
+	trie_free(h->mem, h->trie);
+	h->trie = NULL;
 	mem_free(h->mem, h->fname);
 	h->fname = NULL;
 	mem_free(h->mem, h);        // free ourselves
 }
 
-rpl_private ssize_t
-history_count_with_prefix(const history_t * h, const char *prefix)
+/// Commands with `prefix` lie in [prefix, prefix + 0xFF) (0xFF never occurs in UTF-8)
+static char *
+prefix_upper_bound(alloc_t * mem, const char *prefix)
 {
-	if (strlen(prefix) == 0) {
-		db_in_int(&h->db, DB_GET_PREV_CNT, 1, getpid());
-		db_exec(&h->db, DB_GET_PREV_CNT);
-		int count = db_out_int(&h->db, DB_GET_PREV_CNT, 1);
-		db_reset(&h->db, DB_GET_PREV_CNT);
-		return count;
-	}
-	char *prefix_param = mem_malloc(h->mem, rpl_strlen(prefix) + 3);
-	sprintf(prefix_param, "%s%%", prefix);
-	db_in_txt(&h->db, DB_GET_PREF_CNT, 1, prefix_param);
-	db_exec(&h->db, DB_GET_PREF_CNT);
-	int count = db_out_int(&h->db, DB_GET_PREF_CNT, 1);
-	db_reset(&h->db, DB_GET_PREF_CNT);
-	mem_free(h->mem, prefix_param);
-	return count;
+	ssize_t len = rpl_strlen(prefix);
+	char *end = mem_malloc_tp_n(mem, char, len + 2);
+	if (end == NULL)
+		return NULL;
+	rpl_memcpy(end, prefix, len);
+	end[len] = (char)0xFF;
+	end[len + 1] = 0;
+	return end;
 }
 
 //-------------------------------------------------------------
@@ -265,69 +950,542 @@ get_current_ts(void)
 	return curtime.tv_sec;
 }
 
-rpl_private bool
-history_push(history_t * h, const char *entry)
+/// Count a use of `entry` in the summary table
+static void
+db_push_stats(const struct db_t *db, const char *entry, int ts, int cid)
 {
-	if (entry == NULL || rpl_strlen(entry) == 0)
-		return false;
+	db_in_txt(db, DB_UPS_STATS, 1, entry);
+	db_in_int(db, DB_UPS_STATS, 2, ts);
+	db_in_int(db, DB_UPS_STATS, 3, cid);
+	db_exec(db, DB_UPS_STATS);
+	db_reset(db, DB_UPS_STATS);
+}
 
-	db_in_txt(&h->db, DB_GET_CMD_ID, 1, entry);
-	db_in_int(&h->db, DB_GET_CMD_ID, 2, getpid());
-	int cid = -1;
-	int pid = -1;
-	if (db_exec(&h->db, DB_GET_CMD_ID) == DB_ROW) {;
-		cid = db_out_int(&h->db, DB_GET_CMD_ID, 1);
-		pid = db_out_int(&h->db, DB_GET_CMD_ID, 2);
+/// Set the key of `cmd` in the summary table from its remaining rows, or drop it
+/// if there are none left. `uses` is subtracted from its use count.
+static void
+db_update_stats(const struct db_t *db, const char *cmd, int uses, int *ts, int *cid)
+{
+	*ts = 0;
+	*cid = -1;
+	db_in_txt(db, DB_GET_CMD_KEY, 1, cmd);
+	db_in_hash(db, DB_GET_CMD_KEY, 2, cmd);
+	if (db_exec(db, DB_GET_CMD_KEY) == DB_ROW && db_out_int(db, DB_GET_CMD_KEY, 1) > 0) {
+		*ts = db_out_int(db, DB_GET_CMD_KEY, 2);
+		*cid = db_out_int(db, DB_GET_CMD_KEY, 3);
 	}
-	db_reset(&h->db, DB_GET_CMD_ID);
+	db_reset(db, DB_GET_CMD_KEY);
+	if (*cid < 0) {
+		db_in_txt(db, DB_DEL_STATS, 1, cmd);
+		db_exec(db, DB_DEL_STATS);
+		db_reset(db, DB_DEL_STATS);
+		return;
+	}
+	db_in_txt(db, DB_SET_STATS_KEY, 1, cmd);
+	db_in_int(db, DB_SET_STATS_KEY, 2, *ts);
+	db_in_int(db, DB_SET_STATS_KEY, 3, *cid);
+	db_in_int(db, DB_SET_STATS_KEY, 4, uses);
+	db_exec(db, DB_SET_STATS_KEY);
+	db_reset(db, DB_SET_STATS_KEY);
+}
+
+/// Insert `entry` for process `pid` or, if this process already has it,
+/// update its timestamp. Returns true if a new row was inserted and
+/// sets `cid` to the id of the inserted or updated row.
+static bool
+db_push(const struct db_t *db, const char *entry, int ts, int pid, int *cid)
+{
+	db_in_txt(db, DB_GET_CMD_ID, 1, entry);
+	db_in_int(db, DB_GET_CMD_ID, 2, pid);
+	db_in_hash(db, DB_GET_CMD_ID, 3, entry);
+	int old_cid = -1;
+	int old_pid = -1;
+	if (db_exec(db, DB_GET_CMD_ID) == DB_ROW) {
+		old_cid = db_out_int(db, DB_GET_CMD_ID, 1);
+		old_pid = db_out_int(db, DB_GET_CMD_ID, 2);
+	}
+	db_reset(db, DB_GET_CMD_ID);
 	/// Update timestamp only if the command is entered by the same process.
-	/// Otherwise, time stamps will be updated in history_close().
-	if (cid != -1 && pid == getpid()) {
-		debug_msg("duplicate history entry (cid=%d, pid=%d), updating timestamp: %s\n", cid, pid, entry);
-		db_in_int(&h->db, DB_UPD_TS, 1, get_current_ts());
-		db_in_int(&h->db, DB_UPD_TS, 2, cid);
-		db_exec(&h->db, DB_UPD_TS);
-		db_reset(&h->db, DB_UPD_TS);
+	/// Otherwise, time stamps will be updated in history_sqlite_close().
+	if (old_cid != -1 && old_pid == pid) {
+		debug_msg("duplicate history entry (cid=%d, pid=%d), updating timestamp: %s\n", old_cid, old_pid, entry);
+		db_in_int(db, DB_UPD_TS, 1, ts);
+		db_in_int(db, DB_UPD_TS, 2, old_cid);
+		db_exec(db, DB_UPD_TS);
+		db_reset(db, DB_UPD_TS);
+		*cid = old_cid;
+		db_push_stats(db, entry, ts, old_cid);
 		return false;
 	}
-	debug_msg("new history entry (cid=%d, pid=%d): %s\n", cid, pid, entry);
+	debug_msg("new history entry (cid=%d, pid=%d): %s\n", old_cid, old_pid, entry);
 	/// If command is new or in global history, create a new entry in history for this command,
 	/// tagged with the current pid.
+	db_exec(db, DB_MAX_ID_CMD);
+	int new_cid = db_out_int(db, DB_MAX_ID_CMD, 1) + 1;
+	db_reset(db, DB_MAX_ID_CMD);
+
+	db_in_int(db, DB_INS_CMD, 1, new_cid);
+	db_in_int(db, DB_INS_CMD, 2, ts);
+	db_in_int(db, DB_INS_CMD, 3, pid);
+	db_in_txt(db, DB_INS_CMD, 4, entry);
+	db_in_hash(db, DB_INS_CMD, 5, entry);
+	db_exec(db, DB_INS_CMD);
+	db_reset(db, DB_INS_CMD);
+	*cid = new_cid;
+	db_push_stats(db, entry, ts, new_cid);
+	return true;
+}
+
+//-------------------------------------------------------------
+// Retention
+//
+// Pruning is opt-in: with a positive `max_entries` the history
+// keeps at most that many rows, and with a `max_age` no rows older
+// than that (by default it keeps everything). The oldest rows of closed sessions are deleted a
+// few at a time after a push, so no single push pays for a large
+// cleanup, and whatever is left over when the history is closed.
+// Freed pages are returned to the file system on close.
+//-------------------------------------------------------------
+
+/// Recount the rows over the maximum count, including those of other sessions
+static void
+history_count_excess(history_sqlite_t * h)
+{
+	h->excess = 0;
+	if (h->max_entries <= 0 || h->db.stmts == NULL)
+		return;
+	db_exec(&h->db, DB_COUNT_CMD);
+	h->excess = db_out_int(&h->db, DB_COUNT_CMD, 1) - h->max_entries;
+	db_reset(&h->db, DB_COUNT_CMD);
+}
+
+/// Delete at most `max` rows that are over the maximum count or age, call it
+/// inside a transaction. Returns true if there may be more to delete.
+static bool
+history_prune(history_sqlite_t * h, ssize_t max)
+{
+	if (h->db.stmts == NULL || (h->excess <= 0 && h->max_age <= 0))
+		return false;
+	int min_ts = (h->max_age > 0 ? (int)(get_current_ts() - h->max_age) : 0);
+	int cids[RPL_PRUNE_CLOSE];
+	char *cmds[RPL_PRUNE_CLOSE];
+	ssize_t count = 0;
+	if (max > RPL_PRUNE_CLOSE)
+		max = RPL_PRUNE_CLOSE;
+	db_in_int(&h->db, DB_GET_OLD_CMDS, 1, max);
+	while (count < max && db_exec(&h->db, DB_GET_OLD_CMDS) == DB_ROW) {
+		/// Rows are in age order, so the first one that is young enough ends the batch
+		if (h->excess <= count && db_out_int(&h->db, DB_GET_OLD_CMDS, 2) >= min_ts)
+			break;
+		cmds[count] = mem_strdup(h->mem, (const char *)db_out_txt(&h->db, DB_GET_OLD_CMDS, 3));
+		if (cmds[count] == NULL)
+			break;
+		cids[count] = db_out_int(&h->db, DB_GET_OLD_CMDS, 1);
+		count++;
+	}
+	db_reset(&h->db, DB_GET_OLD_CMDS);
+	for (ssize_t i = 0; i < count; i++) {
+		db_in_int(&h->db, DB_DEL_CMD_ID, 1, cids[i]);
+		db_exec(&h->db, DB_DEL_CMD_ID);
+		db_reset(&h->db, DB_DEL_CMD_ID);
+		int ts;
+		int cid;
+		db_update_stats(&h->db, cmds[i], 1, &ts, &cid);
+		if (h->trie != NULL)
+			trie_update(h->trie, cmds[i], ts, cid);
+		if (cid < 0)
+			h->changes++;       // the last row of the entry is gone
+		mem_free(h->mem, cmds[i]);
+	}
+	h->excess -= count;
+	debug_msg("pruned %zd history entries, %ld over the maximum\n", count, h->excess);
+	return (count == max);
+}
+
+//-------------------------------------------------------------
+// Background writer
+//
+// In async mode history_sqlite_push() only updates the trie and puts the
+// entry on a lock-free queue (and prunes old rows as in sync mode, if
+// the history has a maximum count or age). A writer thread with its own
+// connection commits everything that is queued in one WAL
+// transaction. A batch that cannot be committed (another session
+// holds the database) is tried again with the items queued since,
+// and only dropped, with a message, after RPL_WRITER_RETRIES
+// attempts. The mutex is only used to sleep and wake up, never
+// to access the queue. Reads that go to the database call
+// history_sync() first, which waits until the queue is drained.
+//-------------------------------------------------------------
+
+typedef struct writer_item_s {
+	struct writer_item_s *next;
+	long seq;
+	int ts;
+	char entry[];
+} writer_item_t;
+
+struct history_writer_s {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;        // signaled when items are queued or on stop
+	pthread_cond_t drained;     // signaled after each committed batch
+	_Atomic(writer_item_t *) queue; // pending items, most recent first
+	atomic_long committed;      // seq of the last committed item
+	long queued;                // seq of the last queued item (main thread only)
+	bool stop;
+	int pid;
+	struct db_t db;             // the writer's own connection
+	alloc_t *mem;
+};
+
+/// Commit `batch` (in push order) in one transaction, returns false if
+/// nothing was committed
+static bool
+writer_commit(history_writer_t * w, const writer_item_t * batch)
+{
+	/// Take the write lock up front, so no insert fails on a busy database
+	if (!db_exec_str(&w->db, "BEGIN IMMEDIATE"))
+		return false;
+	for (; batch != NULL; batch = batch->next) {
+		int cid;
+		db_push(&w->db, batch->entry, batch->ts, w->pid, &cid);
+	}
+	if (db_exec_str(&w->db, "COMMIT"))
+		return true;
+	db_exec_str(&w->db, "ROLLBACK");
+	return false;
+}
+
+static void *
+writer_main(void *arg)
+{
+	history_writer_t *w = (history_writer_t *) arg;
+	writer_item_t *batch = NULL;    // items to commit, in push order
+	writer_item_t *last = NULL;     // the most recent item of the batch
+	ssize_t batch_count = 0;
+	int attempts = 0;
+	while (true) {
+		pthread_mutex_lock(&w->lock);
+		while (atomic_load(&w->queue) == NULL && !w->stop && batch == NULL) {
+			pthread_cond_wait(&w->wake, &w->lock);
+		}
+		bool stop = w->stop;
+		pthread_mutex_unlock(&w->lock);
+		/// The queue is a stack, reverse it to append it in push order
+		writer_item_t *items = atomic_exchange(&w->queue, NULL);
+		writer_item_t *fifo = NULL;
+		writer_item_t *fifo_last = NULL;
+		while (items != NULL) {
+			writer_item_t *next = items->next;
+			items->next = fifo;
+			if (fifo == NULL)
+				fifo_last = items;
+			fifo = items;
+			items = next;
+			batch_count++;
+		}
+		if (fifo != NULL) {
+			if (batch == NULL)
+				batch = fifo;
+			else
+				last->next = fifo;
+			last = fifo_last;
+		}
+		if (batch == NULL) {
+			if (stop)
+				break;
+			continue;
+		}
+		if (!writer_commit(w, batch) && ++attempts < RPL_WRITER_RETRIES)
+			continue;
+		if (attempts >= RPL_WRITER_RETRIES)
+			debug_msg("history writer: dropped %zd entries that could not be committed\n",
+			          batch_count);
+		long last_seq = last->seq;
+		while (batch != NULL) {
+			writer_item_t *next = batch->next;
+			mem_free(w->mem, batch);
+			batch = next;
+		}
+		last = NULL;
+		batch_count = 0;
+		attempts = 0;
+		pthread_mutex_lock(&w->lock);
+		atomic_store(&w->committed, last_seq);
+		pthread_cond_broadcast(&w->drained);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+static history_writer_t *
+writer_start(alloc_t * mem, const char *fname)
+{
+	history_writer_t *w = mem_zalloc_tp(mem, history_writer_t);
+	if (w == NULL)
+		return NULL;
+	w->mem = mem;
+	w->pid = getpid();
+	atomic_init(&w->queue, NULL);
+	atomic_init(&w->committed, 0);
+	if (db_open(&w->db, fname) != DB_OK) {
+		sqlite3_close(w->db.dbh);
+		mem_free(mem, w);
+		return NULL;
+	}
+	/// Only the WAL is synced on commit, the database itself at checkpoints
+	db_exec_str(&w->db, "PRAGMA journal_mode = WAL;");
+	db_exec_str(&w->db, "PRAGMA synchronous = NORMAL;");
+	db_prepare_stmts(&w->db, db_queries, DB_STMT_CNT);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	pthread_cond_init(&w->drained, NULL);
+	if (pthread_create(&w->thread, NULL, &writer_main, w) != 0) {
+		debug_msg("cannot start history writer thread\n");
+		pthread_cond_destroy(&w->drained);
+		pthread_cond_destroy(&w->wake);
+		pthread_mutex_destroy(&w->lock);
+		db_free_stmts(&w->db);
+		db_close(&w->db);
+		mem_free(mem, w);
+		return NULL;
+	}
+	return w;
+}
+
+static bool
+writer_push(history_writer_t * w, const char *entry, int ts)
+{
+	ssize_t len = rpl_strlen(entry);
+	writer_item_t *item = (writer_item_t *) mem_malloc(w->mem,
+	                                                   ssizeof(writer_item_t) +
+	                                                   len + 1);
+	if (item == NULL)
+		return false;
+	item->seq = ++w->queued;
+	item->ts = ts;
+	rpl_memcpy(item->entry, entry, len + 1);
+	item->next = atomic_load(&w->queue);
+	while (!atomic_compare_exchange_weak(&w->queue, &item->next, item)) {
+	}
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	return true;
+}
+
+/// Wait until everything queued so far is committed
+static void
+writer_drain(history_writer_t * w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (atomic_load(&w->committed) < w->queued) {
+		pthread_cond_wait(&w->drained, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void
+writer_stop(history_writer_t * w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->drained);
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	db_free_stmts(&w->db);
+	db_close(&w->db);
+	mem_free(w->mem, w);
+}
+
+/// Forget the pending entries that the writer has committed by now
+static void
+history_prune_pending(history_sqlite_t * h)
+{
+	long committed = (h->writer == NULL ? LONG_MAX : atomic_load(&h->writer->committed));
+	ssize_t n = 0;
+	for (ssize_t i = 0; i < h->pending_count; i++) {
+		if (h->pending[i].seq <= committed) {
+			mem_free(h->mem, h->pending[i].entry);
+		} else {
+			h->pending[n++] = h->pending[i];
+		}
+	}
+	h->pending_count = n;
+}
+
+static void
+history_add_pending(history_sqlite_t * h, const char *entry, long seq)
+{
+	history_prune_pending(h);
+	if (h->pending_count >= h->pending_len) {
+		ssize_t newlen = (h->pending_len <= 0 ? 8 : h->pending_len * 2);
+		pending_entry_t *newpending =
+		    mem_realloc_tp(h->mem, pending_entry_t, h->pending, newlen);
+		if (newpending == NULL)
+			return;
+		h->pending = newpending;
+		h->pending_len = newlen;
+	}
+	h->pending[h->pending_count].seq = seq;
+	h->pending[h->pending_count].entry = mem_strdup(h->mem, entry);
+	h->pending_count++;
+}
+
+/// Does this session have `entry` already, in the database or still queued?
+/// (Then the writer only updates its timestamp.)
+static bool
+history_has_own(const history_sqlite_t * h, const char *entry)
+{
+	for (ssize_t i = 0; i < h->pending_count; i++) {
+		if (h->pending[i].entry != NULL && strcmp(h->pending[i].entry, entry) == 0)
+			return true;
+	}
+	db_in_txt(&h->db, DB_GET_CMD_ID, 1, entry);
+	db_in_int(&h->db, DB_GET_CMD_ID, 2, getpid());
+	db_in_hash(&h->db, DB_GET_CMD_ID, 3, entry);
+	bool found = (db_exec(&h->db, DB_GET_CMD_ID) == DB_ROW);
+	db_reset(&h->db, DB_GET_CMD_ID);
+	return found;
+}
+
+/// Make sure all pushed entries are in the database
+static void
+history_sync(const history_sqlite_t * h)
+{
+	if (h->writer != NULL)
+		writer_drain(h->writer);
+}
+
+static void
+history_stop_writer(history_sqlite_t * h)
+{
+	if (h->writer == NULL)
+		return;
+	writer_stop(h->writer);
+	h->writer = NULL;
+	history_prune_pending(h);
+}
+
+static void
+history_start_writer(history_sqlite_t * h)
+{
+	if (h->writer != NULL || h->fname == NULL || h->db.stmts == NULL)
+		return;
 	db_exec(&h->db, DB_MAX_ID_CMD);
-	int new_cid = db_out_int(&h->db, DB_MAX_ID_CMD, 1) + 1;
+	h->last_cid = db_out_int(&h->db, DB_MAX_ID_CMD, 1);
 	db_reset(&h->db, DB_MAX_ID_CMD);
+	h->writer = writer_start(h->mem, h->fname);
+}
 
-	db_in_int(&h->db, DB_INS_CMD, 1, new_cid);
-	db_in_int(&h->db, DB_INS_CMD, 2, get_current_ts());
-	db_in_int(&h->db, DB_INS_CMD, 3, getpid());
-	db_in_txt(&h->db, DB_INS_CMD, 4, entry);
-	db_exec(&h->db, DB_INS_CMD);
-	db_reset(&h->db, DB_INS_CMD);
-	return true;
+static void
+history_sqlite_set_async(history_t * hist, bool enable)
+{
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	h->async = enable;
+	if (enable)
+		history_start_writer(h);
+	else
+		history_stop_writer(h);
 }
 
-rpl_private void
-history_remove_last(history_t * h)
+static bool
+history_sqlite_push(history_t * hist, const char *entry)
 {
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	if (entry == NULL || rpl_strlen(entry) == 0 || h->db.stmts == NULL)
+		return false;
+	int ts = get_current_ts();
+	bool added = (h->writer != NULL && !history_has_own(h, entry));
+	if (h->writer != NULL && writer_push(h->writer, entry, ts)) {
+		/// The writer assigns the real cid, the provisional one only orders the trie
+		history_add_pending(h, entry, h->writer->queued);
+		trie_insert(h->mem, h->trie, entry, ts, ++h->last_cid);
+		if (added && h->max_entries > 0)
+			h->excess++;
+		/// Only rows of closed sessions are pruned, never the queued ones
+		if ((h->excess > 0 || h->max_age > 0) && db_exec_str(&h->db, "BEGIN IMMEDIATE")) {
+			history_prune(h, RPL_PRUNE_PUSH);
+			db_exec_str(&h->db, "COMMIT");
+		}
+		return added;
+	}
+	int cid;
+	/// One transaction for the entry and the rows it pushes out
+	db_exec_str(&h->db, "BEGIN TRANSACTION");
+	added = db_push(&h->db, entry, ts, getpid(), &cid);
+	trie_insert(h->mem, h->trie, entry, ts, cid);
+	if (added && h->max_entries > 0)
+		h->excess++;
+	history_prune(h, RPL_PRUNE_PUSH);
+	db_exec_str(&h->db, "COMMIT");
+	return added;
+}
+
+static void
+history_sqlite_remove_last(history_t * hist)
+{
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	if (h->db.stmts == NULL)
+		return;
+	history_sync(h);
 	db_exec(&h->db, DB_MAX_ID_CMD);
 	int last_cid = db_out_int(&h->db, DB_MAX_ID_CMD, 1);
 	db_reset(&h->db, DB_MAX_ID_CMD);
 
+	char *cmd = NULL;
+	db_in_int(&h->db, DB_GET_CID_CMD, 1, last_cid);
+	if (db_exec(&h->db, DB_GET_CID_CMD) == DB_ROW) {
+		cmd = mem_strdup(h->mem,
+		                 (const char *)db_out_txt(&h->db, DB_GET_CID_CMD, 1));
+	}
+	db_reset(&h->db, DB_GET_CID_CMD);
+
 	db_in_int(&h->db, DB_DEL_CMD_ID, 1, last_cid);
 	db_exec(&h->db, DB_DEL_CMD_ID);
 	db_reset(&h->db, DB_DEL_CMD_ID);
+	if (cmd == NULL)
+		return;
+	if (h->max_entries > 0)
+		h->excess--;
+	/// Other rows of the same command may still be there, so fetch its new key
+	int ts;
+	int cid;
+	db_update_stats(&h->db, cmd, 1, &ts, &cid);
+	if (h->trie != NULL)
+		trie_update(h->trie, cmd, ts, cid);
+	mem_free(h->mem, cmd);
 }
 
-rpl_private void
-history_clear(history_t * h)
+static void
+history_sqlite_clear(history_t * hist)
 {
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	if (h->db.stmts == NULL)
+		return;
+	history_sync(h);
 	db_exec(&h->db, DB_DEL_ALL);
 	db_reset(&h->db, DB_DEL_ALL);
+	db_exec(&h->db, DB_DEL_ALL_STATS);
+	db_reset(&h->db, DB_DEL_ALL_STATS);
+	trie_free(h->mem, h->trie);
+	h->trie = trie_node_new(h->mem, "", 0);
+	history_shared_clear(h);
+	history_shared_init(h);
+	history_count_excess(h);
 }
 
-rpl_private void
-history_close(history_t * h)
+static void
+history_sqlite_close(history_t * hist)
 {
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	if (h->db.stmts == NULL)
+		return;
+	/// Commit all queued entries before merging
+	history_stop_writer(h);
 	/// Get all double entries with pid == NULL and pid == getpid()
 	db_exec_str(&h->db, "BEGIN TRANSACTION");
 	db_in_int(&h->db, DB_GET_DBL_PIDS, 1, getpid());
@@ -346,6 +1504,11 @@ history_close(history_t * h)
 		db_in_int(&h->db, DB_DEL_CMD_ID, 1, cpid_cid);
 		db_exec(&h->db, DB_DEL_CMD_ID);
 		db_reset(&h->db, DB_DEL_CMD_ID);
+		/// The deleted row may have had the highest cid of the command
+		int ts;
+		int cid;
+		db_update_stats(&h->db, (const char *)db_out_txt(&h->db, DB_GET_DBL_PIDS, 5),
+		                0, &ts, &cid);
 	}
 	db_reset(&h->db, DB_GET_DBL_PIDS);
 	/// Set pid of history of the current process to NULL
@@ -353,17 +1516,29 @@ history_close(history_t * h)
 	db_exec(&h->db, DB_SET_PID_NULL);
 	db_reset(&h->db, DB_SET_PID_NULL);
 	db_exec_str(&h->db, "COMMIT");
+	/// The rows of this session can be pruned now as well. A large backlog
+	/// (e.g. after lowering the maximum) is left for the next sessions.
+	history_count_excess(h);
+	bool more = true;
+	for (int i = 0; more && i < RPL_PRUNE_CLOSE_BATCHES; i++) {
+		db_exec_str(&h->db, "BEGIN TRANSACTION");
+		more = history_prune(h, RPL_PRUNE_CLOSE);
+		db_exec_str(&h->db, "COMMIT");
+	}
+	db_exec_str(&h->db, "PRAGMA incremental_vacuum");
+	db_free_stmts(&h->db);
 	db_close(&h->db);
+	h->db.stmts = NULL;
+	h->db.dbh = NULL;
 }
 
-/// Parameter n is the history command index from latest to oldest, starting with 1
-/// NOTE need to free the returned string at the callsite with this backend
-rpl_private const char *
-history_get_with_prefix(const history_t * h, ssize_t n, const char *prefix)
+static char *
+history_fetch_with_prefix(const history_sqlite_t * h, ssize_t n, const char *prefix)
 {
-	if (n <= 0)
+	if (n <= 0 || h->db.stmts == NULL)
 		return NULL;
 	if (strlen(prefix) == 0) {
+		history_sync(h);
 		db_in_int(&h->db, DB_GET_PREV_CNT, 1, getpid());
 		db_exec(&h->db, DB_GET_PREV_CNT);
 		int cnt = db_out_int(&h->db, DB_GET_PREV_CNT, 1);
@@ -376,64 +1551,549 @@ history_get_with_prefix(const history_t * h, ssize_t n, const char *prefix)
 			db_reset(&h->db, DB_GET_PREV_CMD);
 			return NULL;
 		}
-		const char *entry =
+		char *entry =
 		    mem_strdup(h->mem,
 		               (const char *)db_out_txt(&h->db, DB_GET_PREV_CMD, 1));
 		db_reset(&h->db, DB_GET_PREV_CMD);
 		return entry;
 	}
-	char *prefix_param = mem_malloc(h->mem, rpl_strlen(prefix) + 3);
-	sprintf(prefix_param, "%s%%", prefix);
-	db_in_txt(&h->db, DB_GET_PREF_CNT, 1, prefix_param);
-	db_exec(&h->db, DB_GET_PREF_CNT);
-	int cnt = db_out_int(&h->db, DB_GET_PREF_CNT, 1);
-	db_reset(&h->db, DB_GET_PREF_CNT);
-	if (n < 0 || n > cnt) {
-		mem_free(h->mem, prefix_param);
+	/// The most recent entry is the hint, which is served from memory
+	if (n == 1 && h->trie != NULL) {
+		const char *entry = trie_lookup(h->trie, prefix);
+		return (entry == NULL ? NULL : mem_strdup(h->mem, entry));
+	}
+	history_sync(h);
+	/// A range scan of the summary table, no need to count the matches first
+	char *prefix_end = prefix_upper_bound(h->mem, prefix);
+	db_in_txt(&h->db, DB_GET_PREF_CMD, 1, prefix);
+	db_in_txt(&h->db, DB_GET_PREF_CMD, 2, prefix_end);
+	db_in_int(&h->db, DB_GET_PREF_CMD, 3, n - 1);
+	char *entry = NULL;
+	if (db_exec(&h->db, DB_GET_PREF_CMD) == DB_ROW) {
+		entry = mem_strdup(h->mem,
+		                   (const char *)db_out_txt(&h->db, DB_GET_PREF_CMD, 1));
+	}
+	db_reset(&h->db, DB_GET_PREF_CMD);
+	mem_free(h->mem, prefix_end);
+	return entry;
+}
+
+/// Parameter n is the history command index from latest to oldest, starting with 1
+static const char *
+history_sqlite_get_with_prefix(history_t * hist, ssize_t n, const char *prefix)
+{
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	/// The result is kept until the next call, as the entries of the file backend are
+	mem_free(h->mem, h->entry);
+	history_refresh(h);
+	h->entry = history_fetch_with_prefix(h, n, prefix);
+	return h->entry;
+}
+
+//-------------------------------------------------------------
+// History cursor
+//
+// Entries that were already visited are kept in the cursor, so
+// stepping to newer entries costs nothing. Older entries of the
+// own session (empty prefix) are fetched with a keyset predicate
+// on the (pid, ts, cid) index and interleaved with the entries
+// shared by other sessions, and older entries matching a prefix
+// are enumerated from the trie. Search cursors page through the
+// distinct commands from the most recent one and keep those that
+// match, so a search costs the rows up to its matches; older
+// matches of a rare text are looked up in the trigram index.
+//-------------------------------------------------------------
+
+struct history_sqlite_cursor_s {
+	history_cursor_t base;
+	const history_sqlite_t *h;
+	char *prefix;
+	ssize_t pos;                // current position (0 = none, 1 = most recent)
+	char **entries;             // visited entries, most recent first
+	ssize_t count;
+	ssize_t len;
+	ssize_t *visited;           // hash set of the visited entries: index + 1, 0 is empty
+	ssize_t visited_len;
+	bool done;                  // no older entries left
+	int ts;                     // key of the oldest visited entry (empty prefix)
+	int cid;
+	char **pending;             // entries still queued for the writer (empty prefix)
+	ssize_t pending_count;
+	ssize_t pending_idx;
+	trie_heap_t heap;           // pending subtrees (non-empty prefix)
+	sqlite3_stmt *search;       // page query of a search cursor
+	sqlite3_stmt *search_fts;   // trigram index query of a search cursor (or NULL)
+	char *search_param;         // text bound to the trigram index query
+	ssize_t scanned;            // rows of the page query so far
+};
+
+static bool
+history_cursor_is_pending(const history_sqlite_cursor_t * cur, const char *entry)
+{
+	for (ssize_t i = 0; i < cur->pending_count; i++) {
+		if (strcmp(cur->pending[i], entry) == 0)
+			return true;
+	}
+	return false;
+}
+
+static history_cursor_t *
+history_sqlite_cursor_new(const history_t * hist, const char *prefix)
+{
+	const history_sqlite_t *h = (const history_sqlite_t *)hist;
+	/// The shared entries are a cache, so bringing them up to date is fine here
+	history_refresh((history_sqlite_t *)h);
+	history_sqlite_cursor_t *cur = mem_zalloc_tp(h->mem, history_sqlite_cursor_t);
+	if (cur == NULL)
+		return NULL;
+	cur->base.backend = &history_sqlite_backend;
+	cur->h = h;
+	cur->prefix = mem_strdup(h->mem, prefix == NULL ? "" : prefix);
+	cur->ts = INT_MAX;
+	cur->cid = INT_MAX;
+	cur->heap.mem = h->mem;
+	if (cur->prefix == NULL) {
+		mem_free(h->mem, cur);
+		return NULL;
+	}
+	if (cur->prefix[0] != 0) {
+		const trie_node_t *node =
+		    (h->trie == NULL ? NULL : trie_find_prefix(h->trie, cur->prefix));
+		if (node == NULL || node->best == NULL)
+			cur->done = true;
+		else
+			trie_heap_push(&cur->heap, node, false);
+	} else if (h->pending_count > 0) {
+		/// Queued entries are the most recent ones of this session
+		cur->pending = mem_zalloc_tp_n(h->mem, char *, h->pending_count);
+		for (ssize_t i = h->pending_count - 1; cur->pending != NULL && i >= 0; i--) {
+			if (!history_cursor_is_pending(cur, h->pending[i].entry))
+				cur->pending[cur->pending_count++] =
+				    mem_strdup(h->mem, h->pending[i].entry);
+		}
+	}
+	return &cur->base;
+}
+
+/// Quote the search text as an FTS5 string, so it matches as a literal substring
+static char *
+fts_quote(alloc_t * mem, const char *text)
+{
+	stringbuf_t *sbuf = sbuf_new(mem);
+	if (sbuf == NULL)
 		return NULL;
+	sbuf_append_char(sbuf, '"');
+	for (const char *p = text; *p != 0; p++) {
+		if (*p == '"')
+			sbuf_append_char(sbuf, '"');
+		sbuf_append_char(sbuf, *p);
 	}
-	db_in_txt(&h->db, DB_GET_PREF_CMD, 1, prefix_param);
-	db_in_int(&h->db, DB_GET_PREF_CMD, 2, n - 1);
-	int ret = db_exec(&h->db, DB_GET_PREF_CMD);
-	if (ret != DB_ROW) {
-		db_reset(&h->db, DB_GET_PREF_CMD);
-		mem_free(h->mem, prefix_param);
+	sbuf_append_char(sbuf, '"');
+	return sbuf_free_dup(sbuf);
+}
+
+static history_cursor_t *
+history_sqlite_cursor_new_search(const history_t * hist, const char *search)
+{
+	const history_sqlite_t *h = (const history_sqlite_t *)hist;
+	history_sqlite_cursor_t *cur = mem_zalloc_tp(h->mem, history_sqlite_cursor_t);
+	if (cur == NULL)
+		return NULL;
+	cur->base.backend = &history_sqlite_backend;
+	cur->h = h;
+	cur->prefix = mem_strdup(h->mem, search == NULL ? "" : search);
+	cur->ts = INT_MAX;
+	cur->cid = INT_MAX;
+	cur->heap.mem = h->mem;
+	if (cur->prefix == NULL) {
+		mem_free(h->mem, cur);
 		return NULL;
 	}
-	const char *entry =
-	    mem_strdup(h->mem,
-	               (const char *)db_out_txt(&h->db, DB_GET_PREF_CMD, 1));
-	db_reset(&h->db, DB_GET_PREF_CMD);
-	mem_free(h->mem, prefix_param);
+	if (cur->prefix[0] == 0 || h->db.stmts == NULL) {
+		cur->done = true;
+		return &cur->base;
+	}
+	/// Searches cover all sessions, so queued entries must be committed first
+	history_sync(h);
+	if (sqlite3_prepare_v2(h->db.dbh, DB_SEARCH_SCAN, -1, &cur->search, 0) != SQLITE_OK) {
+		debug_msg("failed to prepare search: %s\n", sqlite3_errmsg(h->db.dbh));
+		cur->done = true;
+		return &cur->base;
+	}
+	/// The trigram index needs at least three bytes to match on
+	if (h->has_fts && strlen(cur->prefix) >= 3) {
+		cur->search_param = fts_quote(h->mem, cur->prefix);
+		if (cur->search_param != NULL
+		    && sqlite3_prepare_v2(h->db.dbh, DB_SEARCH_FTS, -1, &cur->search_fts, 0) != SQLITE_OK) {
+			sqlite3_finalize(cur->search_fts);
+			cur->search_fts = NULL;
+		}
+	}
+	return &cur->base;
+}
+
+static void
+history_sqlite_cursor_free(history_cursor_t * hcur)
+{
+	history_sqlite_cursor_t *cur = (history_sqlite_cursor_t *)hcur;
+	if (cur == NULL)
+		return;
+	alloc_t *mem = cur->h->mem;
+	for (ssize_t i = 0; i < cur->count; i++) {
+		mem_free(mem, cur->entries[i]);
+	}
+	mem_free(mem, cur->entries);
+	mem_free(mem, cur->visited);
+	for (ssize_t i = 0; i < cur->pending_count; i++) {
+		mem_free(mem, cur->pending[i]);
+	}
+	mem_free(mem, cur->pending);
+	mem_free(mem, cur->heap.items);
+	sqlite3_finalize(cur->search);
+	sqlite3_finalize(cur->search_fts);
+	mem_free(mem, cur->search_param);
+	mem_free(mem, cur->prefix);
+	mem_free(mem, cur);
+}
+
+static const char *
+history_sqlite_cursor_prefix(const history_cursor_t * hcur)
+{
+	const history_sqlite_cursor_t *cur = (const history_sqlite_cursor_t *)hcur;
+	return cur->prefix;
+}
+
+static ssize_t
+history_sqlite_cursor_pos(const history_cursor_t * hcur)
+{
+	const history_sqlite_cursor_t *cur = (const history_sqlite_cursor_t *)hcur;
+	return cur->pos;
+}
+
+static bool
+history_cursor_visited_eq(const void *arg, ssize_t index, const char *entry, uint64_t hash)
+{
+	rpl_unused(hash);
+	return (strcmp(((const history_sqlite_cursor_t *)arg)->entries[index], entry) == 0);
+}
+
+// slot of `entry` in the visited set, or the empty slot where it belongs
+static ssize_t
+history_cursor_visited_find(const history_sqlite_cursor_t * cur, const char *entry)
+{
+	return rpl_hset_find(cur->visited, cur->visited_len, entry, rpl_hash(entry),
+	                     &history_cursor_visited_eq, cur);
+}
+
+static bool
+history_cursor_is_visited(const history_sqlite_cursor_t * cur, const char *entry)
+{
+	return (cur->visited_len > 0 && cur->visited[history_cursor_visited_find(cur, entry)] != 0);
+}
+
+static bool
+history_cursor_append(history_sqlite_cursor_t * cur, char *entry)
+{
+	const history_sqlite_t *h = cur->h;
+	if (cur->count >= cur->len) {
+		ssize_t newlen = (cur->len <= 0 ? 16 : cur->len * 2);
+		char **newentries = mem_realloc_tp(h->mem, char *, cur->entries, newlen);
+		if (newentries == NULL) {
+			mem_free(h->mem, entry);
+			return false;
+		}
+		cur->entries = newentries;
+		cur->len = newlen;
+	}
+	if (2 * (cur->count + 1) >= cur->visited_len) {
+		if (!rpl_hset_reset(h->mem, &cur->visited, &cur->visited_len, cur->count + 1)) {
+			mem_free(h->mem, entry);
+			return false;
+		}
+		for (ssize_t i = 0; i < cur->count; i++) {
+			cur->visited[history_cursor_visited_find(cur, cur->entries[i])] = i + 1;
+		}
+	}
+	ssize_t j = history_cursor_visited_find(cur, entry);
+	cur->entries[cur->count++] = entry;
+	if (cur->visited[j] == 0)
+		cur->visited[j] = cur->count;
+	return true;
+}
+
+static bool
+history_cursor_fetch_search(history_sqlite_cursor_t * cur)
+{
+	const history_sqlite_t *h = cur->h;
+	ssize_t count = cur->count;
+	while (cur->count == count && !cur->done) {
+		/// Pages without a match skip ahead, once many are scanned the index is faster
+		bool fts = (cur->search_fts != NULL && cur->scanned >= DB_SEARCH_SCAN_MAX);
+		sqlite3_stmt *stmt = (fts ? cur->search_fts : cur->search);
+		ssize_t rows = 0;
+		sqlite3_bind_text(stmt, 1, (fts ? cur->search_param : cur->prefix), -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 2, cur->ts);
+		sqlite3_bind_int(stmt, 3, cur->cid);
+		sqlite3_bind_int(stmt, 4, DB_SEARCH_WINDOW);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			rows++;
+			cur->ts = sqlite3_column_int(stmt, 1);
+			cur->cid = sqlite3_column_int(stmt, 2);
+			if (sqlite3_column_int(stmt, 3) == 0)
+				continue;
+			char *entry = mem_strdup(h->mem, (const char *)sqlite3_column_text(stmt, 0));
+			if (entry == NULL || !history_cursor_append(cur, entry)) {
+				cur->done = true;
+				break;
+			}
+		}
+		sqlite3_reset(stmt);
+		cur->scanned += rows;
+		if (rows < DB_SEARCH_WINDOW)
+			cur->done = true;
+	}
+	return (cur->count > count);
+}
+
+
+/// Next older entry of the session: an own row or a shared entry, whichever is more recent
+static char *
+history_cursor_fetch_session(history_sqlite_cursor_t * cur)
+{
+	const history_sqlite_t *h = cur->h;
+	char *entry = NULL;
+	db_in_int(&h->db, DB_GET_PREV_KEY, 1, getpid());
+	db_in_int(&h->db, DB_GET_PREV_KEY, 2, cur->ts);
+	db_in_int(&h->db, DB_GET_PREV_KEY, 3, cur->cid);
+	bool own = (db_exec(&h->db, DB_GET_PREV_KEY) == DB_ROW);
+	int ts = (own ? db_out_int(&h->db, DB_GET_PREV_KEY, 2) : 0);
+	int cid = (own ? db_out_int(&h->db, DB_GET_PREV_KEY, 3) : 0);
+	ssize_t i = history_shared_lower_bound(h, cur->ts, cur->cid) - 1;
+	if (i >= 0 && (!own || h->shared[i].ts > ts
+	               || (h->shared[i].ts == ts && h->shared[i].cid > cid))) {
+		entry = mem_strdup(h->mem, h->shared[i].entry);
+		cur->ts = h->shared[i].ts;
+		cur->cid = h->shared[i].cid;
+	} else if (own) {
+		entry = mem_strdup(h->mem, (const char *)db_out_txt(&h->db, DB_GET_PREV_KEY, 1));
+		cur->ts = ts;
+		cur->cid = cid;
+	}
+	db_reset(&h->db, DB_GET_PREV_KEY);
 	return entry;
 }
 
+static bool
+history_cursor_fetch(history_sqlite_cursor_t * cur)
+{
+	const history_sqlite_t *h = cur->h;
+	char *entry = NULL;
+	if (cur->search != NULL) {
+		return history_cursor_fetch_search(cur);
+	} else if (cur->prefix[0] != 0) {
+		const char *cmd = trie_heap_next(&cur->heap);
+		if (cmd != NULL)
+			entry = mem_strdup(h->mem, cmd);
+	} else if (cur->pending_idx < cur->pending_count) {
+		entry = mem_strdup(h->mem, cur->pending[cur->pending_idx++]);
+	} else if (h->db.stmts != NULL) {
+		/// Skip rows of queued entries, which may have been committed meanwhile,
+		/// and shared entries that were visited already
+		do {
+			mem_free(h->mem, entry);
+			entry = history_cursor_fetch_session(cur);
+		} while (entry != NULL && (history_cursor_is_pending(cur, entry)
+		                           || history_cursor_is_visited(cur, entry)));
+	}
+	if (entry == NULL) {
+		cur->done = true;
+		return false;
+	}
+	return history_cursor_append(cur, entry);
+}
+
+static const char *
+history_sqlite_cursor_prev(history_cursor_t * hcur)
+{
+	history_sqlite_cursor_t *cur = (history_sqlite_cursor_t *)hcur;
+	if (cur->pos >= cur->count && (cur->done || !history_cursor_fetch(cur)))
+		return NULL;
+	return cur->entries[cur->pos++];
+}
+
+static const char *
+history_sqlite_cursor_next(history_cursor_t * hcur)
+{
+	history_sqlite_cursor_t *cur = (history_sqlite_cursor_t *)hcur;
+	if (cur->pos <= 1) {
+		cur->pos = 0;
+		return NULL;
+	}
+	cur->pos--;
+	return cur->entries[cur->pos - 1];
+}
+
+static const char *
+history_sqlite_cursor_entry(const history_cursor_t * hcur)
+{
+	const history_sqlite_cursor_t *cur = (const history_sqlite_cursor_t *)hcur;
+	return (cur->pos <= 0 ? NULL : cur->entries[cur->pos - 1]);
+}
+
+//-------------------------------------------------------------
+// import/export
+//-------------------------------------------------------------
+
+/// Imported entries become rows of closed sessions (with a NULL pid), or
+/// refresh the timestamp of such a row, all in one transaction
+static bool
+history_sqlite_import(history_t * hist, const history_item_t * items, ssize_t count)
+{
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	if (h->db.stmts == NULL)
+		return false;
+	history_sync(h);
+	int now = (int)get_current_ts();
+	int min_ts = (h->max_age > 0 ? now - (int)h->max_age : 0);
+	/// Entries that would be pruned right away are not inserted at all
+	ssize_t i = (h->max_entries > 0 && count > h->max_entries ? count - h->max_entries : 0);
+	db_exec_str(&h->db, "BEGIN TRANSACTION");
+	db_exec(&h->db, DB_MAX_ID_CMD);
+	int last_cid = db_out_int(&h->db, DB_MAX_ID_CMD, 1);
+	db_reset(&h->db, DB_MAX_ID_CMD);
+	/// The trigger indexing row by row is several times slower than one statement at the end
+	bool bulk_fts = (h->has_fts && count - i > RPL_IMPORT_BULK_FTS
+	                 && db_exec_str(&h->db, "drop trigger cmds_fts_ins"));
+	int first_cid = last_cid + 1;
+	for (; i < count; i++) {
+		const char *entry = items[i].entry;
+		int ts = (items[i].ts > 0 ? (int)items[i].ts : now);
+		if (ts < min_ts)
+			continue;
+		int cid = -1;
+		int old_ts = 0;
+		db_in_txt(&h->db, DB_GET_GLOBAL_CMD, 1, entry);
+		db_in_hash(&h->db, DB_GET_GLOBAL_CMD, 2, entry);
+		if (db_exec(&h->db, DB_GET_GLOBAL_CMD) == DB_ROW) {
+			cid = db_out_int(&h->db, DB_GET_GLOBAL_CMD, 1);
+			old_ts = db_out_int(&h->db, DB_GET_GLOBAL_CMD, 2);
+		}
+		db_reset(&h->db, DB_GET_GLOBAL_CMD);
+		if (cid < 0) {
+			cid = ++last_cid;
+			db_in_int(&h->db, DB_INS_CMD, 1, cid);
+			db_in_int(&h->db, DB_INS_CMD, 2, ts);
+			db_in_null(&h->db, DB_INS_CMD, 3);
+			db_in_txt(&h->db, DB_INS_CMD, 4, entry);
+			db_in_hash(&h->db, DB_INS_CMD, 5, entry);
+			db_exec(&h->db, DB_INS_CMD);
+			db_reset(&h->db, DB_INS_CMD);
+		} else if (ts > old_ts) {
+			db_in_int(&h->db, DB_UPD_TS, 1, ts);
+			db_in_int(&h->db, DB_UPD_TS, 2, cid);
+			db_exec(&h->db, DB_UPD_TS);
+			db_reset(&h->db, DB_UPD_TS);
+		}
+		db_push_stats(&h->db, entry, ts, cid);
+		trie_insert(h->mem, h->trie, entry, ts, cid);
+	}
+	if (bulk_fts) {
+		char query[128];
+		snprintf(query, sizeof(query),
+		         "insert into cmds_fts(rowid, cmd) select rowid, cmd from cmds where cid >= %d", first_cid);
+		db_exec_str(&h->db, query);
+		db_exec_str(&h->db, db_fts_tables[1]);
+	}
+	bool ok = db_exec_str(&h->db, "COMMIT");
+	history_count_excess(h);
+	return ok;
+}
+
+static void
+history_sqlite_for_each(const history_t * hist, history_item_fun_t * fun, void *arg)
+{
+	const history_sqlite_t *h = (const history_sqlite_t *)hist;
+	if (h->db.stmts == NULL)
+		return;
+	history_sync(h);
+	while (db_exec(&h->db, DB_GET_ALL_STATS) == DB_ROW) {
+		if (!fun((const char *)db_out_txt(&h->db, DB_GET_ALL_STATS, 1),
+		         db_out_int(&h->db, DB_GET_ALL_STATS, 2), arg))
+			break;
+	}
+	db_reset(&h->db, DB_GET_ALL_STATS);
+}
+
+static long
+history_sqlite_version(history_t * hist)
+{
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	history_refresh(h);
+	return h->changes;
+}
+
 //-------------------------------------------------------------
 // save/load history to file
 //-------------------------------------------------------------
 
-rpl_private void
-history_load_from(history_t * h, const char *fname, long max_entries)
+static void
+history_sqlite_load_from(history_t * hist, const char *fname, long max_entries)
 {
-	rpl_unused(max_entries);
+	history_sqlite_t *h = (history_sqlite_t *)hist;
 	h->fname = mem_strdup(h->mem, fname);
+	h->max_entries = (max_entries < 0 ? 0 : max_entries);
 	if (db_open(&h->db, h->fname) != DB_OK)
 		return;
+	db_enable_auto_vacuum(&h->db, h->max_entries > 0 || h->max_age > 0);
 	if (!create_tables(&h->db))
 		return;
+	h->has_fts = create_fts_tables(&h->db);
 	db_prepare_stmts(&h->db, db_queries, DB_STMT_CNT);
+	history_count_excess(h);
+	history_trie_load(h);
+	history_shared_init(h);
+	if (h->async)
+		history_start_writer(h);
 }
 
-/// function history_load() is not needed ...
-rpl_private void
-history_load(history_t * h)
+static void
+history_sqlite_set_max_age(history_t * hist, long max_age)
 {
-	rpl_unused(h);
+	history_sqlite_t *h = (history_sqlite_t *)hist;
+	h->max_age = (max_age < 0 ? 0 : max_age);
+	if (h->max_age > 0 && h->db.stmts != NULL)
+		db_enable_auto_vacuum(&h->db, true);
 }
 
-/// function history_save() is not needed with this backend
-rpl_private void
-history_save(const history_t * h)
+/// function history_sqlite_save() is not needed with this backend
+static void
+history_sqlite_save(history_t * hist)
 {
-	rpl_unused(h);
+	rpl_unused(hist);
 }
+
+static const history_backend_t history_sqlite_backend = {
+	"sqlite",
+	history_sqlite_new,
+	history_sqlite_free,
+	history_sqlite_load_from,
+	history_sqlite_save,
+	history_sqlite_close,
+	history_sqlite_clear,
+	history_sqlite_push,
+	history_sqlite_remove_last,
+	history_sqlite_set_async,
+	history_sqlite_set_max_age,
+	history_sqlite_get_with_prefix,
+	history_sqlite_import,
+	history_sqlite_for_each,
+	history_sqlite_version,
+	history_sqlite_cursor_new,
+	history_sqlite_cursor_new_search,
+	history_sqlite_cursor_free,
+	history_sqlite_cursor_prefix,
+	history_sqlite_cursor_pos,
+	history_sqlite_cursor_prev,
+	history_sqlite_cursor_next,
+	history_sqlite_cursor_entry,
+};
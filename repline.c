@@ -21,9 +21,10 @@
 #include "undo.c"
 #ifdef RPL_HIST_IMPL_SQLITE
 #include "history_sqlite.c"
-#else
-#include "history.c"
 #endif
+#include "history.c"
+#include "history_backend.c"
+#include "fuzzy.c"
 #include "completers.c"
 #include "completions.c"
 #include "term.c"
@@ -306,6 +307,86 @@ rpl_history_close(void)
 	history_close(env->history);
 }
 
+rpl_public bool
+rpl_history_import(const char *fname, rpl_history_format_t format)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL || fname == NULL)
+		return false;
+	return history_import(env->history, env->mem, fname, format);
+}
+
+rpl_public bool
+rpl_history_export(const char *fname, rpl_history_format_t format)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL || fname == NULL)
+		return false;
+	return history_export(env->history, env->mem, fname, format);
+}
+
+rpl_public bool
+rpl_set_history_backend(const char *name)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return false;
+	const history_backend_t *backend = history_backend_find(name);
+	if (backend == NULL)
+		return false;
+	if (env->history != NULL && history_backend(env->history) == backend)
+		return true;
+	history_t *h = history_new(env->mem, backend);
+	if (h == NULL)
+		return false;
+	if (env->history != NULL) {
+		history_save(env->history);
+		history_close(env->history);
+		history_free(env->history);
+	}
+	env->history = h;
+	history_set_async(h, env->history_async);
+	history_set_max_age(h, env->history_max_age * 24 * 60 * 60);
+	history_enable_prefetch(h, env->history_prefetch);
+	return true;
+}
+
+rpl_public long
+rpl_set_history_max_age(long days)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return 0;
+	long prev = env->history_max_age;
+	env->history_max_age = (days < 0 ? 0 : days);
+	history_set_max_age(env->history, env->history_max_age * 24 * 60 * 60);
+	return prev;
+}
+
+rpl_public bool
+rpl_enable_history_async(bool enable)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return false;
+	bool prev = env->history_async;
+	env->history_async = enable;
+	history_set_async(env->history, enable);
+	return prev;
+}
+
+rpl_public bool
+rpl_enable_history_prefetch(bool enable)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return false;
+	bool prev = env->history_prefetch;
+	env->history_prefetch = enable;
+	history_enable_prefetch(env->history, enable);
+	return prev;
+}
+
 rpl_public bool
 rpl_enable_completion_preview(bool enable)
 {
@@ -317,6 +398,29 @@ rpl_enable_completion_preview(bool enable)
 	return !prev;
 }
 
+rpl_public bool
+rpl_enable_completion_async(bool enable)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return false;
+	bool prev = env->complete_async;
+	env->complete_async = enable;
+	return prev;
+}
+
+rpl_public bool
+rpl_enable_fuzzy_matching(bool enable)
+{
+	rpl_env_t *env = rpl_get_env();
+	if (env == NULL)
+		return false;
+	bool prev = env->fuzzy;
+	env->fuzzy = enable;
+	completions_set_fuzzy(env->completions, enable);
+	return prev;
+}
+
 rpl_public bool
 rpl_enable_completion_always_quote(bool enable)
 {
@@ -688,7 +792,6 @@ rpl_term_color_rgb(bool foreground, uint32_t hcolor)
 // Readline with temporary completer and highlighter
 //-------------------------------------------------------------
 
-#if 0
 rpl_public char *
 rpl_readline_ex(const char *prompt_text,
                 rpl_completer_fun_t * completer, void *completer_arg,
@@ -717,7 +820,6 @@ rpl_readline_ex(const char *prompt_text,
 	rpl_set_default_highlighter(prev_highlighter, prev_highlighter_arg);
 	return res;
 }
-#endif
 
 //-------------------------------------------------------------
 // Initialize
@@ -734,6 +836,7 @@ rpl_env_free(rpl_env_t * env)
 	history_close(env->history);
 	history_free(env->history);
 	completions_free(env->completions);
+	cmdtable_free(env->commands);
 	bbcode_free(env->bbcode);
 	term_free(env->term);
 	tty_free(env->tty);
@@ -778,8 +881,9 @@ rpl_env_create(rpl_malloc_fun_t * _malloc, rpl_realloc_fun_t * _realloc,
 	// Initialize
 	env->tty = tty_new(env->mem, -1);   // can return NULL
 	env->term = term_new(env->mem, env->tty, false, false, -1);
-	env->history = history_new(env->mem);
+	env->history = history_new(env->mem, NULL);
 	env->completions = completions_new(env->mem);
+	env->commands = cmdtable_new(env->mem);
 	env->bbcode = bbcode_new(env->mem, env->term);
 #ifndef RPL_HIST_IMPL_SQLITE
 	env->hint_delay = 400;
@@ -118,6 +118,8 @@ Contents:
 
 /// Enable history. 
 /// Use a \a NULL filename to not persist the history. Use -1 for max_entries to get the default (200).
+/// The sqlite backend keeps all entries for a max_entries of -1 or 0; a positive max_entries (or
+/// `rpl_set_history_max_age`) makes it prune the oldest entries.
 	void rpl_set_history(const char *fname, long max_entries);
 
 /// Remove the last entry in the history. 
@@ -133,6 +135,46 @@ Contents:
 /// Close the history by merging pid-local to global history
 	void rpl_history_close();
 
+/// Formats of history files for rpl_history_import() and rpl_history_export().
+	typedef enum rpl_history_format_e {
+		RPL_HISTORY_REPLINE,    ///< the file backend format: one entry per line, with escapes
+		RPL_HISTORY_BASH,       ///< bash: one entry per line, with optional `#<time>` lines (and
+		                        ///< all lines up to the next one are one entry, as with `shopt -s lithist`)
+		RPL_HISTORY_ZSH,        ///< zsh, also with EXTENDED_HISTORY (`: <time>:<duration>;<entry>`)
+	} rpl_history_format_t;
+
+/// Add all entries of a history file, e.g. of bash or zsh, to the history in one go.
+/// Duplicates are merged first; imported entries count as history of earlier sessions.
+/// Returns false if the file cannot be read.
+	bool rpl_history_import(const char *fname, rpl_history_format_t format);
+
+/// Write all distinct history entries to a file, oldest first. Entries without
+/// a time (of the file backend) get the current time in the bash and zsh formats.
+/// Returns false if the file cannot be written.
+	bool rpl_history_export(const char *fname, rpl_history_format_t format);
+
+/// Select the history backend by name: "file" (a text file), or "sqlite" when the library
+/// is built with RPL_HIST_IMPL_SQLITE (then also the default). Use \a NULL for the default.
+/// Call it before rpl_set_history(); switching saves and closes the current history.
+/// Returns false if there is no such backend.
+	bool rpl_set_history_backend(const char *name);
+
+/// Disable or enable writing history entries on a background thread (disabled by default).
+/// Entries are then committed in batches and in-process reads see them immediately.
+/// Closing the history waits until all entries are written.
+/// Returns the previous setting.
+	bool rpl_enable_history_async(bool enable);
+
+/// Disable or enable looking up history hints and the first Ctrl-P entries ahead of time
+/// while waiting for input (disabled by default). The hint of the next key press then
+/// usually comes from memory. Returns the previous setting.
+	bool rpl_enable_history_prefetch(bool enable);
+
+/// Drop history entries that are older than the given number of days (0 for no limit, the default).
+/// Only the sqlite backend keeps timestamps; old entries are pruned a few at a time.
+/// Returns the previous setting.
+	long rpl_set_history_max_age(long days);
+
 /// \}
 
 //--------------------------------------------------------------
@@ -152,19 +194,56 @@ Contents:
 /// A completion callback that is called by repline when tab is pressed.
 /// It is passed a completion environment (containing the current input and
 /// the current cursor position),
-/// the current input up-to the cursor (`prefix`)
+/// the word under the cursor up-to the cursor (`prefix`)
 /// and the user given argument when the callback was set.
-/// When using completion transformers, like `rpl_complete_quoted_word`
-/// the `prefix` contains the word to be completed without escape characters or quotes.
-	// typedef void (rpl_completer_fun_t) (rpl_completion_env_t * cenv,
-	                                    // const char *prefix);
+/// The completions replace the whole word under the cursor.
+/// When completions are generated asynchronously (see `rpl_enable_completion_async`)
+/// the callback runs on a worker thread.
+	typedef void (rpl_completer_fun_t) (rpl_completion_env_t * cenv,
+	                                    const char *prefix);
 
 /// Set the default completion handler.
-/// @param completer  The completion function
+/// @param completer  The completion function, or NULL for file names
 /// @param arg        Argument passed to the \a completer.
 /// There can only be one default completion function, setting it again disables the previous one.
-/// The initial default completer uses `rpl_complete_filename`.
-	// void rpl_set_default_completer(rpl_completer_fun_t * completer, void *arg);
+/// It is called for the contexts that have no completer of their own (see `rpl_add_completer`).
+	void rpl_set_default_completer(rpl_completer_fun_t * completer, void *arg);
+
+/// The context of the word under the cursor
+	typedef enum rpl_completion_context_e {
+		RPL_CONTEXT_COMMAND,    ///< the first word of the input
+		RPL_CONTEXT_FLAG,       ///< a word that starts with `-`
+		RPL_CONTEXT_PATH,       ///< a word with a directory separator, or that starts with `~`
+		RPL_CONTEXT_VARIABLE,   ///< a word that starts with `$`
+		RPL_CONTEXT_ARGUMENT    ///< any other word
+	} rpl_completion_context_t;
+
+/// Add a completer for the words of a context; several completers of the same
+/// context are called in the order they were added.
+/// The results of a completer are cached while a line is edited: completing
+/// the same word after the same earlier input again does not call it, and
+/// neither does completing a longer word, which is served by the earlier
+/// results that start with it (or match it, with fuzzy matching). Completers
+/// should therefore only add completions that start with their `prefix`.
+/// Results are not cached for a completer that adds more than 10000 completions.
+/// Returns `false` if out of memory.
+	bool rpl_add_completer(rpl_completion_context_t context,
+	                       rpl_completer_fun_t * completer, void *arg);
+
+/// The context of the word being completed
+	rpl_completion_context_t rpl_completion_context(const rpl_completion_env_t * cenv);
+
+/// Complete the names of the executables on the `PATH`. This is not done by
+/// default; a shell-like application enables it for the first word with
+/// `rpl_add_completer(RPL_CONTEXT_COMMAND, &rpl_complete_command, NULL)`.
+/// The names are read once into a table that is looked up by prefix; a change
+/// of `PATH` or of one of its directories is noticed within a second and the
+/// table is then rebuilt in the background.
+	void rpl_complete_command(rpl_completion_env_t * cenv, const char *prefix);
+
+/// Rebuild the table of `rpl_complete_command` in the background, and drop
+/// the cached completions (for example after installing a program).
+	void rpl_invalidate_commands(void);
 
 /// Use this function to add a completion in a completion callback, which in turn
 /// usually is set by rpl_complete_word().
@@ -323,10 +402,10 @@ Contents:
 /// using a particular completion function and highlighter for this call only.
 /// both can be NULL in which case the defaults are used.
 /// @see rpl_readline(), rpl_set_prompt_marker(), rpl_set_default_completer(), rpl_set_default_highlighter().
-	// char *rpl_readline_ex(const char *prompt_text,
-	                      // rpl_completer_fun_t * completer, void *completer_arg,
-	                      // rpl_highlight_fun_t * highlighter,
-	                      // void *highlighter_arg);
+	char *rpl_readline_ex(const char *prompt_text,
+	                      rpl_completer_fun_t * completer, void *completer_arg,
+	                      rpl_highlight_fun_t * highlighter,
+	                      void *highlighter_arg);
 
 /// \}
 
@@ -370,6 +449,21 @@ Contents:
 /// Returns the previous setting.
 	bool rpl_enable_completion_preview(bool enable);
 
+/// Enable or disable generating completions on a worker thread (disabled by default).
+/// The editor stays responsive meanwhile: completions found so far are shown
+/// when it takes a while, and a key press stops the generation.
+/// The allocator (see `rpl_init_custom_alloc`) and the completers are then
+/// called from that thread, so they must be thread safe.
+/// Returns the previous setting.
+	bool rpl_enable_completion_async(bool enable);
+
+/// Disable or enable fuzzy matching (disabled by default): file name completion,
+/// `rpl_add_completions`, the history hint and the history search (ctrl-r) then
+/// match the characters of the input in order but not necessarily adjacent, and
+/// rank the matches so that consecutive characters and word starts come first.
+/// Returns the previous setting.
+	bool rpl_enable_fuzzy_matching(bool enable);
+
 /// Disable or enable always quote instead of escaping single characters (enabled by default)
 /// Returns the previous setting.
 	bool rpl_enable_completion_always_quote(bool enable);
@@ -430,7 +524,7 @@ Contents:
 /// like `rpl_complete_word` may modify the prefix (for example, unescape it).
 	const char *rpl_completion_input(rpl_completion_env_t * cenv, long *cursor);
 
-/// Get the completion argument passed to `rpl_set_completer`.
+/// Get the completion argument passed to `rpl_set_default_completer` or `rpl_add_completer`.
 	void *rpl_completion_arg(const rpl_completion_env_t * cenv);
 
 /// Do we have already some completions?
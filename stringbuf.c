@@ -88,7 +88,7 @@ char_column_width(const char *s, ssize_t n)
 	}
 }
 
-static ssize_t
+rpl_private ssize_t
 str_column_width_n(const char *s, ssize_t len)
 {
 	if (s == NULL || len <= 0)
@@ -121,6 +121,7 @@ rpl_private ssize_t sbuf_for_each_row(stringbuf_t * sbuf, ssize_t termw,
 rpl_private bool skip_csi_esc(const char *s, ssize_t len, ssize_t * esclen);    // used in term.c
 
 rpl_private ssize_t str_column_width(const char *s);
+rpl_private ssize_t str_column_width_n(const char *s, ssize_t len);
 rpl_private ssize_t str_prev_ofs(const char *s, ssize_t pos, ssize_t * cwidth);
 rpl_private ssize_t str_next_ofs(const char *s, ssize_t len, ssize_t pos,
                                  ssize_t * cwidth);
@@ -131,6 +131,79 @@ test_file_completion_apply(char *input, int pos, char *res, int line)
 }
 
 
+void
+test_file_display(char *input, char *replacement, char *display, int line)
+{
+	setup_ebuf(input, strlen(input), line);
+	completions_generate(env, eb, RPL_MAX_COMPLETIONS_TO_TRY);
+	ssize_t idx = completions_index_of(env->completions, replacement);
+	const char *res = (idx < 0 ? NULL : completions_get_display(env->completions, idx, NULL));
+	if (res != NULL && strcmp(res, display) == 0) {
+		printf("OK completion display: %s\n", display);
+	} else {
+		error_count++;
+		printf("ERR completion display: %s [%s]\n", (res != NULL ? res : "(none)"), display);
+	}
+	clear_ebuf();
+}
+
+
+void
+test_ls_colors_need_mode(bool need_mode, int line)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	ls_colors_t *lc = ls_colors_new(env->mem);
+	if (lc != NULL && ls_colors_need_mode(lc) == need_mode) {
+		printf("OK colors need mode: %d\n", need_mode);
+	} else {
+		error_count++;
+		printf("ERR colors need mode: %d\n", !need_mode);
+	}
+	ls_colors_free(lc);
+}
+
+
+// set the file colors and use them from the next completion on
+void
+set_ls_colors(const char *gnu, const char *bsd)
+{
+	setenv("CLICOLOR", "1", 1);
+	if (gnu != NULL)
+		setenv("LS_COLORS", gnu, 1);
+	else
+		unsetenv("LS_COLORS");
+	if (bsd != NULL)
+		setenv("LSCOLORS", bsd, 1);
+	else
+		unsetenv("LSCOLORS");
+	dircache_free(env->completions->dircache);
+	env->completions->dircache = NULL;
+}
+
+// complete arguments by the command before them
+void
+command_argument_completer(rpl_completion_env_t *cenv, const char *prefix)
+{
+	const char *input = rpl_completion_input(cenv, NULL);
+	const char *git[] = { "checkout", "cherry-pick", NULL };
+	const char *ls[] = { "changes.txt", NULL };
+	rpl_add_completions(cenv, prefix, (strncmp(input, "git ", 4) == 0 ? git : ls));
+}
+
+
+// the cached results of a completer are not used after other earlier words
+void
+test_completer_input(char *input, int res_count, char *res, int line)
+{
+	setup_ebuf(input, strlen(input), line);
+	completions_generate(env, eb, RPL_MAX_COMPLETIONS_TO_TRY);
+	check_completion(res_count, 0, res);
+	clear_ebuf();
+}
+
+
 // rpl_public char *
 // expand_envar(rpl_completion_env_t * cenv, const char *prefix)
 // {
@@ -155,6 +228,8 @@ setup(void)
 		sprintf(cmd, "touch testdir/file_%02d", i);
 		system(cmd);
 	}
+	system("mkdir -p testdir/colors/sub");
+	system("cd testdir/colors && touch a.tar.gz b.GZ notes.txt c.txt app.log README");
 }
 
 
@@ -194,6 +269,33 @@ main(void)
 		test_file_completion_apply("testdir/file", pos, "testdir/file_01", __LINE__);
 	}
 
+	// the last matching LS_COLORS entry wins, whether it is an extension or not
+	set_ls_colors("di=01;34:*.gz=01;31:*.tar.gz=01;35:*.txt=32:*notes.txt=35:*log=33:*.log=36:*README=04", NULL);
+	test_file_display("testdir/colors/s", "sub/", "[ansi-sgr=\"01;34\"][!pre]sub/[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/a", "a.tar.gz", "[ansi-sgr=\"01;35\"][!pre]a.tar.gz[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/b", "b.GZ", "[ansi-sgr=\"01;31\"][!pre]b.GZ[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/n", "notes.txt", "[ansi-sgr=\"35\"][!pre]notes.txt[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/c", "c.txt", "[ansi-sgr=\"32\"][!pre]c.txt[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/ap", "app.log", "[ansi-sgr=\"36\"][!pre]app.log[/pre][/]", __LINE__);
+	test_file_display("testdir/colors/R", "README", "[ansi-sgr=\"04\"][!pre]README[/pre][/]", __LINE__);
+	test_ls_colors_need_mode(false, __LINE__);
+	set_ls_colors("di=01;34:ex=01;32", NULL);
+	test_ls_colors_need_mode(true, __LINE__);
+
+	// BSD colors: foreground and background letters
+	set_ls_colors(NULL, "Gx");
+	test_file_display("testdir/colors/s", "sub/", "[ansi-color=14 ansi-bgcolor=256][!pre]sub/[/pre][/]", __LINE__);
+	test_ls_colors_need_mode(true, __LINE__);
+	set_ls_colors(NULL, "exxxxxxxxxxxxxxxxxexex");
+	test_ls_colors_need_mode(false, __LINE__);
+	unsetenv("CLICOLOR");
+
+	// completers may look at the words before the one they complete
+	rpl_add_completer(RPL_CONTEXT_ARGUMENT, &command_argument_completer, NULL);
+	test_completer_input("git ch", 2, "checkout", __LINE__);
+	test_completer_input("ls ch", 1, "changes.txt", __LINE__);
+	test_completer_input("git che", 2, "checkout", __LINE__);
+
 	print_summary();
 	// teardown();
 
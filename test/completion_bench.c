@@ -0,0 +1,84 @@
+#include "../repline.c"
+
+#include <time.h>
+
+/// Benchmark of collecting completions: the "hello repline" completer of
+/// example.c adds up to 100000 distinct candidates, and a second pass adds
+/// every candidate twice to exercise the duplicate check. Sorting is timed
+/// for the first 9 completions (as shown in the menu) and for all of them.
+/// Usage: completion_bench [candidates] [rounds]
+
+static alloc_t mem = { malloc, realloc, free };
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+bench_add(completions_t *cms, long candidates, long rounds, long repeat)
+{
+	char buf[32];
+	double t = now();
+	for (long r = 0; r < rounds; r++) {
+		completions_clear(cms);
+		cms->completer_max = candidates * repeat;
+		for (long k = 0; k < repeat; k++) {
+			for (long i = 0; i < candidates; i++) {
+				snprintf(buf, sizeof(buf), "hello repline %03ld", i + 1);
+				if (!completions_add(cms, buf, NULL, NULL))
+					break;
+			}
+		}
+	}
+	t = now() - t;
+	printf("  %7ld candidates x%ld: %9.3f ms per round, %7zd kept\n",
+	       candidates, repeat, 1e3 * t / (double)rounds,
+	       completions_count(cms));
+}
+
+static void
+bench_sort(completions_t *cms, long candidates, long rounds, ssize_t shown)
+{
+	char buf[32];
+	double t = 0;
+	for (long r = 0; r < rounds; r++) {
+		completions_clear(cms);
+		cms->completer_max = candidates;
+		for (long i = 0; i < candidates; i++) {
+			// not in sorted order
+			snprintf(buf, sizeof(buf), "Hello Repline %05ld", (i * 7919) % candidates);
+			completions_add(cms, buf, NULL, NULL);
+		}
+		double t0 = now();
+		completions_sort(cms);
+		for (ssize_t i = 0; i < shown && i < completions_count(cms); i++) {
+			completions_get_replacement(cms, i);
+		}
+		t += now() - t0;
+	}
+	printf("  %7ld candidates, sort first %7zd: %9.3f ms per round\n",
+	       candidates, shown, 1e3 * t / (double)rounds);
+}
+
+int
+main(int argc, char **argv)
+{
+	long candidates = (argc > 1 ? atol(argv[1]) : 100000);
+	long rounds = (argc > 2 ? atol(argv[2]) : 5);
+	completions_t *cms = completions_new(&mem);
+	printf("collect completions (%ld rounds):\n", rounds);
+	for (long n = RPL_MAX_COMPLETIONS_TO_TRY; n < candidates; n *= 10) {
+		bench_add(cms, n, rounds, 1);
+	}
+	bench_add(cms, candidates, rounds, 1);
+	bench_add(cms, candidates, rounds, 2);
+	printf("sort completions (%ld rounds):\n", rounds);
+	bench_sort(cms, candidates, rounds, 9);
+	bench_sort(cms, candidates, rounds, candidates);
+	completions_free(cms);
+	return 0;
+}
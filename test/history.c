@@ -0,0 +1,321 @@
+#include "../repline.c"
+
+int total_count = 0, error_count = 0;
+
+
+void
+print_summary(void)
+{
+	puts("-----------------------------------------------------------");
+	puts("\n===========================================================");
+	printf("%d out of %d tests failed\n", error_count, total_count);
+	puts("===========================================================\n");
+}
+
+
+// Parse `input` in the given format and check the deduplicated entries
+// against `expect` (a list of entry/timestamp pairs ending in NULL).
+void
+test_import(rpl_history_format_t format, const char *input, int line, ...)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	alloc_t *mem = rpl_get_env()->mem;
+	char *buf = mem_strdup(mem, input);
+	import_t imp = { NULL, 0, 0, mem };
+	bool ok;
+	if (format == RPL_HISTORY_BASH)
+		ok = import_bash(&imp, buf);
+	else if (format == RPL_HISTORY_ZSH)
+		ok = import_zsh(&imp, buf);
+	else
+		ok = import_repline(&imp, buf);
+	ok = ok && import_dedup(&imp);
+
+	bool err = !ok;
+	va_list args;
+	va_start(args, line);
+	ssize_t i = 0;
+	const char *entry;
+	while ((entry = va_arg(args, const char *)) != NULL) {
+		long ts = va_arg(args, long);
+		if (i >= imp.count) {
+			err = true;
+			printf("ERR missing entry %ld: \"%s\"\n", i, entry);
+		} else if (strcmp(imp.items[i].entry, entry) != 0 || imp.items[i].ts != ts) {
+			err = true;
+			printf("ERR entry %ld: \"%s\" %ld [\"%s\" %ld]\n", i,
+			       imp.items[i].entry, imp.items[i].ts, entry, ts);
+		} else {
+			printf("OK entry %ld: \"%s\" %ld\n", i, entry, ts);
+		}
+		i++;
+	}
+	va_end(args);
+	if (imp.count != i) {
+		err = true;
+		printf("ERR entries count: %ld [%ld]\n", imp.count, i);
+	}
+	if (err) error_count++;
+	mem_free(mem, imp.items);
+	mem_free(mem, buf);
+}
+
+
+static bool
+join_entry(const char *entry, long ts, void *arg)
+{
+	rpl_unused(ts);
+	stringbuf_t *sbuf = (stringbuf_t *)arg;
+	if (sbuf_len(sbuf) > 0)
+		sbuf_append(sbuf, "|");
+	sbuf_append(sbuf, entry);
+	return true;
+}
+
+// Export the entries (with a newline between `a` and `b`) and import them again
+void
+test_export_import(rpl_history_format_t format, int line)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	const char *fname = "export.hist";
+	alloc_t *mem = rpl_get_env()->mem;
+	const history_backend_t *backend = history_backend_find("file");
+	history_t *h = history_new(mem, backend);
+	history_load_from(h, NULL, -1);
+	history_push(h, "ls");
+	history_push(h, "echo a\necho b");
+	history_push(h, "#not a time");
+	history_push(h, "make");
+	bool ok = history_export(h, mem, fname, format);
+	history_free(h);
+	h = history_new(mem, backend);
+	history_load_from(h, NULL, -1);
+	ok = ok && history_import(h, mem, fname, format);
+	stringbuf_t *sbuf = sbuf_new(mem);
+	h->backend->for_each(h, &join_entry, sbuf);
+	const char *expect = "ls|echo a\necho b|#not a time|make";
+	if (!ok || strcmp(sbuf_string(sbuf), expect) != 0) {
+		error_count++;
+		printf("ERR entries: \"%s\" [\"%s\"]\n", sbuf_string(sbuf), expect);
+	} else {
+		printf("OK entries: \"%s\"\n", expect);
+	}
+	sbuf_free(sbuf);
+	history_free(h);
+	unlink(fname);
+}
+
+// Two sessions share a history file: removing an entry that is saved already
+// must keep what the other session appended meanwhile.
+void
+test_file_shared(int line)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	const char *fname = "shared.hist";
+	unlink(fname);
+	alloc_t *mem = rpl_get_env()->mem;
+	const history_backend_t *backend = history_backend_find("file");
+	history_t *a = history_new(mem, backend);
+	history_t *b = history_new(mem, backend);
+	history_load_from(a, fname, -1);
+	history_push(a, "a1");
+	history_save(a);
+	history_load_from(b, fname, -1);
+	history_push(b, "b1");
+	history_save(b);
+	history_push(a, "a2");
+	history_save(a);
+	history_remove_last(b);     // b1 is in the file already
+	history_push(b, "b2");
+	history_save(b);
+	history_free(a);
+	history_free(b);
+
+	history_t *h = history_new(mem, backend);
+	history_load_from(h, fname, -1);
+	stringbuf_t *sbuf = sbuf_new(mem);
+	h->backend->for_each(h, &join_entry, sbuf);
+	const char *expect = "a1|a2|b2";
+	if (strcmp(sbuf_string(sbuf), expect) != 0) {
+		error_count++;
+		printf("ERR entries: \"%s\" [\"%s\"]\n", sbuf_string(sbuf), expect);
+	} else {
+		printf("OK entries: \"%s\"\n", expect);
+	}
+	sbuf_free(sbuf);
+	history_free(h);
+	unlink(fname);
+}
+
+#ifdef RPL_HIST_IMPL_SQLITE
+static bool
+count_entry(const char *entry, long ts, void *arg)
+{
+	rpl_unused(entry);
+	rpl_unused(ts);
+	(*(ssize_t *)arg)++;
+	return true;
+}
+
+static ssize_t
+count_sqlite_entries(const char *fname)
+{
+	history_t *h = history_new(rpl_get_env()->mem, history_backend_find("sqlite"));
+	history_load_from(h, fname, -1);
+	ssize_t count = 0;
+	h->backend->for_each(h, &count_entry, &count);
+	history_close(h);
+	history_free(h);
+	return count;
+}
+
+// A database opened with the default maximum (-1) is never pruned, also not
+// when it holds more entries than a pruning history would keep.
+void
+test_sqlite_keeps_all(int line)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	const char *fname = "keep_all.db";
+	unlink(fname);
+	alloc_t *mem = rpl_get_env()->mem;
+	const ssize_t count = 12000;
+	history_item_t *items = mem_malloc_tp_n(mem, history_item_t, count);
+	char *texts = mem_malloc(mem, count * 16);
+	for (ssize_t i = 0; i < count; i++) {
+		snprintf(texts + 16 * i, 16, "cmd %zd", i);
+		items[i].entry = texts + 16 * i;
+		items[i].ts = 1000 + i;
+	}
+	history_t *h = history_new(mem, history_backend_find("sqlite"));
+	history_load_from(h, fname, -1);
+	h->backend->import(h, items, count);
+	history_close(h);
+	history_free(h);
+	mem_free(mem, texts);
+	mem_free(mem, items);
+
+	// push and close in a default configured session: pruning would run in both
+	h = history_new(mem, history_backend_find("sqlite"));
+	history_load_from(h, fname, -1);
+	history_push(h, "new 1");
+	history_push(h, "new 2");
+	history_close(h);
+	history_free(h);
+
+	ssize_t kept = count_sqlite_entries(fname);
+	if (kept != count + 2) {
+		error_count++;
+		printf("ERR entries kept: %zd [%zd]\n", kept, count + 2);
+	} else {
+		printf("OK entries kept: %zd\n", kept);
+	}
+	unlink(fname);
+	unlink("keep_all.db-wal");
+	unlink("keep_all.db-shm");
+}
+
+// The background writer must not lose entries while another session holds
+// the database longer than the busy timeout, and an asynchronous push
+// reports duplicates like a synchronous one.
+void
+test_sqlite_async_busy(int line)
+{
+	total_count++;
+	puts("-----------------------------------------------------------");
+	printf("test #%d at %s:%d\n", total_count, __FILE__, line);
+	const char *fname = "async_busy.db";
+	unlink(fname);
+	history_t *h = history_new(rpl_get_env()->mem, history_backend_find("sqlite"));
+	history_set_async(h, true);
+	history_load_from(h, fname, -1);
+	sqlite3 *other = NULL;
+	sqlite3_open(fname, &other);
+	bool err = (sqlite3_exec(other, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK);
+	bool added[3];
+	added[0] = history_push(h, "a");
+	added[1] = history_push(h, "b");
+	added[2] = history_push(h, "a");
+	usleep(1500 * 1000);        // the first commit of the writer times out meanwhile
+	sqlite3_exec(other, "COMMIT", NULL, NULL, NULL);
+	sqlite3_close(other);
+	if (!added[0] || !added[1] || added[2]) {
+		err = true;
+		printf("ERR push results: %d %d %d [1 1 0]\n", added[0], added[1], added[2]);
+	}
+	history_close(h);
+	history_free(h);
+	ssize_t count = count_sqlite_entries(fname);
+	if (count != 2) {
+		err = true;
+		printf("ERR entries committed: %zd [2]\n", count);
+	}
+	if (err)
+		error_count++;
+	else
+		printf("OK entries committed after a busy database\n");
+	unlink(fname);
+	unlink("async_busy.db-wal");
+	unlink("async_busy.db-shm");
+}
+#endif
+
+
+int
+main()
+{
+	// bash: plain lines, with optional `#<time>` lines before an entry
+	test_import(RPL_HISTORY_BASH, "ls\ncd /tmp\n", __LINE__,
+	            "ls", 0L, "cd /tmp", 0L, NULL);
+	test_import(RPL_HISTORY_BASH, "ls\n#100\nls -l\n#200\ncd /tmp\n", __LINE__,
+	            "ls", 0L, "ls -l", 100L, "cd /tmp", 200L, NULL);
+	// after a `#<time>` line, the lines up to the next one are one entry
+	test_import(RPL_HISTORY_BASH, "#100\nls\n#200\nfor i in 1 2\ndo echo $i\ndone\n", __LINE__,
+	            "ls", 100L, "for i in 1 2\ndo echo $i\ndone", 200L, NULL);
+	test_import(RPL_HISTORY_BASH, "#comment\n#12x\n\nls", __LINE__,
+	            "#comment", 0L, "#12x", 0L, "ls", 0L, NULL);
+
+	// zsh: extended history, continuation lines and metafied bytes
+	test_import(RPL_HISTORY_ZSH, ": 100:0;ls\n: 200:5;cd /tmp\n", __LINE__,
+	            "ls", 100L, "cd /tmp", 200L, NULL);
+	test_import(RPL_HISTORY_ZSH, "ls\n: bad;echo\n", __LINE__,
+	            "ls", 0L, ": bad;echo", 0L, NULL);
+	test_import(RPL_HISTORY_ZSH, ": 100:0;for i in 1 2\\\ndo echo $i\\\ndone\n: 200:0;ls\n", __LINE__,
+	            "for i in 1 2\ndo echo $i\ndone", 100L, "ls", 200L, NULL);
+	test_import(RPL_HISTORY_ZSH, ": 100:0;echo \x83\xa3\n", __LINE__,
+	            "echo \x83", 100L, NULL);
+
+	// repline: escaped newlines, `#` lines are comments
+	test_import(RPL_HISTORY_REPLINE, "# repline history\nls\necho a\\nb\n", __LINE__,
+	            "ls", 0L, "echo a\nb", 0L, NULL);
+
+	// duplicates keep their last position and latest timestamp
+	test_import(RPL_HISTORY_BASH, "#300\nls\n#100\nmake\n#200\nls\n", __LINE__,
+	            "make", 100L, "ls", 300L, NULL);
+	test_import(RPL_HISTORY_ZSH, ": 100:0;a\\\nb\n: 200:0;ls\n: 300:0;a\\\nb\n", __LINE__,
+	            "ls", 200L, "a\nb", 300L, NULL);
+
+	// exported entries read back the same
+	test_export_import(RPL_HISTORY_BASH, __LINE__);
+	test_export_import(RPL_HISTORY_ZSH, __LINE__);
+	test_export_import(RPL_HISTORY_REPLINE, __LINE__);
+
+	// concurrent sessions on one history file
+	test_file_shared(__LINE__);
+
+#ifdef RPL_HIST_IMPL_SQLITE
+	// the sqlite backend only prunes if asked to
+	test_sqlite_keeps_all(__LINE__);
+	test_sqlite_async_busy(__LINE__);
+#endif
+
+	print_summary();
+	return (error_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,218 @@
+#include "../repline.c"
+
+#include <time.h>
+
+/// Benchmarks of the history backends: loading a large file into the
+/// in-memory backend (history.c), and the same editing workload replayed
+/// against every compiled in backend.
+/// Usage: history_bench [megabytes of history file] [entries pushed per backend]
+
+static alloc_t mem = { malloc, realloc, free };
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// Write a history file of about `mb` megabytes with shell-like entries,
+/// some of them repeated and some with escaped characters
+static void
+write_history_file(const char *fname, long mb)
+{
+	static const char *cmds[] = { "git commit -m", "make -j8", "ls -la", "cd",
+		"grep -rn", "ssh host", "vim", "echo \"tab\there\"", "printf 'a\\nb'"
+	};
+	FILE *f = fopen(fname, "w");
+	stringbuf_t *sbuf = sbuf_new(&mem);
+	char entry[256];
+	long size = 0;
+	srand(42);
+	for (long i = 0; size < mb * 1024 * 1024; i++) {
+		long arg = (rand() % 4 == 0 ? rand() % 1000 : i);
+		snprintf(entry, sizeof(entry), "%s /path/to/some/file_%ld.c # %ld",
+		         cmds[rand() % 9], arg, i % 97);
+		history_write_entry(entry, f, sbuf);
+		size += sbuf_len(sbuf);
+	}
+	sbuf_free(sbuf);
+	fclose(f);
+}
+
+static void
+bench_load(const char *fname, long max_entries, bool mapped)
+{
+	history_file_t *h = (history_file_t *)history_new(&mem, &history_file_backend);
+	h->fname = mem_strdup(&mem, fname);
+	h->max = max_entries;
+	double t = now();
+	h->loading = true;
+	if (mapped)
+		history_load_mapped(h);
+	else
+		history_load_stream(h);
+	h->loading = false;
+	history_index_rebuild(h);
+	t = now() - t;
+	printf("  %-8s max %8ld: %7.3fs, %7zd entries from %zd records\n",
+	       (mapped ? "mmap" : "fgetc"), max_entries, t, history_count(h),
+	       h->journal_count);
+	history_free(&h->base);
+}
+
+//-------------------------------------------------------------
+// Workload replayed against every backend
+//-------------------------------------------------------------
+
+typedef struct bench_op_s {
+	const char *name;
+	double *lat;                // latency of every operation in seconds
+	ssize_t count;
+	double total;
+} bench_op_t;
+
+static void
+bench_op_start(bench_op_t * op, const char *name, ssize_t n)
+{
+	op->name = name;
+	op->lat = mem_malloc_tp_n(&mem, double, n);
+	op->count = 0;
+	op->total = 0;
+}
+
+static void
+bench_op_add(bench_op_t * op, double t)
+{
+	op->lat[op->count++] = t;
+	op->total += t;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static void
+bench_op_report(bench_op_t * op)
+{
+	qsort(op->lat, to_size_t(op->count), sizeof(double), cmp_double);
+	double p99 = (op->count > 0 ? op->lat[op->count * 99 / 100] : 0);
+	printf("  %-8s %8zd ops %12.0f ops/s   p99 %9.1f us\n", op->name, op->count,
+	       (op->total > 0 ? (double)op->count / op->total : 0), p99 * 1e6);
+	mem_free(&mem, op->lat);
+}
+
+/// Shell-like entry number `i`, about a third of them repeat earlier ones
+static void
+bench_entry(char *buf, size_t size, long i)
+{
+	static const char *cmds[] = { "git commit -m", "make -j8", "ls -la", "cd",
+		"grep -rn", "ssh host", "vim", "docker run --rm", "cargo build"
+	};
+	long arg = (i % 3 == 0 ? i / 7 : i);
+	snprintf(buf, size, "%s src/module_%ld/file_%ld.c", cmds[arg % 9], arg % 113, arg);
+}
+
+static void
+bench_backend(const history_backend_t * backend, long entries)
+{
+	char fname[64];
+	char entry[256];
+	char text[16];
+	snprintf(fname, sizeof(fname), "history_bench.%s", backend->name);
+	unlink(fname);
+	history_t *h = history_new(&mem, backend);
+	history_load_from(h, fname, entries);
+	printf("%s backend:\n", backend->name);
+	bench_op_t op;
+	srand(7);
+
+	// push every entry, as after each accepted line
+	bench_op_start(&op, "push", entries);
+	for (long i = 0; i < entries; i++) {
+		bench_entry(entry, sizeof(entry), i);
+		double t = now();
+		history_push(h, entry);
+		bench_op_add(&op, now() - t);
+	}
+	history_save(h);
+	bench_op_report(&op);
+
+	// hint for a few typed characters of an earlier entry
+	long hints = entries / 4;
+	bench_op_start(&op, "hint", hints);
+	for (long i = 0; i < hints; i++) {
+		bench_entry(entry, sizeof(entry), rand() % entries);
+		entry[2 + rand() % 12] = 0;
+		double t = now();
+		history_get_with_prefix(h, 1, entry);
+		bench_op_add(&op, now() - t);
+	}
+	bench_op_report(&op);
+
+	// walk back 20 entries with the up key, from an empty and a typed prefix
+	long walks = entries / 100 + 1;
+	bench_op_start(&op, "walk", walks * 20);
+	for (long i = 0; i < walks; i++) {
+		bench_entry(entry, sizeof(entry), rand() % entries);
+		entry[i % 2 == 0 ? 0 : 4] = 0;
+		double t = now();
+		history_cursor_t *cur = history_cursor_new(h, entry);
+		for (int j = 0; j < 20; j++) {
+			history_cursor_prev(cur);
+			double t1 = now();
+			bench_op_add(&op, t1 - t);
+			t = t1;
+		}
+		history_cursor_free(cur);
+	}
+	bench_op_report(&op);
+
+	// incremental search for a part of an entry, showing the first 10 matches
+	long searches = entries / 100 + 1;
+	bench_op_start(&op, "search", searches);
+	for (long i = 0; i < searches; i++) {
+		bench_entry(entry, sizeof(entry), rand() % entries);
+		ssize_t len = rpl_strlen(entry);
+		ssize_t n = 3 + rand() % 4;
+		ssize_t start = rand() % (len - n);
+		rpl_memcpy(text, entry + start, n);
+		text[n] = 0;
+		double t = now();
+		history_cursor_t *cur = history_cursor_new_search(h, text);
+		for (int j = 0; j < 10 && history_cursor_prev(cur) != NULL; j++) {
+		}
+		history_cursor_free(cur);
+		bench_op_add(&op, now() - t);
+	}
+	bench_op_report(&op);
+
+	history_close(h);
+	history_free(h);
+	unlink(fname);
+}
+
+int
+main(int argc, char **argv)
+{
+	long mb = (argc > 1 ? atol(argv[1]) : 50);
+	long entries = (argc > 2 ? atol(argv[2]) : 2000);
+	const char *fname = "history_bench.txt";
+	write_history_file(fname, mb);
+	printf("load a %ld MB history file:\n", mb);
+	bench_load(fname, RPL_MAX_HISTORY, false);
+	bench_load(fname, RPL_MAX_HISTORY, true);
+	bench_load(fname, 1000000, false);
+	bench_load(fname, 1000000, true);
+	unlink(fname);
+	printf("replay %ld entries:\n", entries);
+	for (ssize_t i = 0; history_backend_at(i) != NULL; i++) {
+		bench_backend(history_backend_at(i), entries);
+	}
+	return 0;
+}